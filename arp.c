@@ -32,18 +32,6 @@
  */
 _Pragma ("pack(push)") _Pragma ("pack(1)")
 
-struct EthernetHeader
-{
-  struct MacAddress dst;
-  struct MacAddress src;
-
-  /**
-   * See ETH_P-values.
-   */
-  uint16_t tag;
-};
-
-
 /**
  * ARP header for Ethernet-IPv4.
  */
@@ -115,25 +103,30 @@ struct arpProps {
 static struct arpProps arpTable[500];
 static unsigned int switchTableLength = 0;
 
-static void print_mac(const struct MacAddress *mac) {
-    fprintf(stderr, "%02X:%02X:%02X:%02X:%02X:%02X",
-            mac->mac[0],
-            mac->mac[1],
-            mac->mac[2],
-            mac->mac[3],
-            mac->mac[4],
-            mac->mac[5]);
-}
+/**
+ * Version of the layout of `struct ArpRecord`.
+ */
+#define ARP_SNAPSHOT_SCHEMA 1
 
-static void print_mac1(const struct MacAddress *mac) {
-    print("%02X:%02X:%02X:%02X:%02X:%02X",
-          mac->mac[0],
-          mac->mac[1],
-          mac->mac[2],
-          mac->mac[3],
-          mac->mac[4],
-          mac->mac[5]);
-}
+/**
+ * Entry of #arpTable in a snapshot.
+ */
+struct ArpRecord
+{
+  struct MacAddress mac;
+
+  /**
+   * Interface number, in host byte order, 0 if unknown.
+   */
+  uint16_t ifc_num;
+
+  struct in_addr ip;
+};
+
+/**
+ * Did #arpTable change since the last snapshot?
+ */
+static int arpDirty;
 
 static int ipcmp(const struct in_addr *ip1, const struct in_addr *ip2) {
     return memcmp(ip1, ip2, sizeof(struct in_addr));
@@ -199,42 +192,11 @@ forward_to (struct Interface *dst,
             const void *frame,
             size_t frame_size)
 {
-  char iob[frame_size + sizeof (struct GLAB_MessageHeader)];
-  struct GLAB_MessageHeader hdr;
-
   if (frame_size > dst->mtu)
     abort ();
-  hdr.size = htons (sizeof (iob));
-  hdr.type = htons (dst->ifc_num);
-  memcpy (iob,
-          &hdr,
-          sizeof (hdr));
-  memcpy (&iob[sizeof (hdr)],
-          frame,
-          frame_size);
-  write_all (STDOUT_FILENO,
-             iob,
-             sizeof (iob));
-}
-
-static void
-print_ip(const struct in_addr *ip) {
-    char buf[INET_ADDRSTRLEN];
-    fprintf(stderr, "\n%s",
-            inet_ntop(AF_INET,
-                      ip,
-                      buf,
-                      sizeof(buf)));
-}
-
-static void
-print_ip1(const struct in_addr *ip) {
-    char buf[INET_ADDRSTRLEN];
-    print("\n%s",
-          inet_ntop(AF_INET,
-                    ip,
-                    buf,
-                    sizeof(buf)));
+  output_frame (dst->ifc_num,
+                frame,
+                frame_size);
 }
 
 struct ArpEntry {
@@ -261,75 +223,45 @@ static bool isIpInCache(struct in_addr ip) {
 
 static void printArpCache() {
   for (int i = 0; i < cacheSize; i++) {
-    struct ArpEntry entry = arpCache[i];
-
-    char entryIp[INET_ADDRSTRLEN];
-    print("%s: %02x:%02x:%02x:%02x:%02x:%02x\n",
-          inet_ntop(AF_INET, &(entry.ip), entryIp, sizeof(entryIp)),
-          entry.mac.mac[0],
-          entry.mac.mac[1],
-          entry.mac.mac[2],
-          entry.mac.mac[3],
-          entry.mac.mac[4],
-          entry.mac.mac[5]);
+    print_add_ipv4(arpCache[i].ip);
+    print_add_str(": ");
+    print_add_mac(&arpCache[i].mac);
+    print_add_char('\n');
   }
+  print_flush();
 }
 
 /**
- * Parse and process frame received on @a ifc.
+ * Process frame @a f received on @a ifc.
  *
  * @param ifc interface we got the frame on
- * @param frame raw frame data
- * @param frame_size number of bytes in @a frame
+ * @param f the frame
  */
 static void
 parse_frame (struct Interface *ifc,
-             const void *frame,
-             size_t frame_size)
+             const struct GLAB_Frame *f)
 {
-  struct EthernetHeader ethernetHeader;
-  const char *cframe = frame;
+  const void *frame = f->data;
+  size_t frame_size = f->size;
 
-  if (frame_size < sizeof (ethernetHeader))
+  if (frame_size < sizeof (struct EthernetHeader))
   {
     fprintf (stderr,
              "Malformed frame\n");
     return;
   }
-  memcpy (&ethernetHeader,
-          frame,
-          sizeof (ethernetHeader));
   /* DO WORK HERE */
 
-  fprintf(stderr, "\n");
-    const uint8_t *fb = frame;
-    
-    for (int i = 0; i < frame_size; i++) {
-        fprintf(stderr, "%02X:", fb[i]);
-    };
-
-    fprintf(stderr, "\n");
-
     struct ArpHeaderEthernetIPv4 *arpHeader = frame;
 
-    fprintf(stderr, "ip: ");
-    print_ip(&arpHeader[0].target_pa);
-    fprintf(stderr, "\n");
-    // fprintf(stderr, "mac dest: %08X\n", (*ifc).ip);
-    print_mac(&arpHeader[0].dst);
-    fprintf(stderr, "mac src: ");
-    print_mac(&arpHeader[0].src);
-
-    fprintf(stderr, "source mac: ");
-    print_mac(&arpHeader[0].sender_ha);
-    // fprintf(stderr, "source ip: %08X\n", arpHeader[0].sender_pa);
-    fprintf(stderr, "dest mac: ");
-    print_mac(&arpHeader[0].target_ha);
-    // fprintf(stderr, "dest ip: %08X\n", arpHeader[0].target_pa);
+    TRACE (TRACE_LEVEL_FRAME, TRACE_ARP_IN, ifc->ifc_num,
+           ntohs (arpHeader[0].oper),
+           trace_ipv4 (arpHeader[0].target_pa));
 
         arpTable[switchTableLength].mac = arpHeader[0].sender_ha;
         arpTable[switchTableLength].ip = arpHeader[0].sender_pa;
         switchTableLength++;
+        arpDirty = 1;
 
     if (0 == ipcmp(&arpHeader[0].target_pa, &(*ifc).ip) && arpHeader[0].oper == 0x0100) {
       const uint8_t *frame1 = frame;
@@ -345,14 +277,9 @@ parse_frame (struct Interface *ifc,
       memcpy(&frame2[28], &(*ifc).ip, 4);
       memcpy(&frame2[32], &frame1[32], 10);
       
-      const uint8_t *frame3 = frame2;
-      fprintf(stderr, "\n");
-      for (int i = 0; i < frame_size; i++) {
-          fprintf(stderr, "%02X:",
-                  frame3[i]);
-      };
-      fprintf(stderr, "\n");
-
+      TRACE (TRACE_LEVEL_EVENT, TRACE_ARP_REPLY, ifc->ifc_num,
+             trace_ipv4 (ifc->ip),
+             trace_ipv4 (arpHeader[0].sender_pa));
       forward_to(ifc, frame2, frame_size);
       return;
     }
@@ -424,22 +351,17 @@ parse_frame (struct Interface *ifc,
 }
 
 /**
- * Process frame received from @a interface.
+ * Process frame @a f received from @a f->interface.
  *
- * @param interface number of the interface on which we received @a frame
- * @param frame the frame
- * @param frame_size number of bytes in @a frame
+ * @param f the frame, parsed by loop.c
  */
 static void
-handle_frame (uint16_t interface,
-              const void *frame,
-              size_t frame_size)
+handle_frame (const struct GLAB_Frame *f)
 {
-  if (interface > num_ifc)
+  if (f->interface > num_ifc)
     abort ();
-  parse_frame (&gifc[interface - 1],
-               frame,
-               frame_size);
+  parse_frame (&gifc[f->interface - 1],
+               f);
 }
 
 /**
@@ -565,15 +487,15 @@ process_cmd_arp ()
 
     fprintf(stderr, "\n%d\n", switchTableLength);
     for (int i = 0; i < switchTableLength; i++) {
-        print_ip(&arpTable[i].ip);
-        fprintf(stderr, " -> ");
-        print_mac(&arpTable[i].mac);
-        fprintf(stderr, " (%s)\n", arpTable[i].ifc->name);
-        print_ip1(&arpTable[i].ip);
-        print(" -> ");
-        print_mac1(&arpTable[i].mac);
-        print(" (%s)\n", arpTable[i].ifc->name);
+        print_add_char('\n');
+        print_add_ipv4(arpTable[i].ip);
+        print_add_str(" -> ");
+        print_add_mac(&arpTable[i].mac);
+        print_add_str(" (");
+        print_add_str((NULL == arpTable[i].ifc) ? "?" : arpTable[i].ifc->name);
+        print_add_str(")\n");
     }
+    print_flush();
 }
 
 
@@ -733,6 +655,16 @@ handle_control (char *cmd,
   if (0 == strcasecmp (tok,
                        "arp"))
     process_cmd_arp ();
+  else if (0 == strcasecmp (tok,
+                            "queues"))
+    output_print_stats ();
+  else if (0 == strcasecmp (tok,
+                            "trace"))
+    trace_command ();
+  else if (0 == strcasecmp (tok,
+                            "perf"))
+    perf_command (strtok (NULL,
+                          " "));
   else
     fprintf (stderr,
              "Unsupported command `%s'\n",
@@ -740,6 +672,97 @@ handle_control (char *cmd,
 }
 
 
+/**
+ * Interface MACs, the binding of our snapshots: a snapshot is only
+ * restored for the same interfaces.
+ *
+ * @param[out] macs array of #num_ifc MACs
+ */
+static void
+arp_binding (struct MacAddress *macs)
+{
+  for (unsigned int i=0;i<num_ifc;i++)
+    macs[i] = gifc[i].mac;
+}
+
+
+/**
+ * Write #arpTable to its snapshot if it changed.
+ */
+static void
+arp_save ()
+{
+  struct MacAddress macs[num_ifc];
+  struct ArpRecord rec[sizeof (arpTable) / sizeof (arpTable[0])];
+  unsigned int count = switchTableLength;
+
+  if (! arpDirty)
+    return;
+  if (count > sizeof (arpTable) / sizeof (arpTable[0]))
+    count = sizeof (arpTable) / sizeof (arpTable[0]);
+  arp_binding (macs);
+  memset (rec,
+          0,
+          sizeof (rec));
+  for (unsigned int i = 0; i < count; i++)
+    {
+      rec[i].mac = arpTable[i].mac;
+      rec[i].ip = arpTable[i].ip;
+      rec[i].ifc_num = (NULL == arpTable[i].ifc) ? 0 : arpTable[i].ifc->ifc_num;
+    }
+  if (0 == snapshot_save ("arp",
+                          ARP_SNAPSHOT_SCHEMA,
+                          macs,
+                          sizeof (macs),
+                          rec,
+                          sizeof (struct ArpRecord),
+                          count))
+    arpDirty = 0;
+}
+
+
+/**
+ * Fill #arpTable from its snapshot, if there is a valid one for our
+ * interfaces, and start writing snapshots.
+ */
+static void
+arp_restore ()
+{
+  struct MacAddress macs[num_ifc];
+  struct GLAB_Snapshot snap;
+
+  if (! snapshot_start (&arp_save))
+    return;
+  arp_binding (macs);
+  if (0 != snapshot_open (&snap,
+                          "arp",
+                          ARP_SNAPSHOT_SCHEMA,
+                          macs,
+                          sizeof (macs),
+                          sizeof (struct ArpRecord)))
+    return;
+  for (size_t i = 0;
+       (i < snap.count) &&
+       (switchTableLength < sizeof (arpTable) / sizeof (arpTable[0]));
+       i++)
+    {
+      struct ArpRecord rec;
+
+      memcpy (&rec,
+              (const char *) snap.records + i * sizeof (rec),
+              sizeof (rec));
+      if (rec.ifc_num > num_ifc)
+        continue;
+      arpTable[switchTableLength].mac = rec.mac;
+      arpTable[switchTableLength].ip = rec.ip;
+      arpTable[switchTableLength].ifc
+        = (0 == rec.ifc_num) ? NULL : &gifc[rec.ifc_num - 1];
+      switchTableLength++;
+    }
+  snapshot_close (&snap);
+}
+
+
 /**
  * Handle MAC information @a mac
  *
@@ -753,6 +776,8 @@ handle_mac (uint16_t ifc_num,
   if (ifc_num > num_ifc)
     abort ();
   gifc[ifc_num - 1].mac = *mac;
+  if (ifc_num == num_ifc)
+    arp_restore (); /* all MACs known */
 }
 
 
@@ -0,0 +1,1511 @@
+/*
+     This file (was) part of GNUnet.
+     Copyright (C) 2018 Christian Grothoff
+
+     GNUnet is free software: you can redistribute it and/or modify it
+     under the terms of the GNU Affero General Public License as published
+     by the Free Software Foundation, either version 3 of the License,
+     or (at your option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Affero General Public License for more details.
+
+     You should have received a copy of the GNU Affero General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file emulator.c
+ * @brief Runs many child programs (switch, router, ...) at once and
+ *        wires their interfaces together with in-memory virtual
+ *        links, speaking the same protocol as network-driver.
+ *        Emulated hosts attached to free ports generate UDP traffic,
+ *        and we report per-node throughput and per-flow latency.
+ *        Needs neither root nor network interfaces.
+ *
+ * The topology file has one statement per line ('#' starts a comment):
+ *
+ *   node NAME PROGRAM [ARG...]      one port per ARG, e.g. "eth0"
+ *   link NODE:PORT NODE:PORT        connect two ports
+ *   host NAME NODE:PORT [IP/LEN [GW]]  emulated end system
+ *   flow SRC DST [FPS [SIZE]]       UDP flow between hosts,
+ *                                   FPS 0 (default) means "max"
+ *
+ * Lines "NODE COMMAND" on our stdin are passed to NODE as commands.
+ */
+#include "glab.h"
+#include <poll.h>
+#include <sys/wait.h>
+
+
+/**
+ * Maximum size of a message.
+ */
+#define MAX_SIZE (65536 + sizeof (struct GLAB_MessageHeader))
+
+/**
+ * Size of the per-node buffer for data to be written to the node.
+ */
+#define WBUF_SIZE (256 * 1024)
+
+/**
+ * Maximum number of frames a saturating flow injects per round.
+ */
+#define BURST 32
+
+/**
+ * EtherType numbers.
+ */
+#define ETH_P_IPV4 0x0800
+#define ETH_P_ARP 0x0806
+
+/**
+ * UDP port used for generated traffic.
+ */
+#define GEN_PORT 7071
+
+/**
+ * Identifies generated frames.
+ */
+#define GEN_MAGIC 0x474c4142
+
+/**
+ * Size of Ethernet + IPv4 + UDP headers.
+ */
+#define HDR_SIZE (14 + 20 + 8)
+
+/**
+ * Smallest frame we generate: headers plus `struct GenPayload`.
+ */
+#define MIN_FRAME (HDR_SIZE + sizeof (struct GenPayload))
+
+/**
+ * Largest frame we generate.
+ */
+#define MAX_FRAME 1514
+
+
+_Pragma("pack(push)") _Pragma("pack(1)")
+
+/**
+ * Payload of generated UDP datagrams.
+ */
+struct GenPayload
+{
+  uint32_t magic;
+  uint32_t flow;
+  uint64_t seq;
+  uint64_t timestamp_ns;
+};
+
+_Pragma("pack(pop)")
+
+
+/**
+ * What is at the other end of a port?
+ */
+struct Endpoint
+{
+  enum
+  {
+    EP_NONE = 0,
+    EP_NODE,
+    EP_HOST
+  } type;
+
+  /**
+   * Index of the node or host.
+   */
+  unsigned int idx;
+
+  /**
+   * Port number at the node (counting from 1), for #EP_NODE.
+   */
+  uint16_t port;
+};
+
+
+/**
+ * A child program.
+ */
+struct Node
+{
+  char *name;
+
+  /**
+   * NULL-terminated argument vector for execvp().
+   */
+  char **argv;
+
+  pid_t pid;
+
+  /**
+   * Child's stdin, we write here.
+   */
+  int in_fd;
+
+  /**
+   * Child's stdout, we read here.
+   */
+  int out_fd;
+
+  /**
+   * Number of interfaces of the child.
+   */
+  unsigned int num_ports;
+
+  /**
+   * What each port is connected to, array of @e num_ports.
+   */
+  struct Endpoint *peer;
+
+  /**
+   * Data read from the child.
+   */
+  unsigned char *rbuf;
+
+  size_t rbuf_len;
+
+  /**
+   * Data to be written to the child, from @e wbuf_off
+   * to @e wbuf_len.
+   */
+  unsigned char *wbuf;
+
+  size_t wbuf_off;
+
+  size_t wbuf_len;
+
+  uint64_t frames_in;
+  uint64_t frames_out;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+
+  /**
+   * Frames lost because the child did not keep up.
+   */
+  uint64_t drops;
+};
+
+
+/**
+ * An emulated end system.
+ */
+struct Host
+{
+  char *name;
+
+  struct MacAddress mac;
+
+  struct in_addr ip;
+
+  struct in_addr netmask;
+
+  struct in_addr gw;
+
+  /**
+   * Port we are attached to.
+   */
+  struct Endpoint attach;
+
+  uint64_t frames_in;
+};
+
+
+/**
+ * Generated traffic between two hosts.
+ */
+struct Flow
+{
+  unsigned int src;
+
+  unsigned int dst;
+
+  /**
+   * Frames per second, 0 for as fast as the topology takes them.
+   */
+  double fps;
+
+  size_t frame_size;
+
+  /**
+   * Resolved next hop MAC.
+   */
+  struct MacAddress next_hop;
+
+  /**
+   * Non-zero once @e next_hop is known.
+   */
+  int resolved;
+
+  /**
+   * When to send the next frame.
+   */
+  uint64_t next_ns;
+
+  uint64_t sent;
+  uint64_t received;
+  uint64_t tx_drops;
+  uint64_t lat_sum;
+  uint64_t lat_min;
+  uint64_t lat_max;
+};
+
+
+static struct Node *nodes;
+static unsigned int num_nodes;
+
+static struct Host *hosts;
+static unsigned int num_hosts;
+
+static struct Flow *flows;
+static unsigned int num_flows;
+
+
+/**
+ * Return monotonic time in ns.
+ */
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC,
+                 &ts);
+  return (uint64_t) ts.tv_sec * 1000000000LLU + ts.tv_nsec;
+}
+
+
+static struct Node *
+find_node (const char *name)
+{
+  for (unsigned int i=0;i<num_nodes;i++)
+    if (0 == strcmp (name,
+                     nodes[i].name))
+      return &nodes[i];
+  return NULL;
+}
+
+
+static struct Host *
+find_host (const char *name)
+{
+  for (unsigned int i=0;i<num_hosts;i++)
+    if (0 == strcmp (name,
+                     hosts[i].name))
+      return &hosts[i];
+  return NULL;
+}
+
+
+/**
+ * Parse "NODE:PORT" into a node endpoint.
+ *
+ * @return 0 on success
+ */
+static int
+parse_port (const char *spec,
+            struct Endpoint *ep)
+{
+  char name[256];
+  unsigned int port;
+  struct Node *n;
+
+  if ( (2 != sscanf (spec,
+                     "%255[^:]:%u",
+                     name,
+                     &port)) ||
+       (NULL == (n = find_node (name))) ||
+       (0 == port) ||
+       (port > n->num_ports) )
+    {
+      fprintf (stderr,
+               "Invalid port `%s'\n",
+               spec);
+      return 1;
+    }
+  ep->type = EP_NODE;
+  ep->idx = n - nodes;
+  ep->port = port;
+  return 0;
+}
+
+
+/**
+ * Connect @a a to @a b.
+ *
+ * @return 0 on success
+ */
+static int
+attach (const struct Endpoint *a,
+        const struct Endpoint *b)
+{
+  struct Endpoint *pa = &nodes[a->idx].peer[a->port - 1];
+
+  if (EP_NONE != pa->type)
+    {
+      fprintf (stderr,
+               "Port %s:%u connected twice\n",
+               nodes[a->idx].name,
+               (unsigned int) a->port);
+      return 1;
+    }
+  *pa = *b;
+  return 0;
+}
+
+
+/**
+ * Parse network "IP/LEN".
+ *
+ * @return 0 on success
+ */
+static int
+parse_network (const char *spec,
+               struct in_addr *ip,
+               struct in_addr *netmask)
+{
+  char addr[64];
+  unsigned int len;
+
+  if ( (2 != sscanf (spec,
+                     "%63[^/]/%u",
+                     addr,
+                     &len)) ||
+       (len > 32) ||
+       (1 != inet_pton (AF_INET,
+                        addr,
+                        ip)) )
+    {
+      fprintf (stderr,
+               "Invalid network `%s'\n",
+               spec);
+      return 1;
+    }
+  netmask->s_addr = htonl (~(uint32_t) ((1LLU << (32 - len)) - 1LLU));
+  return 0;
+}
+
+
+/**
+ * Parse one line of the topology file.
+ *
+ * @param line the line, modified
+ * @param lno line number for error messages
+ * @return 0 on success
+ */
+static int
+parse_line (char *line,
+            unsigned int lno)
+{
+  char *tok[64];
+  unsigned int ntok = 0;
+  char *hash;
+
+  if (NULL != (hash = strchr (line, '#')))
+    *hash = '\0';
+  for (char *t = strtok (line, " \t\r\n");
+       NULL != t;
+       t = strtok (NULL, " \t\r\n"))
+    {
+      if (ntok == sizeof (tok) / sizeof (tok[0]))
+        {
+          fprintf (stderr,
+                   "Line %u: too many arguments\n",
+                   lno);
+          return 1;
+        }
+      tok[ntok++] = t;
+    }
+  if (0 == ntok)
+    return 0;
+  if ( (0 == strcmp (tok[0], "node")) &&
+       (ntok >= 3) )
+    {
+      struct Node *n;
+
+      if (NULL != find_node (tok[1]))
+        {
+          fprintf (stderr,
+                   "Line %u: duplicate node `%s'\n",
+                   lno,
+                   tok[1]);
+          return 1;
+        }
+      nodes = realloc (nodes,
+                       (num_nodes + 1) * sizeof (struct Node));
+      if (NULL == nodes)
+        abort ();
+      n = &nodes[num_nodes++];
+      memset (n,
+              0,
+              sizeof (*n));
+      n->name = strdup (tok[1]);
+      n->num_ports = ntok - 3;
+      n->argv = calloc (ntok - 1,
+                        sizeof (char *));
+      n->peer = calloc (n->num_ports + 1,
+                        sizeof (struct Endpoint));
+      if ( (NULL == n->name) ||
+           (NULL == n->argv) ||
+           (NULL == n->peer) )
+        abort ();
+      for (unsigned int i=2;i<ntok;i++)
+        if (NULL == (n->argv[i - 2] = strdup (tok[i])))
+          abort ();
+      return 0;
+    }
+  if ( (0 == strcmp (tok[0], "link")) &&
+       (3 == ntok) )
+    {
+      struct Endpoint a;
+      struct Endpoint b;
+
+      if ( (0 != parse_port (tok[1], &a)) ||
+           (0 != parse_port (tok[2], &b)) ||
+           (0 != attach (&a, &b)) ||
+           (0 != attach (&b, &a)) )
+        return 1;
+      return 0;
+    }
+  if ( (0 == strcmp (tok[0], "host")) &&
+       (ntok >= 3) &&
+       (ntok <= 5) )
+    {
+      struct Host *h;
+      struct Endpoint self;
+
+      if (NULL != find_host (tok[1]))
+        {
+          fprintf (stderr,
+                   "Line %u: duplicate host `%s'\n",
+                   lno,
+                   tok[1]);
+          return 1;
+        }
+      hosts = realloc (hosts,
+                       (num_hosts + 1) * sizeof (struct Host));
+      if (NULL == hosts)
+        abort ();
+      h = &hosts[num_hosts];
+      memset (h,
+              0,
+              sizeof (*h));
+      h->name = strdup (tok[1]);
+      if (NULL == h->name)
+        abort ();
+      /* locally administered, unique per host */
+      h->mac.mac[0] = 0x02;
+      h->mac.mac[1] = 0x48;
+      h->mac.mac[4] = (num_hosts >> 8) & 0xFF;
+      h->mac.mac[5] = num_hosts & 0xFF;
+      if (0 != parse_port (tok[2], &h->attach))
+        return 1;
+      if ( (ntok >= 4) &&
+           (0 != parse_network (tok[3], &h->ip, &h->netmask)) )
+        return 1;
+      if ( (5 == ntok) &&
+           (1 != inet_pton (AF_INET, tok[4], &h->gw)) )
+        {
+          fprintf (stderr,
+                   "Line %u: invalid gateway `%s'\n",
+                   lno,
+                   tok[4]);
+          return 1;
+        }
+      self.type = EP_HOST;
+      self.idx = num_hosts;
+      self.port = 0;
+      if (0 != attach (&h->attach, &self))
+        return 1;
+      num_hosts++;
+      return 0;
+    }
+  if ( (0 == strcmp (tok[0], "flow")) &&
+       (ntok >= 3) &&
+       (ntok <= 5) )
+    {
+      struct Flow *f;
+      struct Host *src = find_host (tok[1]);
+      struct Host *dst = find_host (tok[2]);
+      unsigned int size = 128;
+      double fps = 0;
+
+      if ( (NULL == src) ||
+           (NULL == dst) ||
+           ( (ntok >= 4) && (1 != sscanf (tok[3], "%lf", &fps)) ) ||
+           ( (5 == ntok) && (1 != sscanf (tok[4], "%u", &size)) ) ||
+           (fps < 0) ||
+           (size < MIN_FRAME) ||
+           (size > MAX_FRAME) )
+        {
+          fprintf (stderr,
+                   "Line %u: invalid flow (frame size must be %u-%u)\n",
+                   lno,
+                   (unsigned int) MIN_FRAME,
+                   (unsigned int) MAX_FRAME);
+          return 1;
+        }
+      flows = realloc (flows,
+                       (num_flows + 1) * sizeof (struct Flow));
+      if (NULL == flows)
+        abort ();
+      f = &flows[num_flows++];
+      memset (f,
+              0,
+              sizeof (*f));
+      f->src = src - hosts;
+      f->dst = dst - hosts;
+      f->fps = fps;
+      f->frame_size = size;
+      f->lat_min = UINT64_MAX;
+      return 0;
+    }
+  fprintf (stderr,
+           "Line %u: cannot parse `%s' statement\n",
+           lno,
+           tok[0]);
+  return 1;
+}
+
+
+/**
+ * Queue message for @a n.
+ *
+ * @param n node to send to
+ * @param type message type
+ * @param data message body
+ * @param size number of bytes in @a data
+ * @return 0 on success, -1 if the node's buffer is full
+ */
+static int
+send_to_node (struct Node *n,
+              uint16_t type,
+              const void *data,
+              size_t size)
+{
+  struct GLAB_MessageHeader hdr;
+
+  if (n->wbuf_len + sizeof (hdr) + size > WBUF_SIZE)
+    {
+      if (0 == n->wbuf_off)
+        return -1;
+      memmove (n->wbuf,
+               &n->wbuf[n->wbuf_off],
+               n->wbuf_len - n->wbuf_off);
+      n->wbuf_len -= n->wbuf_off;
+      n->wbuf_off = 0;
+      if (n->wbuf_len + sizeof (hdr) + size > WBUF_SIZE)
+        return -1;
+    }
+  hdr.size = htons (sizeof (hdr) + size);
+  hdr.type = htons (type);
+  memcpy (&n->wbuf[n->wbuf_len],
+          &hdr,
+          sizeof (hdr));
+  memcpy (&n->wbuf[n->wbuf_len + sizeof (hdr)],
+          data,
+          size);
+  n->wbuf_len += sizeof (hdr) + size;
+  return 0;
+}
+
+
+/**
+ * Can @a n accept a frame of @a size bytes right now?
+ */
+static int
+node_has_room (const struct Node *n,
+               size_t size)
+{
+  return (n->wbuf_len - n->wbuf_off) + sizeof (struct GLAB_MessageHeader) + size
+    <= WBUF_SIZE;
+}
+
+
+/**
+ * Transmit @a frame from host @a h.
+ *
+ * @return 0 on success, -1 if the frame was dropped
+ */
+static int
+host_send (struct Host *h,
+           const void *frame,
+           size_t size)
+{
+  struct Node *n = &nodes[h->attach.idx];
+
+  if (0 != send_to_node (n,
+                         h->attach.port,
+                         frame,
+                         size))
+    {
+      n->drops++;
+      return -1;
+    }
+  n->frames_in++;
+  n->bytes_in += size;
+  return 0;
+}
+
+
+/**
+ * Send ARP packet from @a h.
+ *
+ * @param h sending host
+ * @param oper 1 for request, 2 for reply
+ * @param dst destination MAC (broadcast for requests)
+ * @param target_ha target hardware address
+ * @param target_pa target IPv4 address
+ */
+static void
+host_send_arp (struct Host *h,
+               uint16_t oper,
+               const struct MacAddress *dst,
+               const struct MacAddress *target_ha,
+               struct in_addr target_pa)
+{
+  unsigned char frame[42];
+  uint16_t v;
+
+  memcpy (&frame[0], dst, MAC_ADDR_SIZE);
+  memcpy (&frame[6], &h->mac, MAC_ADDR_SIZE);
+  v = htons (ETH_P_ARP);
+  memcpy (&frame[12], &v, 2);
+  v = htons (1); /* Ethernet */
+  memcpy (&frame[14], &v, 2);
+  v = htons (ETH_P_IPV4);
+  memcpy (&frame[16], &v, 2);
+  frame[18] = MAC_ADDR_SIZE;
+  frame[19] = sizeof (struct in_addr);
+  v = htons (oper);
+  memcpy (&frame[20], &v, 2);
+  memcpy (&frame[22], &h->mac, MAC_ADDR_SIZE);
+  memcpy (&frame[28], &h->ip, 4);
+  memcpy (&frame[32], target_ha, MAC_ADDR_SIZE);
+  memcpy (&frame[38], &target_pa, 4);
+  (void) host_send (h,
+                    frame,
+                    sizeof (frame));
+}
+
+
+/**
+ * Which IP does flow @a f have to resolve?
+ */
+static struct in_addr
+flow_next_hop_ip (const struct Flow *f)
+{
+  const struct Host *s = &hosts[f->src];
+  const struct Host *d = &hosts[f->dst];
+
+  if ( (0 != s->gw.s_addr) &&
+       ( (s->ip.s_addr & s->netmask.s_addr) !=
+         (d->ip.s_addr & s->netmask.s_addr) ) )
+    return s->gw;
+  return d->ip;
+}
+
+
+/**
+ * Announce hosts (so that switches learn them) and resolve
+ * next hops of flows.  Called periodically.
+ */
+static void
+host_announce (void)
+{
+  static const struct MacAddress bcast = {
+    { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF }
+  };
+  static const struct MacAddress zero;
+
+  for (unsigned int i=0;i<num_hosts;i++)
+    host_send_arp (&hosts[i],
+                   1,
+                   &bcast,
+                   &zero,
+                   hosts[i].ip);
+  for (unsigned int i=0;i<num_flows;i++)
+    {
+      struct Flow *f = &flows[i];
+
+      if (f->resolved)
+        continue;
+      if (0 == hosts[f->src].ip.s_addr)
+        {
+          /* pure layer 2, address the destination host directly */
+          f->next_hop = hosts[f->dst].mac;
+          f->resolved = 1;
+          continue;
+        }
+      host_send_arp (&hosts[f->src],
+                     1,
+                     &bcast,
+                     &zero,
+                     flow_next_hop_ip (f));
+    }
+}
+
+
+/**
+ * One's complement checksum over IPv4 header @a buf.
+ */
+static uint16_t
+ip_checksum (const unsigned char *buf,
+             size_t len)
+{
+  uint32_t sum = 0;
+
+  for (size_t i=0;i<len;i+=2)
+    sum += (buf[i] << 8) | buf[i + 1];
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return htons ((uint16_t) ~sum);
+}
+
+
+/**
+ * Generate one frame of flow @a f.
+ *
+ * @return 0 on success, -1 if dropped
+ */
+static int
+flow_send (struct Flow *f,
+           uint64_t now)
+{
+  unsigned char frame[MAX_FRAME];
+  struct Host *s = &hosts[f->src];
+  struct Host *d = &hosts[f->dst];
+  struct GenPayload gp;
+  unsigned char *ip = &frame[14];
+  unsigned char *udp = &frame[14 + 20];
+  uint16_t v;
+
+  memset (frame,
+          0,
+          f->frame_size);
+  memcpy (&frame[0], &f->next_hop, MAC_ADDR_SIZE);
+  memcpy (&frame[6], &s->mac, MAC_ADDR_SIZE);
+  v = htons (ETH_P_IPV4);
+  memcpy (&frame[12], &v, 2);
+  ip[0] = 0x45;
+  v = htons (f->frame_size - 14);
+  memcpy (&ip[2], &v, 2);
+  ip[8] = 64; /* TTL */
+  ip[9] = IPPROTO_UDP;
+  memcpy (&ip[12], &s->ip, 4);
+  memcpy (&ip[16], &d->ip, 4);
+  v = ip_checksum (ip, 20);
+  memcpy (&ip[10], &v, 2);
+  v = htons (GEN_PORT);
+  memcpy (&udp[0], &v, 2);
+  memcpy (&udp[2], &v, 2);
+  v = htons (f->frame_size - 14 - 20);
+  memcpy (&udp[4], &v, 2);
+  gp.magic = htonl (GEN_MAGIC);
+  gp.flow = htonl (f - flows);
+  gp.seq = f->sent;
+  gp.timestamp_ns = now;
+  memcpy (&frame[HDR_SIZE],
+          &gp,
+          sizeof (gp));
+  if (0 != host_send (s,
+                      frame,
+                      f->frame_size))
+    {
+      f->tx_drops++;
+      return -1;
+    }
+  f->sent++;
+  return 0;
+}
+
+
+/**
+ * Host @a h received @a frame.
+ */
+static void
+host_receive (struct Host *h,
+              const unsigned char *frame,
+              size_t size,
+              uint64_t now)
+{
+  uint16_t type;
+
+  h->frames_in++;
+  if (size < 14)
+    return;
+  if ( (0 == (frame[0] & 1)) &&
+       (0 != memcmp (frame, &h->mac, MAC_ADDR_SIZE)) )
+    return; /* flooded unicast for someone else */
+  memcpy (&type, &frame[12], 2);
+  type = ntohs (type);
+  if ( (ETH_P_ARP == type) &&
+       (size >= 42) )
+    {
+      uint16_t oper;
+      struct in_addr spa;
+      struct in_addr tpa;
+      struct MacAddress sha;
+
+      memcpy (&oper, &frame[20], 2);
+      memcpy (&sha, &frame[22], MAC_ADDR_SIZE);
+      memcpy (&spa, &frame[28], 4);
+      memcpy (&tpa, &frame[38], 4);
+      if ( (1 == ntohs (oper)) &&
+           (0 != h->ip.s_addr) &&
+           (tpa.s_addr == h->ip.s_addr) &&
+           (spa.s_addr != h->ip.s_addr) )
+        host_send_arp (h, 2, &sha, &sha, spa);
+      if (2 == ntohs (oper))
+        for (unsigned int i=0;i<num_flows;i++)
+          if ( (&hosts[flows[i].src] == h) &&
+               (flow_next_hop_ip (&flows[i]).s_addr == spa.s_addr) )
+            {
+              flows[i].next_hop = sha;
+              flows[i].resolved = 1;
+            }
+      return;
+    }
+  if ( (ETH_P_IPV4 == type) &&
+       (size >= MIN_FRAME) &&
+       (IPPROTO_UDP == frame[14 + 9]) )
+    {
+      struct GenPayload gp;
+      uint32_t fid;
+      struct Flow *f;
+      uint64_t lat;
+
+      memcpy (&gp,
+              &frame[HDR_SIZE],
+              sizeof (gp));
+      fid = ntohl (gp.flow);
+      if ( (GEN_MAGIC != ntohl (gp.magic)) ||
+           (fid >= num_flows) ||
+           (&hosts[flows[fid].dst] != h) )
+        return;
+      f = &flows[fid];
+      lat = now - gp.timestamp_ns;
+      f->received++;
+      f->lat_sum += lat;
+      if (lat < f->lat_min)
+        f->lat_min = lat;
+      if (lat > f->lat_max)
+        f->lat_max = lat;
+    }
+}
+
+
+/**
+ * Node @a n sent @a frame out on @a port, pass it on to the peer.
+ */
+static void
+transmit (struct Node *n,
+          uint16_t port,
+          const unsigned char *frame,
+          size_t frame_size,
+          uint64_t now)
+{
+  struct Endpoint *peer = &n->peer[port - 1];
+
+  n->frames_out++;
+  n->bytes_out += frame_size;
+  switch (peer->type)
+    {
+    case EP_NONE:
+      break;
+    case EP_HOST:
+      host_receive (&hosts[peer->idx],
+                    frame,
+                    frame_size,
+                    now);
+      break;
+    case EP_NODE:
+      {
+        struct Node *pn = &nodes[peer->idx];
+
+        if (0 != send_to_node (pn,
+                               peer->port,
+                               frame,
+                               frame_size))
+          {
+            pn->drops++;
+            break;
+          }
+        pn->frames_in++;
+        pn->bytes_in += frame_size;
+        break;
+      }
+    }
+}
+
+
+/**
+ * Handle message @a msg that node @a n sent.
+ */
+static void
+handle_node_message (struct Node *n,
+                     const unsigned char *msg,
+                     size_t size,
+                     uint64_t now)
+{
+  struct GLAB_MessageHeader hdr;
+  const unsigned char *body = &msg[sizeof (hdr)];
+  size_t body_size = size - sizeof (hdr);
+  uint16_t type;
+
+  memcpy (&hdr,
+          msg,
+          sizeof (hdr));
+  type = ntohs (hdr.type);
+  if (0 == type)
+    {
+      fprintf (stdout,
+               "[%s] %.*s",
+               n->name,
+               (int) body_size,
+               body);
+      fflush (stdout);
+      return;
+    }
+  if (GLAB_TYPE_MULTICAST == type)
+    {
+      struct GLAB_MulticastHeader mh;
+      uint16_t ms;
+
+      if (size < sizeof (mh))
+        return;
+      memcpy (&mh,
+              msg,
+              sizeof (mh));
+      ms = ntohs (mh.mask_size);
+      if (sizeof (mh) + ms > size)
+        return;
+      for (unsigned int b=0;(b < 8u * ms) && (b < n->num_ports);b++)
+        if (0 != (msg[sizeof (mh) + b / 8] & (1 << (b % 8))))
+          transmit (n,
+                    b + 1,
+                    &msg[sizeof (mh) + ms],
+                    size - sizeof (mh) - ms,
+                    now);
+      return;
+    }
+  if (type >= GLAB_TYPE_RESERVED)
+    return; /* not announced */
+  if (type > n->num_ports)
+    {
+      fprintf (stderr,
+               "Node `%s' sent to invalid interface %u\n",
+               n->name,
+               (unsigned int) type);
+      return;
+    }
+  transmit (n,
+            type,
+            body,
+            body_size,
+            now);
+}
+
+
+/**
+ * Read from node @a n and dispatch complete messages.
+ *
+ * @return 0 on success, -1 if the node died
+ */
+static int
+read_node (struct Node *n,
+           uint64_t now)
+{
+  ssize_t ret;
+  size_t off;
+
+  ret = read (n->out_fd,
+              &n->rbuf[n->rbuf_len],
+              2 * MAX_SIZE - n->rbuf_len);
+  if (ret <= 0)
+    {
+      if ( (-1 == ret) &&
+           ( (EAGAIN == errno) || (EINTR == errno) ) )
+        return 0;
+      fprintf (stderr,
+               "Node `%s' terminated\n",
+               n->name);
+      return -1;
+    }
+  n->rbuf_len += ret;
+  off = 0;
+  while (n->rbuf_len - off >= sizeof (struct GLAB_MessageHeader))
+    {
+      struct GLAB_MessageHeader hdr;
+      uint16_t size;
+
+      memcpy (&hdr,
+              &n->rbuf[off],
+              sizeof (hdr));
+      size = ntohs (hdr.size);
+      if (size < sizeof (hdr))
+        {
+          fprintf (stderr,
+                   "Node `%s' sent malformed message\n",
+                   n->name);
+          return -1;
+        }
+      if (n->rbuf_len - off < size)
+        break;
+      handle_node_message (n,
+                           &n->rbuf[off],
+                           size,
+                           now);
+      off += size;
+    }
+  memmove (n->rbuf,
+           &n->rbuf[off],
+           n->rbuf_len - off);
+  n->rbuf_len -= off;
+  return 0;
+}
+
+
+/**
+ * Write pending data to node @a n.
+ *
+ * @return 0 on success, -1 if the node died
+ */
+static int
+write_node (struct Node *n)
+{
+  ssize_t ret;
+
+  ret = write (n->in_fd,
+               &n->wbuf[n->wbuf_off],
+               n->wbuf_len - n->wbuf_off);
+  if (-1 == ret)
+    {
+      if ( (EAGAIN == errno) || (EINTR == errno) )
+        return 0;
+      fprintf (stderr,
+               "Writing to node `%s' failed: %s\n",
+               n->name,
+               strerror (errno));
+      return -1;
+    }
+  n->wbuf_off += ret;
+  if (n->wbuf_off == n->wbuf_len)
+    {
+      n->wbuf_off = 0;
+      n->wbuf_len = 0;
+    }
+  return 0;
+}
+
+
+/**
+ * Launch node @a n and send it the MACs of its interfaces.
+ *
+ * @param quiet non-zero to discard the child's stderr
+ * @return 0 on success
+ */
+static int
+start_node (struct Node *n,
+            int quiet)
+{
+  int cin[2];
+  int cout[2];
+  struct MacAddress macs[n->num_ports + 1];
+
+  if ( (0 != pipe (cin)) ||
+       (0 != pipe (cout)) )
+    {
+      perror ("pipe");
+      return 1;
+    }
+  n->pid = fork ();
+  if (-1 == n->pid)
+    {
+      perror ("fork");
+      return 1;
+    }
+  if (0 == n->pid)
+    {
+      if ( (-1 == dup2 (cin[0], STDIN_FILENO)) ||
+           (-1 == dup2 (cout[1], STDOUT_FILENO)) )
+        {
+          perror ("dup2");
+          _exit (1);
+        }
+      if (quiet)
+        {
+          int null = open ("/dev/null", O_WRONLY);
+
+          if (-1 != null)
+            dup2 (null, STDERR_FILENO);
+        }
+      /* close everything else, in particular other nodes' pipes */
+      for (int fd = STDERR_FILENO + 1; fd < 4 * (int) num_nodes + 16; fd++)
+        close (fd);
+      execvp (n->argv[0],
+              n->argv);
+      perror ("execvp");
+      _exit (1);
+    }
+  close (cin[0]);
+  close (cout[1]);
+  n->in_fd = cin[1];
+  n->out_fd = cout[0];
+  if ( (0 != fcntl (n->in_fd, F_SETFL, O_NONBLOCK)) ||
+       (0 != fcntl (n->out_fd, F_SETFL, O_NONBLOCK)) )
+    {
+      perror ("fcntl");
+      return 1;
+    }
+  n->rbuf = malloc (2 * MAX_SIZE);
+  n->wbuf = malloc (WBUF_SIZE);
+  if ( (NULL == n->rbuf) ||
+       (NULL == n->wbuf) )
+    abort ();
+  for (unsigned int i=0;i<n->num_ports;i++)
+    {
+      /* locally administered, unique per node and port */
+      memset (&macs[i], 0, sizeof (struct MacAddress));
+      macs[i].mac[0] = 0x02;
+      macs[i].mac[1] = 0x4e;
+      macs[i].mac[2] = ((n - nodes) >> 8) & 0xFF;
+      macs[i].mac[3] = (n - nodes) & 0xFF;
+      macs[i].mac[5] = i + 1;
+    }
+  return send_to_node (n,
+                       0,
+                       macs,
+                       n->num_ports * sizeof (struct MacAddress));
+}
+
+
+/**
+ * Forward command lines from our stdin ("NODE COMMAND") to nodes.
+ *
+ * @return 0 on success, -1 on EOF
+ */
+static int
+read_commands (void)
+{
+  static char buf[4096];
+  static size_t off;
+  ssize_t ret;
+  char *nl;
+
+  ret = read (STDIN_FILENO,
+              &buf[off],
+              sizeof (buf) - off);
+  if (ret <= 0)
+    return -1;
+  off += ret;
+  while (NULL != (nl = memchr (buf, '\n', off)))
+    {
+      char *sp = memchr (buf, ' ', nl - buf);
+      struct Node *n;
+
+      if (NULL != sp)
+        {
+          *sp = '\0';
+          n = find_node (buf);
+          if (NULL == n)
+            fprintf (stderr,
+                     "Unknown node `%s'\n",
+                     buf);
+          else
+            (void) send_to_node (n,
+                                 0,
+                                 sp + 1,
+                                 nl - sp);
+        }
+      memmove (buf,
+               nl + 1,
+               off - (nl + 1 - buf));
+      off -= nl + 1 - buf;
+    }
+  if (sizeof (buf) == off)
+    off = 0; /* line too long, discard */
+  return 0;
+}
+
+
+/**
+ * Print statistics.
+ *
+ * @param duration_ns how long we ran
+ */
+static void
+report (uint64_t duration_ns)
+{
+  double secs = duration_ns / 1e9;
+
+  fprintf (stdout,
+           "%-16s %12s %12s %10s %10s %10s\n",
+           "node",
+           "frames-in",
+           "frames-out",
+           "kfps-in",
+           "Mbit/s-in",
+           "drops");
+  for (unsigned int i=0;i<num_nodes;i++)
+    {
+      struct Node *n = &nodes[i];
+
+      fprintf (stdout,
+               "%-16s %12llu %12llu %10.1f %10.1f %10llu\n",
+               n->name,
+               (unsigned long long) n->frames_in,
+               (unsigned long long) n->frames_out,
+               n->frames_in / secs / 1000.0,
+               n->bytes_in * 8 / secs / 1e6,
+               (unsigned long long) n->drops);
+    }
+  fprintf (stdout,
+           "%-16s %12s %12s %10s %10s %10s %10s\n",
+           "flow",
+           "sent",
+           "received",
+           "kfps",
+           "lat-min/us",
+           "lat-avg/us",
+           "lat-max/us");
+  for (unsigned int i=0;i<num_flows;i++)
+    {
+      struct Flow *f = &flows[i];
+      char name[64];
+
+      snprintf (name,
+                sizeof (name),
+                "%s->%s",
+                hosts[f->src].name,
+                hosts[f->dst].name);
+      fprintf (stdout,
+               "%-16s %12llu %12llu %10.1f %10.1f %10.1f %10.1f%s\n",
+               name,
+               (unsigned long long) f->sent,
+               (unsigned long long) f->received,
+               f->received / secs / 1000.0,
+               f->received ? f->lat_min / 1e3 : 0.0,
+               f->received ? f->lat_sum / 1e3 / f->received : 0.0,
+               f->lat_max / 1e3,
+               f->resolved ? "" : " (next hop unresolved)");
+    }
+  fflush (stdout);
+}
+
+
+/**
+ * Run the emulation for @a duration_ns.
+ *
+ * @return 0 on success
+ */
+static int
+run (uint64_t duration_ns)
+{
+  struct pollfd pfd[2 * num_nodes + 1];
+  uint64_t start = now_ns ();
+  uint64_t end = start + duration_ns;
+  uint64_t next_announce = start;
+  int stdin_open = 1;
+
+  while (1)
+    {
+      uint64_t now = now_ns ();
+      int timeout_ms = 100;
+      int busy = 0;
+
+      if (now >= end)
+        break;
+      if (now >= next_announce)
+        {
+          host_announce ();
+          next_announce = now + 1000000000LLU;
+        }
+      /* generate traffic */
+      for (unsigned int i=0;i<num_flows;i++)
+        {
+          struct Flow *f = &flows[i];
+          struct Node *n = &nodes[hosts[f->src].attach.idx];
+
+          if (! f->resolved)
+            continue;
+          if (0 == f->fps)
+            {
+              for (unsigned int j=0;
+                   (j < BURST) && node_has_room (n, f->frame_size);
+                   j++)
+                (void) flow_send (f, now);
+              if (node_has_room (n, f->frame_size))
+                busy = 1;
+              continue;
+            }
+          if (0 == f->next_ns)
+            f->next_ns = now;
+          for (unsigned int j=0;
+               (j < BURST) && (f->next_ns <= now);
+               j++)
+            {
+              (void) flow_send (f, now);
+              f->next_ns += (uint64_t) (1e9 / f->fps);
+            }
+          if (f->next_ns <= now)
+            busy = 1;
+          else if ((f->next_ns - now) / 1000000 < (uint64_t) timeout_ms)
+            timeout_ms = (f->next_ns - now) / 1000000;
+        }
+      if (busy)
+        timeout_ms = 0;
+
+      for (unsigned int i=0;i<num_nodes;i++)
+        {
+          struct Node *n = &nodes[i];
+
+          pfd[2 * i].fd = n->out_fd;
+          pfd[2 * i].events = POLLIN;
+          pfd[2 * i + 1].fd = n->in_fd;
+          pfd[2 * i + 1].events = (n->wbuf_len > n->wbuf_off) ? POLLOUT : 0;
+        }
+      pfd[2 * num_nodes].fd = stdin_open ? STDIN_FILENO : -1;
+      pfd[2 * num_nodes].events = POLLIN;
+      if (-1 == poll (pfd,
+                      2 * num_nodes + 1,
+                      timeout_ms))
+        {
+          if (EINTR == errno)
+            continue;
+          perror ("poll");
+          return 1;
+        }
+      now = now_ns ();
+      for (unsigned int i=0;i<num_nodes;i++)
+        {
+          if ( (0 != (pfd[2 * i].revents & (POLLIN | POLLHUP))) &&
+               (0 != read_node (&nodes[i], now)) )
+            return 1;
+          if ( (0 != (pfd[2 * i + 1].revents & (POLLOUT | POLLERR))) &&
+               (0 != write_node (&nodes[i])) )
+            return 1;
+        }
+      if ( (0 != pfd[2 * num_nodes].revents) &&
+           (0 != read_commands ()) )
+        stdin_open = 0;
+    }
+  report (now_ns () - start);
+  return 0;
+}
+
+
+/**
+ * Run topology emulation.
+ *
+ * @param argc number of arguments in @a argv
+ * @param argv [-q] [-t SECONDS] TOPOLOGY-FILE
+ * @return 0 on success
+ */
+int
+main (int argc,
+      char **argv)
+{
+  unsigned int seconds = 10;
+  int quiet = 0;
+  int opt;
+  FILE *f;
+  char line[4096];
+  unsigned int lno = 0;
+  int ret;
+
+  while (-1 != (opt = getopt (argc,
+                              argv,
+                              "qt:")))
+    {
+      switch (opt)
+        {
+        case 'q':
+          quiet = 1;
+          break;
+        case 't':
+          seconds = atoi (optarg);
+          break;
+        default:
+          fprintf (stderr,
+                   "Usage: %s [-q] [-t SECONDS] TOPOLOGY-FILE\n",
+                   argv[0]);
+          return 1;
+        }
+    }
+  if (optind + 1 != argc)
+    {
+      fprintf (stderr,
+               "Usage: %s [-q] [-t SECONDS] TOPOLOGY-FILE\n",
+               argv[0]);
+      return 1;
+    }
+  f = fopen (argv[optind],
+             "r");
+  if (NULL == f)
+    {
+      fprintf (stderr,
+               "Failed to open `%s': %s\n",
+               argv[optind],
+               strerror (errno));
+      return 1;
+    }
+  while (NULL != fgets (line,
+                        sizeof (line),
+                        f))
+    if (0 != parse_line (line,
+                         ++lno))
+      {
+        fclose (f);
+        return 1;
+      }
+  fclose (f);
+  if (0 == num_nodes)
+    {
+      fprintf (stderr,
+               "Topology has no nodes\n");
+      return 1;
+    }
+  {
+    char fstr[16];
+
+    /* what our children may send us */
+    snprintf (fstr,
+              sizeof (fstr),
+              "%x",
+              GLAB_FEATURE_MULTICAST);
+    if (0 != setenv (GLAB_FEATURES_ENV,
+                     fstr,
+                     1))
+      {
+        perror ("setenv");
+        return 1;
+      }
+  }
+  if (SIG_ERR == signal (SIGPIPE,
+                         SIG_IGN))
+    perror ("signal");
+  ret = 0;
+  for (unsigned int i=0;i<num_nodes;i++)
+    if (0 != start_node (&nodes[i],
+                         quiet))
+      ret = 1;
+  if (0 == ret)
+    ret = run (1000000000LLU * seconds);
+  for (unsigned int i=0;i<num_nodes;i++)
+    {
+      if (0 == nodes[i].pid)
+        continue;
+      close (nodes[i].in_fd);
+      close (nodes[i].out_fd);
+      kill (nodes[i].pid,
+            SIGTERM);
+      waitpid (nodes[i].pid,
+               NULL,
+               0);
+    }
+  return ret;
+}
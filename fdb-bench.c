@@ -0,0 +1,425 @@
+/*
+     This file (was) part of GNUnet.
+     Copyright (C) 2018 Christian Grothoff
+
+     GNUnet is free software: you can redistribute it and/or modify it
+     under the terms of the GNU Affero General Public License as published
+     by the Free Software Foundation, either version 3 of the License,
+     or (at your option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Affero General Public License for more details.
+
+     You should have received a copy of the GNU Affero General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file fdb-bench.c
+ * @brief Multi-threaded stress test and benchmark of fdb.c.  For 1,
+ *        2, 4, ... threads, measures the throughput of
+ *
+ *   lookup  fdb_get() of random known MACs (the forwarding path),
+ *   learn   fdb_put() of random known MACs on a new port (MACs moving),
+ *   insert  fdb_put() of new MACs into an empty table, which grows.
+ *
+ * and checks that no MAC is lost or duplicated meanwhile.
+ */
+#include "glab.h"
+#include <pthread.h>
+#include "fdb.c"
+
+
+/**
+ * Default number of MACs in the table.
+ */
+#define BENCH_ENTRIES_DEFAULT (1 << 20)
+
+/**
+ * Default duration of each lookup and learn test in ms.
+ */
+#define BENCH_MS_DEFAULT 500
+
+/**
+ * Operations between looks at the stop flag.
+ */
+#define BENCH_BATCH 1024
+
+
+/**
+ * Kinds of tests.
+ */
+enum BenchTest
+{
+  BENCH_LOOKUP,
+  BENCH_LEARN,
+  BENCH_INSERT
+};
+
+
+/**
+ * State of one benchmark thread.
+ */
+struct BenchThread
+{
+  pthread_t tid;
+
+  enum BenchTest test;
+
+  /**
+   * Index of the thread.
+   */
+  unsigned int idx;
+
+  /**
+   * Number of threads.
+   */
+  unsigned int num;
+
+  /**
+   * State of the random number generator.
+   */
+  uint64_t rnd;
+
+  /**
+   * Operations done.
+   */
+  uint64_t ops;
+
+  /**
+   * Operations with the wrong result: known MACs not found or added
+   * again, new MACs found.
+   */
+  uint64_t misses;
+
+  char pad[64];
+};
+
+
+/**
+ * The table under test.
+ */
+static struct GLAB_Fdb bench_fdb;
+
+/**
+ * Number of MACs in the table.
+ */
+static uint64_t bench_entries;
+
+/**
+ * Set to make threads stop.
+ */
+static _Atomic int bench_stop;
+
+/**
+ * Set to make threads start.
+ */
+static _Atomic int bench_go;
+
+
+/**
+ * Key of the @a i-th MAC.
+ */
+static uint64_t
+bench_key (uint64_t i)
+{
+  struct MacAddress mac;
+
+  i *= 0x9E3779B97F4A7C15LLU; /* spread MACs like real ones */
+  for (unsigned int j=0;j<MAC_ADDR_SIZE;j++)
+    mac.mac[j] = (uint8_t) (i >> (8 * j));
+  return fdb_key (&mac,
+                  (uint16_t) (i >> 48));
+}
+
+
+/**
+ * Random number from @a t's generator (xorshift64).
+ */
+static uint64_t
+bench_random (struct BenchThread *t)
+{
+  t->rnd ^= t->rnd << 13;
+  t->rnd ^= t->rnd >> 7;
+  t->rnd ^= t->rnd << 17;
+  return t->rnd;
+}
+
+
+/**
+ * Body of a benchmark thread.
+ *
+ * @param cls the `struct BenchThread`
+ * @return NULL
+ */
+static void *
+bench_run (void *cls)
+{
+  struct BenchThread *t = cls;
+  struct GLAB_FdbEntry e;
+  struct GLAB_FdbEntry old;
+
+  while (! atomic_load (&bench_go))
+    sched_yield ();
+  switch (t->test)
+    {
+    case BENCH_LOOKUP:
+      while (! atomic_load_explicit (&bench_stop,
+                                     memory_order_relaxed))
+        {
+          for (unsigned int i=0;i<BENCH_BATCH;i++)
+            if (! fdb_get (&bench_fdb,
+                           bench_key (bench_random (t) % bench_entries),
+                           0,
+                           &e))
+              t->misses++;
+          t->ops += BENCH_BATCH;
+        }
+      break;
+    case BENCH_LEARN:
+      memset (&e,
+              0,
+              sizeof (e));
+      while (! atomic_load_explicit (&bench_stop,
+                                     memory_order_relaxed))
+        {
+          for (unsigned int i=0;i<BENCH_BATCH;i++)
+            {
+              uint64_t r = bench_random (t);
+
+              e.port = 1 + (r >> 60);
+              e.seen = (uint32_t) t->ops;
+              if (FDB_PUT_NEW == fdb_put (&bench_fdb,
+                                          bench_key (r % bench_entries),
+                                          &e,
+                                          &old))
+                t->misses++;
+            }
+          t->ops += BENCH_BATCH;
+        }
+      break;
+    case BENCH_INSERT:
+      memset (&e,
+              0,
+              sizeof (e));
+      for (uint64_t i = t->idx; i < bench_entries; i += t->num)
+        {
+          e.port = 1 + t->idx;
+          if (FDB_PUT_NEW != fdb_put (&bench_fdb,
+                                      bench_key (i),
+                                      &e,
+                                      &old))
+            t->misses++;
+          t->ops++;
+        }
+      break;
+    }
+  return NULL;
+}
+
+
+/**
+ * Monotonic clock in ns.
+ */
+static uint64_t
+bench_clock_ns ()
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC,
+                 &ts);
+  return (uint64_t) ts.tv_sec * 1000000000LLU + ts.tv_nsec;
+}
+
+
+/**
+ * Run test @a test with @a num threads for @a ms milliseconds (or, for
+ * #BENCH_INSERT, until done).
+ *
+ * @param[out] misses set to the number of failed operations
+ * @return throughput in millions of operations per second
+ */
+static double
+bench (enum BenchTest test,
+       unsigned int num,
+       unsigned int ms,
+       uint64_t *misses)
+{
+  struct BenchThread *threads;
+  struct timespec ts = {
+    .tv_sec = ms / 1000,
+    .tv_nsec = (ms % 1000) * 1000000L
+  };
+  uint64_t start;
+  uint64_t ops = 0;
+  double elapsed;
+
+  threads = aligned_alloc (64,
+                           num * sizeof (struct BenchThread));
+  if (NULL == threads)
+    abort ();
+  memset (threads,
+          0,
+          num * sizeof (struct BenchThread));
+  atomic_store (&bench_go,
+                0);
+  atomic_store (&bench_stop,
+                0);
+  for (unsigned int i=0;i<num;i++)
+    {
+      threads[i].test = test;
+      threads[i].idx = i;
+      threads[i].num = num;
+      threads[i].rnd = 0x2545F4914F6CDD1DLLU * (i + 1);
+      if (0 != pthread_create (&threads[i].tid,
+                               NULL,
+                               &bench_run,
+                               &threads[i]))
+        {
+          fprintf (stderr,
+                   "Failed to start thread: %s\n",
+                   strerror (errno));
+          exit (1);
+        }
+    }
+  start = bench_clock_ns ();
+  atomic_store (&bench_go,
+                1);
+  if (BENCH_INSERT != test)
+    {
+      nanosleep (&ts,
+                 NULL);
+      atomic_store (&bench_stop,
+                    1);
+    }
+  *misses = 0;
+  for (unsigned int i=0;i<num;i++)
+    {
+      pthread_join (threads[i].tid,
+                    NULL);
+      ops += threads[i].ops;
+      *misses += threads[i].misses;
+    }
+  elapsed = (bench_clock_ns () - start) / 1e9;
+  free (threads);
+  /* all threads are gone, so old tables can go as well */
+  fdb_reclaim (&bench_fdb);
+  return ops / elapsed / 1e6;
+}
+
+
+/**
+ * Check that the table has exactly the MACs 0 to #bench_entries - 1.
+ *
+ * @return 0 if so
+ */
+static int
+bench_verify ()
+{
+  struct GLAB_FdbEntry e;
+
+  if (fdb_size (&bench_fdb) != bench_entries)
+    return -1;
+  for (uint64_t i = 0; i < bench_entries; i++)
+    if (! fdb_get (&bench_fdb,
+                   bench_key (i),
+                   0,
+                   &e))
+      return -1;
+  return 0;
+}
+
+
+int
+main (int argc,
+      char **argv)
+{
+  unsigned int max_threads = sysconf (_SC_NPROCESSORS_ONLN);
+  unsigned int ms = BENCH_MS_DEFAULT;
+  int ret = 0;
+
+  bench_entries = BENCH_ENTRIES_DEFAULT;
+  if ( (argc > 4) ||
+       ( (argc > 1) &&
+         (0 == (bench_entries = strtoull (argv[1],
+                                          NULL,
+                                          10))) ) ||
+       ( (argc > 2) &&
+         (0 == (max_threads = strtoul (argv[2],
+                                       NULL,
+                                       10))) ) ||
+       ( (argc > 3) &&
+         (0 == (ms = strtoul (argv[3],
+                              NULL,
+                              10))) ) )
+    {
+      fprintf (stderr,
+               "Usage: %s [ENTRIES [MAX-THREADS [MS-PER-TEST]]]\n",
+               argv[0]);
+      return 1;
+    }
+  printf ("# %llu entries, %u ms per test, Mops/s\n",
+          (unsigned long long) bench_entries,
+          ms);
+  printf ("%7s %10s %10s %10s\n",
+          "threads",
+          "lookup",
+          "learn",
+          "insert");
+  for (unsigned int num = 1; ; num *= 2)
+    {
+      double lookup;
+      double learn;
+      double insert;
+      uint64_t lost;
+      uint64_t added;
+      uint64_t failed;
+
+      if (num > max_threads)
+        num = max_threads;
+      fdb_destroy (&bench_fdb);
+      insert = bench (BENCH_INSERT,
+                      num,
+                      ms,
+                      &failed);
+      if ( (0 != failed) ||
+           (0 != bench_verify ()) )
+        {
+          fprintf (stderr,
+                   "insert with %u threads: table is wrong\n",
+                   num);
+          ret = 1;
+        }
+      lookup = bench (BENCH_LOOKUP,
+                      num,
+                      ms,
+                      &lost);
+      learn = bench (BENCH_LEARN,
+                     num,
+                     ms,
+                     &added);
+      if ( (0 != lost) ||
+           (0 != added) ||
+           (0 != bench_verify ()) )
+        {
+          fprintf (stderr,
+                   "%u threads: %llu lookups failed, %llu MACs duplicated\n",
+                   num,
+                   (unsigned long long) lost,
+                   (unsigned long long) added);
+          ret = 1;
+        }
+      printf ("%7u %10.2f %10.2f %10.2f\n",
+              num,
+              lookup,
+              learn,
+              insert);
+      fflush (stdout);
+      if (num >= max_threads)
+        break;
+    }
+  fdb_destroy (&bench_fdb);
+  return ret;
+}
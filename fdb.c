@@ -0,0 +1,1068 @@
+/*
+     This file (was) part of GNUnet.
+     Copyright (C) 2018 Christian Grothoff
+
+     GNUnet is free software: you can redistribute it and/or modify it
+     under the terms of the GNU Affero General Public License as published
+     by the Free Software Foundation, either version 3 of the License,
+     or (at your option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Affero General Public License for more details.
+
+     You should have received a copy of the GNU Affero General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file fdb.c
+ * @brief Forwarding database: open-addressing hash table from
+ *        (VLAN, MAC) to port, for the switches.  A MAC and VLAN are
+ *        packed into one 64-bit key.  Keys are kept apart from the
+ *        entries, in buckets that fill one cache line, and a bucket is
+ *        searched with a few SIMD compares; buckets are probed
+ *        linearly.  Removed keys leave tombstones that insertions
+ *        reuse and that go away when the table is rebuilt.  For bounded
+ *        tables, fdb_sweep() ages entries out incrementally and
+ *        fdb_evict() picks victims with the CLOCK algorithm.
+ *
+ *        Frame handlers of several workers may share a table:
+ *        fdb_get() takes no locks, as the last word of each bucket is
+ *        a sequence number that writers make odd while they change the
+ *        bucket, and readers retry if it changed under them.  Writers
+ *        lock the stripe of their key and the bucket they change, so
+ *        writers of different keys rarely wait for each other.
+ *        Growing takes all stripes and publishes a new table; the old
+ *        one stays readable until fdb_reclaim(), which must run while
+ *        no thread uses the table (for loop.c programs: in a timer or
+ *        command, when workers are idle).
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include <sched.h>
+#include <stdatomic.h>
+
+
+/**
+ * Number of words per bucket (one cache line): the keys and the
+ * sequence number.
+ */
+#define FDB_BUCKET 8
+
+/**
+ * Number of keys per bucket.
+ */
+#define FDB_BUCKET_KEYS (FDB_BUCKET - 1)
+
+/**
+ * Initial number of buckets, a power of two.
+ */
+#define FDB_INITIAL_BUCKETS 128
+
+/**
+ * Number of writer locks, a power of two.
+ */
+#define FDB_STRIPES 64
+
+/**
+ * Bit set in all keys of entries; 0 marks free slots.
+ */
+#define FDB_KEY_USED (1LLU << 63)
+
+/**
+ * Key of removed entries.
+ */
+#define FDB_KEY_DELETED 1LLU
+
+/**
+ * Initial sequence number of a bucket; never equal to a key, 0 or
+ * #FDB_KEY_DELETED.
+ */
+#define FDB_SEQ_INIT (1LLU << 62)
+
+
+/**
+ * Value of an FDB entry.
+ */
+struct GLAB_FdbEntry
+{
+  /**
+   * When the MAC was last seen as a source, in seconds (see
+   * fdb_sweep()).
+   */
+  uint32_t seen;
+
+  /**
+   * Port (interface number) the MAC was learned on.
+   */
+  uint16_t port;
+
+  /**
+   * Set when the entry is used, cleared by fdb_evict() passing by.
+   * Lookups set it without holding the bucket lock.
+   */
+  _Atomic uint8_t referenced;
+};
+
+
+/**
+ * One generation of the table of a `struct GLAB_Fdb`.
+ */
+struct GLAB_FdbTable
+{
+  /**
+   * Buckets of #FDB_BUCKET_KEYS keys and a sequence number, 64-byte
+   * aligned.
+   */
+  uint64_t *keys;
+
+  /**
+   * Entries, parallel to @e keys.
+   */
+  struct GLAB_FdbEntry *entries;
+
+  /**
+   * Number of buckets minus one.
+   */
+  size_t mask;
+
+  /**
+   * Next table waiting for fdb_reclaim().
+   */
+  struct GLAB_FdbTable *retired;
+};
+
+
+/**
+ * A writer lock, alone in its cache line.
+ */
+struct FdbLock
+{
+  _Atomic int locked;
+
+  char pad[64 - sizeof (int)];
+};
+
+
+/**
+ * A forwarding database.  Zero-initialize before first use.
+ */
+struct GLAB_Fdb
+{
+  /**
+   * Current table, NULL until the first insertion.
+   */
+  struct GLAB_FdbTable *_Atomic table;
+
+  /**
+   * Tables replaced by fdb_grow() that readers may still use.
+   */
+  struct GLAB_FdbTable *retired;
+
+  /**
+   * Number of entries.
+   */
+  _Atomic size_t used;
+
+  /**
+   * Number of tombstones.
+   */
+  _Atomic size_t deleted;
+
+  /**
+   * Next slot fdb_sweep() looks at.
+   */
+  size_t sweep;
+
+  /**
+   * Next slot fdb_evict() looks at (the CLOCK hand).
+   */
+  size_t hand;
+
+  /**
+   * Writer locks, by hash of the key.
+   */
+  struct FdbLock stripes[FDB_STRIPES];
+};
+
+
+/**
+ * Result of fdb_put().
+ */
+enum GLAB_FdbPutResult
+{
+  /**
+   * The key was added.
+   */
+  FDB_PUT_NEW,
+
+  /**
+   * The key was there; its entry was replaced.
+   */
+  FDB_PUT_UPDATED
+};
+
+
+/**
+ * Key for @a mac in VLAN @a vlan.
+ */
+static inline uint64_t
+fdb_key (const struct MacAddress *mac,
+         uint16_t vlan)
+{
+  uint64_t k = 0;
+
+  memcpy (&k,
+          mac,
+          MAC_ADDR_SIZE);
+  return FDB_KEY_USED | ((uint64_t) (vlan & 0xFFF) << 48) | k;
+}
+
+
+/**
+ * MAC of key @a key.
+ */
+static inline void
+fdb_key_mac (uint64_t key,
+             struct MacAddress *mac)
+{
+  memcpy (mac,
+          &key,
+          MAC_ADDR_SIZE);
+}
+
+
+/**
+ * VLAN of key @a key.
+ */
+static inline uint16_t
+fdb_key_vlan (uint64_t key)
+{
+  return (key >> 48) & 0xFFF;
+}
+
+
+/**
+ * Hash of @a key.
+ */
+static inline uint64_t
+fdb_hash (uint64_t key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdLLU;
+  key ^= key >> 33;
+  return key;
+}
+
+
+/**
+ * Which keys of @a bucket are @a key?
+ *
+ * @return bitmask, bit i set if the i-th key matches
+ */
+static inline unsigned int
+fdb_match (const uint64_t *bucket,
+           uint64_t key)
+{
+  unsigned int m = 0;
+
+#if defined(__AVX2__)
+  __m256i k = _mm256_set1_epi64x (key);
+
+  for (unsigned int i=0;i<FDB_BUCKET;i+=4)
+    m |= (unsigned int) _mm256_movemask_pd (
+      _mm256_castsi256_pd (
+        _mm256_cmpeq_epi64 (_mm256_load_si256 ((const __m256i *) &bucket[i]),
+                            k))) << i;
+#elif defined(__SSE2__)
+  __m128i k = _mm_set1_epi64x (key);
+
+  for (unsigned int i=0;i<FDB_BUCKET;i+=2)
+    {
+      /* no 64-bit compare in SSE2: both 32-bit halves must match */
+      __m128i e = _mm_cmpeq_epi32 (_mm_load_si128 ((const __m128i *) &bucket[i]),
+                                   k);
+
+      e = _mm_and_si128 (e,
+                         _mm_shuffle_epi32 (e,
+                                            _MM_SHUFFLE (2, 3, 0, 1)));
+      m |= (unsigned int) _mm_movemask_pd (_mm_castsi128_pd (e)) << i;
+    }
+#else
+  for (unsigned int i=0;i<FDB_BUCKET;i++)
+    if (bucket[i] == key)
+      m |= 1U << i;
+#endif
+  /* the last word is the sequence number */
+  return m & ((1U << FDB_BUCKET_KEYS) - 1);
+}
+
+
+/**
+ * Sequence number of @a bucket.
+ */
+static inline _Atomic uint64_t *
+fdb_seq (const uint64_t *bucket)
+{
+  return (_Atomic uint64_t *) &bucket[FDB_BUCKET_KEYS];
+}
+
+
+/**
+ * Wait a little for another thread, after @a spins attempts.
+ */
+static inline void
+fdb_relax (unsigned int spins)
+{
+  if (spins > 64)
+    sched_yield ();
+#if defined(__x86_64__) || defined(__i386__)
+  else
+    __builtin_ia32_pause ();
+#endif
+}
+
+
+/**
+ * Lock @a bucket for writing: make its sequence number odd.
+ */
+static void
+fdb_bucket_lock (uint64_t *bucket)
+{
+  _Atomic uint64_t *seq = fdb_seq (bucket);
+
+  for (unsigned int spins = 0; ; spins++)
+    {
+      uint64_t v = atomic_load_explicit (seq,
+                                         memory_order_relaxed);
+
+      if ( (0 == (v & 1)) &&
+           (atomic_compare_exchange_weak_explicit (seq,
+                                                   &v,
+                                                   v + 1,
+                                                   memory_order_acquire,
+                                                   memory_order_relaxed)) )
+        break;
+      fdb_relax (spins);
+    }
+  /* readers must not see our stores before the odd number */
+  atomic_thread_fence (memory_order_release);
+}
+
+
+/**
+ * Unlock @a bucket after writing.
+ */
+static void
+fdb_bucket_unlock (uint64_t *bucket)
+{
+  _Atomic uint64_t *seq = fdb_seq (bucket);
+
+  atomic_store_explicit (seq,
+                         atomic_load_explicit (seq,
+                                               memory_order_relaxed) + 1,
+                         memory_order_release);
+}
+
+
+/**
+ * Take writer lock @a l.
+ */
+static void
+fdb_lock (struct FdbLock *l)
+{
+  for (unsigned int spins = 0;
+       atomic_exchange_explicit (&l->locked,
+                                 1,
+                                 memory_order_acquire);
+       spins++)
+    fdb_relax (spins);
+}
+
+
+/**
+ * Release writer lock @a l.
+ */
+static void
+fdb_unlock (struct FdbLock *l)
+{
+  atomic_store_explicit (&l->locked,
+                         0,
+                         memory_order_release);
+}
+
+
+/**
+ * Current table of @a fdb, NULL if nothing was ever added.  Slot i of
+ * it is in use if `t->keys[i] & FDB_KEY_USED`.
+ */
+static inline struct GLAB_FdbTable *
+fdb_table (const struct GLAB_Fdb *fdb)
+{
+  return atomic_load_explicit (&((struct GLAB_Fdb *) fdb)->table,
+                               memory_order_acquire);
+}
+
+
+/**
+ * Number of slots of @a t, for iterating.
+ */
+static inline size_t
+fdb_slots (const struct GLAB_FdbTable *t)
+{
+  return (NULL == t) ? 0 : (t->mask + 1) * FDB_BUCKET;
+}
+
+
+/**
+ * Number of entries in @a fdb.
+ */
+static inline size_t
+fdb_size (const struct GLAB_Fdb *fdb)
+{
+  return atomic_load_explicit (&fdb->used,
+                               memory_order_relaxed);
+}
+
+
+/**
+ * Allocate a table of @a buckets empty buckets.
+ */
+static struct GLAB_FdbTable *
+fdb_table_create (size_t buckets)
+{
+  struct GLAB_FdbTable *t = malloc (sizeof (*t));
+
+  if (NULL == t)
+    abort ();
+  t->keys = aligned_alloc (64,
+                           buckets * FDB_BUCKET * sizeof (uint64_t));
+  t->entries = calloc (buckets * FDB_BUCKET,
+                       sizeof (struct GLAB_FdbEntry));
+  if ( (NULL == t->keys) ||
+       (NULL == t->entries) )
+    abort ();
+  memset (t->keys,
+          0,
+          buckets * FDB_BUCKET * sizeof (uint64_t));
+  for (size_t b=0;b<buckets;b++)
+    t->keys[b * FDB_BUCKET + FDB_BUCKET_KEYS] = FDB_SEQ_INIT;
+  t->mask = buckets - 1;
+  t->retired = NULL;
+  return t;
+}
+
+
+/**
+ * Hint that @a key will be looked up soon.
+ */
+static inline void
+fdb_prefetch (const struct GLAB_Fdb *fdb,
+              uint64_t key)
+{
+  const struct GLAB_FdbTable *t = fdb_table (fdb);
+
+  if (NULL != t)
+    __builtin_prefetch (&t->keys[(fdb_hash (key) & t->mask) * FDB_BUCKET]);
+}
+
+
+/**
+ * Look up @a key, without locks.  Marks the entry as used for
+ * fdb_evict() and, unless @a now is 0, as seen at @a now.
+ *
+ * @param key what to look for
+ * @param now current time in seconds, or 0
+ * @param[out] e set to a copy of the entry if found
+ * @return 1 if found, 0 if not
+ */
+static inline int
+fdb_get (const struct GLAB_Fdb *fdb,
+         uint64_t key,
+         uint32_t now,
+         struct GLAB_FdbEntry *e)
+{
+  struct GLAB_FdbTable *t = fdb_table (fdb);
+  size_t b;
+
+  if (NULL == t)
+    return 0;
+  b = fdb_hash (key) & t->mask;
+  for (unsigned int spins = 0; ; spins++)
+    {
+      const uint64_t *bucket = &t->keys[b * FDB_BUCKET];
+      _Atomic uint64_t *seq = fdb_seq (bucket);
+      uint64_t v = atomic_load_explicit (seq,
+                                         memory_order_acquire);
+      struct GLAB_FdbEntry *slot = NULL;
+      unsigned int m;
+      int more;
+
+      if (0 != (v & 1))
+        {
+          fdb_relax (spins); /* being written */
+          continue;
+        }
+      m = fdb_match (bucket,
+                     key);
+      if (0 != m)
+        {
+          slot = &t->entries[b * FDB_BUCKET + __builtin_ctz (m)];
+          *e = *slot;
+        }
+      /* a free slot ends every probe sequence */
+      more = (0 == m) && (0 == fdb_match (bucket,
+                                          0));
+      atomic_thread_fence (memory_order_acquire);
+      if (v != atomic_load_explicit (seq,
+                                     memory_order_relaxed))
+        continue;
+      if (more)
+        {
+          b = (b + 1) & t->mask;
+          continue;
+        }
+      if (NULL == slot)
+        return 0;
+      /* the slot may be reused by now; at worst, another entry looks
+         a bit fresher than it is */
+      if (! atomic_load_explicit (&e->referenced,
+                                  memory_order_relaxed))
+        atomic_store_explicit (&slot->referenced,
+                               1,
+                               memory_order_relaxed);
+      if ( (0 != now) &&
+           (e->seen != now) )
+        slot->seen = now;
+      return 1;
+    }
+}
+
+
+/**
+ * Put @a key with @a entry into a free slot of @a t, which must not
+ * have @a key yet and which nobody else uses yet.  For fdb_grow().
+ */
+static void
+fdb_place (struct GLAB_FdbTable *t,
+           uint64_t key,
+           const struct GLAB_FdbEntry *entry)
+{
+  size_t b = fdb_hash (key) & t->mask;
+
+  while (1)
+    {
+      unsigned int m = fdb_match (&t->keys[b * FDB_BUCKET],
+                                  0);
+
+      if (0 != m)
+        {
+          size_t slot = b * FDB_BUCKET + __builtin_ctz (m);
+
+          t->keys[slot] = key;
+          t->entries[slot] = *entry;
+          return;
+        }
+      b = (b + 1) & t->mask;
+    }
+}
+
+
+/**
+ * Replace table @a old of @a fdb with one of @a buckets buckets and
+ * without tombstones, unless another thread already replaced it.
+ * @a old is kept until fdb_reclaim().
+ */
+static void
+fdb_grow (struct GLAB_Fdb *fdb,
+          struct GLAB_FdbTable *old,
+          size_t buckets)
+{
+  for (unsigned int i=0;i<FDB_STRIPES;i++)
+    fdb_lock (&fdb->stripes[i]);
+  if (fdb_table (fdb) == old)
+    {
+      struct GLAB_FdbTable *t = fdb_table_create (buckets);
+      size_t slots = fdb_slots (old);
+
+      for (size_t i=0;i<slots;i++)
+        if (0 != (old->keys[i] & FDB_KEY_USED))
+          fdb_place (t,
+                     old->keys[i],
+                     &old->entries[i]);
+      atomic_store_explicit (&fdb->deleted,
+                             0,
+                             memory_order_relaxed);
+      fdb->sweep = 0;
+      fdb->hand = 0;
+      atomic_store_explicit (&fdb->table,
+                             t,
+                             memory_order_release);
+      if (NULL != old)
+        {
+          old->retired = fdb->retired;
+          fdb->retired = old;
+        }
+    }
+  for (unsigned int i=0;i<FDB_STRIPES;i++)
+    fdb_unlock (&fdb->stripes[i]);
+}
+
+
+/**
+ * Free the tables fdb_grow() replaced.  No other thread may use
+ * @a fdb during the call.
+ */
+static void
+fdb_reclaim (struct GLAB_Fdb *fdb)
+{
+  while (NULL != fdb->retired)
+    {
+      struct GLAB_FdbTable *t = fdb->retired;
+
+      fdb->retired = t->retired;
+      free (t->keys);
+      free (t->entries);
+      free (t);
+    }
+}
+
+
+/**
+ * Free all memory of @a fdb, leaving it empty.  No other thread may
+ * use @a fdb during the call.
+ */
+static void __attribute__ ((unused))
+fdb_destroy (struct GLAB_Fdb *fdb)
+{
+  struct GLAB_FdbTable *t = fdb_table (fdb);
+
+  if (NULL != t)
+    {
+      t->retired = fdb->retired;
+      fdb->retired = t;
+    }
+  fdb_reclaim (fdb);
+  atomic_store (&fdb->table,
+                NULL);
+  atomic_store (&fdb->used,
+                0);
+  atomic_store (&fdb->deleted,
+                0);
+  fdb->sweep = 0;
+  fdb->hand = 0;
+}
+
+
+/**
+ * Set the entry of @a key to @a entry, adding @a key if needed.  May
+ * be called by several threads at once.
+ *
+ * @param key the key
+ * @param entry the new entry
+ * @param[out] old set to the previous entry if @a key was there
+ * @return #FDB_PUT_NEW or #FDB_PUT_UPDATED
+ */
+static enum GLAB_FdbPutResult
+fdb_put (struct GLAB_Fdb *fdb,
+         uint64_t key,
+         const struct GLAB_FdbEntry *entry,
+         struct GLAB_FdbEntry *old)
+{
+  uint64_t h = fdb_hash (key);
+  struct FdbLock *stripe = &fdb->stripes[(h >> 48) & (FDB_STRIPES - 1)];
+
+  while (1)
+    {
+      struct GLAB_FdbTable *t;
+      size_t capacity;
+      size_t slot = SIZE_MAX;
+      uint64_t *bucket;
+      int found = 0;
+
+      fdb_lock (stripe);
+      t = fdb_table (fdb);
+      capacity = (NULL == t) ? 0 : (t->mask + 1) * FDB_BUCKET_KEYS;
+      if (4 * (fdb_size (fdb)
+               + atomic_load_explicit (&fdb->deleted,
+                                       memory_order_relaxed) + 1)
+          > 3 * capacity)
+        {
+          /* at most 3/4 full (including tombstones), so probes stay
+             short; grow if it is at least half full with live entries */
+          fdb_unlock (stripe);
+          fdb_grow (fdb,
+                    t,
+                    (NULL == t)
+                    ? FDB_INITIAL_BUCKETS
+                    : (2 * (fdb_size (fdb) + 1) > capacity)
+                    ? 2 * (t->mask + 1)
+                    : t->mask + 1);
+          continue;
+        }
+      /* other writers of @a key wait for our stripe, so what we find
+         stays true but for other keys taking a free slot */
+      for (size_t b = h & t->mask; ; b = (b + 1) & t->mask)
+        {
+          unsigned int m;
+
+          bucket = &t->keys[b * FDB_BUCKET];
+          m = fdb_match (bucket,
+                         key);
+          if (0 != m)
+            {
+              slot = b * FDB_BUCKET + __builtin_ctz (m);
+              found = 1;
+              break;
+            }
+          if ( (SIZE_MAX == slot) &&
+               (0 != (m = fdb_match (bucket,
+                                     FDB_KEY_DELETED))) )
+            slot = b * FDB_BUCKET + __builtin_ctz (m);
+          m = fdb_match (bucket,
+                         0);
+          if (0 != m)
+            {
+              if (SIZE_MAX == slot)
+                slot = b * FDB_BUCKET + __builtin_ctz (m);
+              break;
+            }
+        }
+      bucket = &t->keys[slot - slot % FDB_BUCKET];
+      fdb_bucket_lock (bucket);
+      if ( (found) &&
+           (key == t->keys[slot]) )
+        {
+          *old = t->entries[slot];
+          t->entries[slot] = *entry;
+          fdb_bucket_unlock (bucket);
+          fdb_unlock (stripe);
+          return FDB_PUT_UPDATED;
+        }
+      if ( (! found) &&
+           ( (0 == t->keys[slot]) ||
+             (FDB_KEY_DELETED == t->keys[slot]) ) )
+        {
+          if (FDB_KEY_DELETED == t->keys[slot])
+            atomic_fetch_sub_explicit (&fdb->deleted,
+                                       1,
+                                       memory_order_relaxed);
+          t->entries[slot] = *entry;
+          t->keys[slot] = key;
+          atomic_fetch_add_explicit (&fdb->used,
+                                     1,
+                                     memory_order_relaxed);
+          fdb_bucket_unlock (bucket);
+          fdb_unlock (stripe);
+          return FDB_PUT_NEW;
+        }
+      /* the writer of another key took the slot first, or a sweep
+         removed our key */
+      fdb_bucket_unlock (bucket);
+      fdb_unlock (stripe);
+    }
+}
+
+
+/**
+ * Remove the entry in slot @a slot of table @a t of @a fdb if it
+ * still has key @a key.
+ *
+ * @param[out] old set to the removed entry, may be NULL
+ * @return 0 if it was removed, -1 if not
+ */
+static int
+fdb_remove_slot (struct GLAB_Fdb *fdb,
+                 struct GLAB_FdbTable *t,
+                 size_t slot,
+                 uint64_t key,
+                 struct GLAB_FdbEntry *old)
+{
+  uint64_t *bucket = &t->keys[slot - slot % FDB_BUCKET];
+  int ret = -1;
+
+  fdb_bucket_lock (bucket);
+  if (key == t->keys[slot])
+    {
+      if (NULL != old)
+        *old = t->entries[slot];
+      t->keys[slot] = FDB_KEY_DELETED;
+      atomic_fetch_sub_explicit (&fdb->used,
+                                 1,
+                                 memory_order_relaxed);
+      atomic_fetch_add_explicit (&fdb->deleted,
+                                 1,
+                                 memory_order_relaxed);
+      ret = 0;
+    }
+  fdb_bucket_unlock (bucket);
+  return ret;
+}
+
+
+/**
+ * Remove @a key from @a fdb.  May be called by several threads at
+ * once.
+ *
+ * @return 0 if it was removed, -1 if it was not there
+ */
+static int __attribute__ ((unused))
+fdb_remove (struct GLAB_Fdb *fdb,
+            uint64_t key)
+{
+  uint64_t h = fdb_hash (key);
+  struct FdbLock *stripe = &fdb->stripes[(h >> 48) & (FDB_STRIPES - 1)];
+  struct GLAB_FdbTable *t;
+  int ret = -1;
+
+  fdb_lock (stripe);
+  t = fdb_table (fdb);
+  if (NULL != t)
+    for (size_t b = h & t->mask; ; b = (b + 1) & t->mask)
+      {
+        const uint64_t *bucket = &t->keys[b * FDB_BUCKET];
+        unsigned int m = fdb_match (bucket,
+                                    key);
+
+        if (0 != m)
+          {
+            ret = fdb_remove_slot (fdb,
+                                   t,
+                                   b * FDB_BUCKET + __builtin_ctz (m),
+                                   key,
+                                   NULL);
+            break;
+          }
+        if (0 != fdb_match (bucket,
+                            0))
+          break;
+      }
+  fdb_unlock (stripe);
+  return ret;
+}
+
+
+/**
+ * Function called for entries of the table.
+ *
+ * @param cls closure
+ * @param key key of the entry
+ * @param e the entry
+ * @return non-zero to remove the entry
+ */
+typedef int
+(*GLAB_FdbIterator)(void *cls,
+                    uint64_t key,
+                    struct GLAB_FdbEntry *e);
+
+
+/**
+ * Function called for each entry fdb_sweep() or fdb_evict() removes,
+ * after it was removed.
+ *
+ * @param cls closure
+ * @param key key of the entry
+ * @param e the entry
+ */
+typedef void
+(*GLAB_FdbRemoveCallback)(void *cls,
+                          uint64_t key,
+                          const struct GLAB_FdbEntry *e);
+
+
+/**
+ * Call @a it on the entries in up to @a budget slots of @a fdb,
+ * starting at slot @a *pos and wrapping around.  The table must not
+ * grow meanwhile, so other threads may only look up and update keys.
+ *
+ * @param[in,out] pos where to start, set to where to continue
+ * @param budget number of slots to look at
+ * @param stop stop after this many removals, 0 for no limit
+ * @param it function to call
+ * @param it_cls closure for @a it
+ * @param cb function to call on removed entries, may be NULL
+ * @param cb_cls closure for @a cb
+ * @return number of entries removed
+ */
+static unsigned int
+fdb_scan (struct GLAB_Fdb *fdb,
+          size_t *pos,
+          size_t budget,
+          unsigned int stop,
+          GLAB_FdbIterator it,
+          void *it_cls,
+          GLAB_FdbRemoveCallback cb,
+          void *cb_cls)
+{
+  struct GLAB_FdbTable *t = fdb_table (fdb);
+  size_t slots = fdb_slots (t);
+  unsigned int removed = 0;
+
+  if (*pos >= slots)
+    *pos = 0;
+  while ( (budget-- > 0) &&
+          ( (0 == stop) ||
+            (removed < stop) ) )
+    {
+      size_t i = *pos;
+      uint64_t key = t->keys[i];
+      struct GLAB_FdbEntry old;
+
+      *pos = (i + 1 < slots) ? i + 1 : 0;
+      if ( (0 == (key & FDB_KEY_USED)) ||
+           (! it (it_cls,
+                  key,
+                  &t->entries[i])) ||
+           (0 != fdb_remove_slot (fdb,
+                                  t,
+                                  i,
+                                  key,
+                                  &old)) )
+        continue; /* kept, or another thread removed it first */
+      removed++;
+      if (NULL != cb)
+        cb (cb_cls,
+            key,
+            &old);
+    }
+  return removed;
+}
+
+
+/**
+ * Call @a it on all entries of @a fdb.  The table must not grow
+ * meanwhile, so other threads may only look up and update keys.
+ *
+ * @param it function to call, returns non-zero to remove the entry
+ * @param it_cls closure for @a it
+ */
+static void __attribute__ ((unused))
+fdb_iterate (struct GLAB_Fdb *fdb,
+             GLAB_FdbIterator it,
+             void *it_cls)
+{
+  size_t pos = 0;
+
+  (void) fdb_scan (fdb,
+                   &pos,
+                   fdb_slots (fdb_table (fdb)),
+                   0,
+                   it,
+                   it_cls,
+                   NULL,
+                   NULL);
+}
+
+
+/**
+ * Closure of fdb_sweep_check().
+ */
+struct FdbScanContext
+{
+  uint32_t now;
+
+  uint32_t max_age;
+};
+
+
+/**
+ * Is entry @a e older than allowed?  See fdb_sweep().
+ */
+static int
+fdb_sweep_check (void *cls,
+                 uint64_t key,
+                 struct GLAB_FdbEntry *e)
+{
+  struct FdbScanContext *ctx = cls;
+
+  (void) key;
+  return (ctx->now - e->seen >= ctx->max_age);
+}
+
+
+/**
+ * Remove entries not seen for @a max_age seconds, looking at up to
+ * @a budget slots from where the last call stopped.  The table must
+ * not grow meanwhile.
+ *
+ * @param now current time in seconds
+ * @param max_age maximum age in seconds
+ * @param budget number of slots to look at
+ * @param cb function to call on removed entries
+ * @param cb_cls closure for @a cb
+ */
+static void __attribute__ ((unused))
+fdb_sweep (struct GLAB_Fdb *fdb,
+           uint32_t now,
+           uint32_t max_age,
+           size_t budget,
+           GLAB_FdbRemoveCallback cb,
+           void *cb_cls)
+{
+  struct FdbScanContext ctx = {
+    .now = now,
+    .max_age = max_age
+  };
+  size_t slots = fdb_slots (fdb_table (fdb));
+
+  (void) fdb_scan (fdb,
+                   &fdb->sweep,
+                   (budget > slots) ? slots : budget,
+                   0,
+                   &fdb_sweep_check,
+                   &ctx,
+                   cb,
+                   cb_cls);
+}
+
+
+/**
+ * Was entry @a e unused since the CLOCK hand last passed it?  See
+ * fdb_evict().
+ */
+static int
+fdb_evict_check (void *cls,
+                 uint64_t key,
+                 struct GLAB_FdbEntry *e)
+{
+  (void) cls;
+  (void) key;
+  /* lookups on other threads may set the bit again meanwhile */
+  return (0 == atomic_exchange_explicit (&e->referenced,
+                                         0,
+                                         memory_order_relaxed));
+}
+
+
+/**
+ * Remove one entry to make room, preferring entries that were not
+ * used since the CLOCK hand last passed them.  The table must not
+ * grow meanwhile.
+ *
+ * @param cb function to call on the removed entry
+ * @param cb_cls closure for @a cb
+ * @return 0 if an entry was removed, -1 if @a fdb is empty
+ */
+static int __attribute__ ((unused))
+fdb_evict (struct GLAB_Fdb *fdb,
+           GLAB_FdbRemoveCallback cb,
+           void *cb_cls)
+{
+  if (0 == fdb_size (fdb))
+    return -1;
+  /* the first round may only clear reference bits */
+  return (1 == fdb_scan (fdb,
+                         &fdb->hand,
+                         2 * fdb_slots (fdb_table (fdb)) + 1,
+                         1,
+                         &fdb_evict_check,
+                         NULL,
+                         cb,
+                         cb_cls)) ? 0 : -1;
+}
@@ -37,9 +37,11 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <time.h>
 #include <byteswap.h>
 #include <linux/if.h>
@@ -77,6 +79,45 @@ struct GLAB_MessageHeader
 };
 
 
+/**
+ * Message types at or above this value do not denote an adapter,
+ * but are used for optional signalling between network-driver and
+ * the child.  The child must only send them if the driver announced
+ * support in #GLAB_FEATURES_ENV.
+ */
+#define GLAB_TYPE_RESERVED 0xFF00
+
+/**
+ * Child tells the driver about a learned MAC, see
+ * `struct GLAB_FdbUpdate`.
+ */
+#define GLAB_TYPE_FDB_UPDATE 0xFF01
+
+/**
+ * Child sends one frame out on several interfaces, see
+ * `struct GLAB_MulticastHeader`.
+ */
+#define GLAB_TYPE_MULTICAST 0xFF02
+
+
+/**
+ * Name of the environment variable in which network-driver tells
+ * the child which optional features it supports, as a hexadecimal
+ * bitmask of GLAB_FEATURE_* values.
+ */
+#define GLAB_FEATURES_ENV "GLAB_FEATURES"
+
+/**
+ * Driver accepts #GLAB_TYPE_FDB_UPDATE messages (XDP offload).
+ */
+#define GLAB_FEATURE_FDB_OFFLOAD 1
+
+/**
+ * Driver accepts #GLAB_TYPE_MULTICAST messages.
+ */
+#define GLAB_FEATURE_MULTICAST 2
+
+
 /**
  * Number of bytes in a MAC.
  */
@@ -92,7 +133,166 @@ struct MacAddress
 };
 
 
+/**
+ * Ethernet header (without any 802.1Q tags).
+ */
+struct EthernetHeader
+{
+  struct MacAddress dst;
+  struct MacAddress src;
+
+  /**
+   * EtherType (or TPID of the first tag), in big-endian format.
+   */
+  uint16_t tag;
+};
+
+
+/**
+ * Message of type #GLAB_TYPE_FDB_UPDATE.  Known unicast frames
+ * to @e mac may then be forwarded directly by the driver.
+ */
+struct GLAB_FdbUpdate
+{
+  struct GLAB_MessageHeader header;
+
+  /**
+   * MAC address that was learned.
+   */
+  struct MacAddress mac;
+
+  /**
+   * Interface at which @e mac was learned, in big-endian format;
+   * 0 to remove the entry.
+   */
+  uint16_t ifc_num;
+};
+
+
+/**
+ * Message of type #GLAB_TYPE_MULTICAST.  Followed by @e mask_size
+ * bytes of egress bitmap and then by the frame.  Bit (i-1) % 8 of
+ * byte (i-1) / 8 of the bitmap (LSB first) selects interface i.
+ */
+struct GLAB_MulticastHeader
+{
+  struct GLAB_MessageHeader header;
+
+  /**
+   * Number of bytes in the bitmap, in big-endian format.
+   */
+  uint16_t mask_size;
+};
+
+
 _Pragma("pack(pop)")
 
 
+/**
+ * Maximum number of 802.1Q/802.1ad tags recorded in a `struct GLAB_Frame`;
+ * frames with more tags are treated as having an unknown EtherType.
+ */
+#define GLAB_MAX_TAGS 2
+
+/**
+ * Flag in `struct GLAB_Frame`: frame carries a valid IPv4 header.
+ */
+#define GLAB_FRAME_IPV4 1
+
+/**
+ * Flag in `struct GLAB_Frame`: the IPv4 packet is a fragment, so the
+ * payload may not start with (or contain) the layer 4 header.
+ */
+#define GLAB_FRAME_FRAGMENT 2
+
+
+/**
+ * A received frame, parsed once by loop.c and passed to handle_frame()
+ * (or handle_frames() for programs that define GLAB_HANDLE_FRAMES).
+ * Offsets are only set if the respective header is within @e size.
+ */
+struct GLAB_Frame
+{
+  /**
+   * The frame, valid until the handler returns.  The handler may
+   * modify it (and its @e headroom) in place, e.g. to push or pop a
+   * tag; output that refers to the modified bytes must be queued
+   * after the change.
+   */
+  const void *data;
+
+  /**
+   * Number of bytes in @e data.
+   */
+  uint16_t size;
+
+  /**
+   * Number of the interface the frame was received on.
+   */
+  uint16_t interface;
+
+  /**
+   * EtherType after any 802.1Q/802.1ad tags, in host byte order;
+   * 0 if the frame is too short.
+   */
+  uint16_t ethertype;
+
+  /**
+   * Offset of the layer 3 header in @e data.
+   */
+  uint16_t l3_offset;
+
+  /**
+   * Offset of the IPv4 payload (normally the layer 4 header) in
+   * @e data; 0 unless #GLAB_FRAME_IPV4 is set.
+   */
+  uint16_t l4_offset;
+
+  /**
+   * Number of entries in @e tci.
+   */
+  uint8_t num_tags;
+
+  /**
+   * Combination of GLAB_FRAME_-flags.
+   */
+  uint8_t flags;
+
+  /**
+   * Number of bytes right before @e data the handler may overwrite.
+   */
+  uint8_t headroom;
+
+  /**
+   * TCIs of the tags, outermost first, in host byte order.
+   */
+  uint16_t tci[GLAB_MAX_TAGS];
+
+  /**
+   * IPv4 total length, in host byte order (if #GLAB_FRAME_IPV4).
+   */
+  uint16_t ip_length;
+
+  /**
+   * IPv4 protocol (if #GLAB_FRAME_IPV4).
+   */
+  uint8_t ip_proto;
+
+  /**
+   * IPv4 TTL (if #GLAB_FRAME_IPV4).
+   */
+  uint8_t ip_ttl;
+
+  /**
+   * IPv4 source address (if #GLAB_FRAME_IPV4).
+   */
+  struct in_addr ip_src;
+
+  /**
+   * IPv4 destination address (if #GLAB_FRAME_IPV4).
+   */
+  struct in_addr ip_dst;
+};
+
+
 #endif
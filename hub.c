@@ -23,24 +23,6 @@
  */
 #include "glab.h"
 
-/**
- * gcc 4.x-ism to pack structures (to be used before structs);
- * Using this still causes structs to be unaligned on the stack on Sparc
- * (See #670578 from Debian).
- */
-_Pragma("pack(push)") _Pragma("pack(1)")
-
-
-struct EthernetHeader
-{
-  struct MacAddress dst;
-  struct MacAddress src;
-  uint16_t tag;
-};
-
-_Pragma("pack(pop)")
-
-
 /**
  * Per-interface context.
  */
@@ -73,66 +55,38 @@ static struct Interface *gifc;
 #include "print.c"
 
 
-/**
- * Forward @a frame to interface @a dst.
- *
- * @param dst target interface to send the frame out on
- * @param frame the frame to forward
- * @param frame_size number of bytes in @a frame
- */
-static void
-forward_to (struct Interface *dst,
-	    const void *frame,
-	    size_t frame_size)
-{
-  char iob[frame_size + sizeof (struct GLAB_MessageHeader)];
-  struct GLAB_MessageHeader hdr;
-
-  hdr.size = htons (sizeof (iob));
-  hdr.type = htons (dst->ifc_num);
-  memcpy (iob,
-	  &hdr,
-	  sizeof (hdr));
-  memcpy (&iob[sizeof (hdr)],
-	  frame,
-	  frame_size);
-  write_all (STDOUT_FILENO,
-	     iob,
-	     sizeof (iob));
-}
-
-
 static void
 fwd_frame (struct Interface *src_ifc,
 	   const void *frame,
 	   size_t frame_size)
-{   // Don't forward frame to the source interface
+{
+    uint16_t egress[num_ifc];
+    unsigned int num_egress = 0;
+
+    // Don't forward frame to the source interface
     for (int i = 0; i < num_ifc; ++i) {
         if (gifc[i].ifc_num != src_ifc->ifc_num){
-            forward_to(&gifc[i], frame, frame_size);
+            egress[num_egress++] = gifc[i].ifc_num;
         }
 
     }
+    forward_to_many(egress, num_egress, frame, frame_size);
 }
 
 
 /**
- * Process frame received from @a interface.
+ * Process frame @a f received from @a f->interface.
  *
- * @param interface number of the interface on which we received @a frame
- * @param frame the frame
- * @param frame_size number of bytes in @a frame
+ * @param f the frame, parsed by loop.c
  */
 static void
-handle_frame (uint16_t interface,
-	      const void *frame,
-	      size_t frame_size)
+handle_frame (const struct GLAB_Frame *f)
 {
-  if (interface > num_ifc)
+  if (f->interface > num_ifc)
     abort ();
-  fwd_frame (&gifc[interface - 1],
-	     frame,
-	     frame_size);
+  fwd_frame (&gifc[f->interface - 1],
+	     f->data,
+	     f->size);
 }
 
 
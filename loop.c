@@ -23,73 +23,426 @@
  */
 
 
+/**
+ * Size of the input buffer of loop().  Must be at least twice the
+ * maximum message size so that compaction stays rare.
+ */
+#define LOOP_BUFFER_SIZE (16 * (UINT16_MAX + 1))
+
+
+/**
+ * Maximum number of frames passed to one handle_frames() call.
+ */
+#define LOOP_MAX_FRAMES 256
+
+
+/**
+ * Fill in descriptor @a f for @a frame: walk the 802.1Q/802.1ad tags
+ * and, for IPv4, validate the header and extract the fields handlers
+ * (and workers_flow_hash()) need.  @a frame must directly follow its
+ * message header in a writable buffer; once parsed, that header is
+ * the frame's headroom.
+ *
+ * @param[out] f descriptor to initialize
+ * @param interface interface the frame was received on
+ * @param frame the frame
+ * @param frame_size number of bytes in @a frame
+ */
+static void
+loop_parse_headers (struct GLAB_Frame *f,
+                    uint16_t interface,
+                    const char *frame,
+                    uint16_t frame_size)
+{
+  const uint8_t *p = (const uint8_t *) frame;
+  unsigned int off = 2 * MAC_ADDR_SIZE;
+  uint16_t type = 0;
+  unsigned int hlen;
+
+  f->data = frame;
+  f->size = frame_size;
+  f->interface = interface;
+  f->l4_offset = 0;
+  f->num_tags = 0;
+  f->flags = 0;
+  f->headroom = sizeof (struct GLAB_MessageHeader);
+  while (off + sizeof (uint16_t) <= frame_size)
+    {
+      type = (p[off] << 8) | p[off + 1];
+      off += sizeof (uint16_t);
+      if ( (0x8100 != type) &&
+           (0x88A8 != type) )
+        break;
+      type = 0;
+      if ( (GLAB_MAX_TAGS == f->num_tags) ||
+           (off + sizeof (uint16_t) > frame_size) )
+        break;
+      f->tci[f->num_tags++] = (p[off] << 8) | p[off + 1];
+      off += sizeof (uint16_t); /* skip TCI */
+    }
+  f->ethertype = type;
+  f->l3_offset = off;
+  if ( (0x0800 != type) ||
+       (off + 20 > frame_size) )
+    return;
+  hlen = 4 * (p[off] & 0x0F);
+  if ( (0x40 != (p[off] & 0xF0)) ||
+       (hlen < 20) ||
+       (off + hlen > frame_size) )
+    return;
+  f->flags = GLAB_FRAME_IPV4;
+  if (0 != (((p[off + 6] << 8) | p[off + 7]) & 0x3FFF))
+    f->flags |= GLAB_FRAME_FRAGMENT; /* MF or offset set */
+  f->l4_offset = off + hlen;
+  f->ip_length = (p[off + 2] << 8) | p[off + 3];
+  f->ip_ttl = p[off + 8];
+  f->ip_proto = p[off + 9];
+  memcpy (&f->ip_src,
+          &p[off + 12],
+          sizeof (struct in_addr));
+  memcpy (&f->ip_dst,
+          &p[off + 16],
+          sizeof (struct in_addr));
+}
+
+
+/**
+ * Parse @a frame into descriptor @a f (see loop_parse_headers()),
+ * accounting the time to the "parse" stage.  Each frame is parsed
+ * once before it is handed to its handler.
+ *
+ * @param[out] f descriptor to initialize
+ * @param interface interface the frame was received on
+ * @param frame the frame
+ * @param frame_size number of bytes in @a frame
+ */
+static void
+loop_parse_frame (struct GLAB_Frame *f,
+                  uint16_t interface,
+                  const char *frame,
+                  uint16_t frame_size)
+{
+  struct PerfProbe probe;
+
+  perf_begin (&probe);
+  loop_parse_headers (f,
+                      interface,
+                      frame,
+                      frame_size);
+  perf_end (PERF_PARSE,
+            &probe);
+}
+
+
+#ifdef GLAB_HANDLE_FRAMES
+/**
+ * Frames collected for the next handle_frames() call.
+ */
+static struct GLAB_Frame loop_frames[LOOP_MAX_FRAMES];
+
+/**
+ * Number of entries in #loop_frames.
+ */
+static unsigned int loop_frames_cnt;
+
+
+/**
+ * Pass collected frames to handle_frames().
+ */
+static void
+loop_frames_flush ()
+{
+  if (0 == loop_frames_cnt)
+    return;
+  handle_frames (loop_frames,
+                 loop_frames_cnt);
+  loop_frames_cnt = 0;
+}
+
+
+/**
+ * Add frame to the vector for handle_frames().
+ *
+ * @param interface interface the frame was received on
+ * @param frame the frame
+ * @param frame_size number of bytes in @a frame
+ */
+static void
+loop_frames_add (uint16_t interface,
+                 const char *frame,
+                 uint16_t frame_size)
+{
+  loop_parse_frame (&loop_frames[loop_frames_cnt++],
+                    interface,
+                    frame,
+                    frame_size);
+  if (LOOP_MAX_FRAMES == loop_frames_cnt)
+    loop_frames_flush ();
+}
+#endif
+
+
+#include "workers.c"
+
+
+/**
+ * Fire expired timers; workers (if any) must not run concurrently.
+ */
+static void
+loop_run_timers ()
+{
+  if ( (0 != num_workers) &&
+       (timer_due ()) )
+    workers_quiesce ();
+  timer_run ();
+}
+
+
+/**
+ * Dispatch message @a msg of @a size bytes (header included) to
+ * handle_mac(), handle_control() or handle_frame().
+ *
+ * @param msg the message, may be modified by the handler
+ * @param size number of bytes in @a msg
+ * @param have_mac set to 1 once the MAC list was received
+ */
+static void
+loop_dispatch (char *msg,
+               uint16_t size,
+               int *have_mac)
+{
+  struct GLAB_MessageHeader hdr;
+
+  memcpy (&hdr,
+          msg,
+          sizeof (hdr));
+  switch (ntohs (hdr.type)) {
+  case 0: /* control */
+    if (0 != num_workers)
+      workers_quiesce (); /* commands never race with frame handlers */
+#ifdef GLAB_HANDLE_FRAMES
+    loop_frames_flush (); /* keep order between frames and commands */
+#endif
+    if (0 == *have_mac)
+      {
+        for (unsigned int i=0;i<(size - sizeof (hdr)) / sizeof (struct MacAddress);i++)
+          {
+            struct MacAddress mac;
+
+            memcpy (&mac,
+                    &msg[sizeof (hdr) + i * sizeof (struct MacAddress)],
+                    sizeof (struct MacAddress));
+            handle_mac (i + 1,
+                        &mac);
+          }
+        *have_mac = 1;
+      }
+    else
+      {
+        handle_control (&msg[sizeof (hdr)],
+                        size - sizeof (hdr));
+        print_flush ();
+      }
+    break;
+  default:
+    TRACE (TRACE_LEVEL_FRAME, TRACE_FRAME_IN, ntohs (hdr.type),
+           size - sizeof (hdr),
+           (size - sizeof (hdr) >= MAC_ADDR_SIZE)
+           ? trace_mac ((const struct MacAddress *) &msg[sizeof (hdr)])
+           : 0);
+    perf_frame ();
+    if (0 != num_workers)
+      {
+        workers_dispatch (ntohs (hdr.type),
+                          &msg[sizeof (hdr)],
+                          size - sizeof (hdr));
+        break;
+      }
+#ifdef GLAB_HANDLE_FRAMES
+    loop_frames_add (ntohs (hdr.type),
+                     &msg[sizeof (hdr)],
+                     size - sizeof (hdr));
+#else
+    {
+      struct GLAB_Frame f;
+
+      loop_parse_frame (&f,
+                        ntohs (hdr.type),
+                        &msg[sizeof (hdr)],
+                        size - sizeof (hdr));
+      handle_frame (&f);
+    }
+#endif
+    break;
+  }
+}
+
+
 /**
  * Sample main loop.  Reads packets from STDIN_FILENO
  * and calls handle_mac(), handle_control() or handle_frame()
- * on each depending on the type.
+ * on each depending on the type.  Programs that define
+ * GLAB_HANDLE_FRAMES before including this file implement
+ * handle_frames() instead of handle_frame() and get all frames of
+ * a read at once (up to #LOOP_MAX_FRAMES, and split at commands).
+ * Programs that define GLAB_WORKER_THREADS may have their frames
+ * handled by worker threads, see workers.c.
+ *
+ * Messages are dispatched in place: we read as much as fits into a
+ * large buffer, hand out every complete message from it and only
+ * move the (partial) rest to the front once there is no longer room
+ * for a maximum-size message at the end.  Output produced by the
+ * handlers is flushed after each such batch, before the buffer is
+ * touched again, so frames from the buffer are sent without copying.
+ * Our stdout is non-blocking: if the parent does not keep up, output
+ * waits in bounded per-interface queues (see output_drain()) while we
+ * keep processing input.  Timers (see timer.c) are run before each
+ * batch and whenever poll() times out for them.
  */
 static void
 loop ()
 {
-  char buf[UINT16_MAX];
-  size_t off;
+  static char buf[LOOP_BUFFER_SIZE];
+  size_t start;
+  size_t end;
   ssize_t ret;
   int have_mac;
 
-  off = 0;
+  start = 0;
+  end = 0;
   have_mac = 0;
-  while (-1 != (ret = read (STDIN_FILENO,
-                            &buf[off],
-                            sizeof (buf) - off)))
+  output_stable = buf;
+  output_stable_size = sizeof (buf);
+  {
+    int flags = fcntl (STDOUT_FILENO,
+                       F_GETFL);
+
+    if ( (-1 == flags) ||
+         (0 != fcntl (STDOUT_FILENO,
+                      F_SETFL,
+                      flags | O_NONBLOCK)) )
+      fprintf (stderr,
+               "Failed to make stdout non-blocking: %s\n",
+               strerror (errno));
+  }
+  timer_init ();
+  trace_start ();
+  perf_init ();
+  if (0 != workers_start ())
+    fprintf (stderr,
+             "Failed to start all workers, continuing with %u\n",
+             num_workers);
+  while (1)
     {
-      struct GLAB_MessageHeader hdr;
-      uint16_t size;
+      /* send what the last batch produced; it may reference 'buf' */
+      if (0 != num_workers)
+        workers_collect ();
+      {
+        struct PerfProbe probe;
+
+        perf_begin (&probe);
+        output_flush ();
+        perf_end (PERF_WRITE,
+                  &probe);
+      }
+      if ( (0 != output_queued) ||
+           (0 != num_workers) ||
+           (timer_pending ()) ||
+           (perf_enabled) )
+        {
+          /* parent is slow or workers may produce output: keep
+             reading input while we wait for either (when measuring,
+             we also wait here so that read() below never blocks) */
+          struct pollfd pfd[3] = {
+            { .fd = STDIN_FILENO, .events = POLLIN },
+            { .fd = (0 != output_queued) ? STDOUT_FILENO : -1, .events = POLLOUT },
+            { .fd = (0 != num_workers) ? workers_main.fd : -1, .events = POLLIN }
+          };
+          int timeout = timer_timeout_ms ();
 
+          if (0 != num_workers)
+            {
+              waiter_prepare (&workers_main);
+              if (workers_have_output ())
+                timeout = 0;
+            }
+          if (-1 == poll (pfd,
+                          3,
+                          timeout))
+            {
+              if (EINTR == errno)
+                continue;
+              break;
+            }
+          if (0 != num_workers)
+            waiter_done (&workers_main);
+          if (0 != pfd[1].revents)
+            output_drain ();
+          if (0 == pfd[0].revents)
+            {
+              loop_run_timers ();
+              continue;
+            }
+        }
+      if (sizeof (buf) - end <= UINT16_MAX)
+        {
+          /* wrap: move partial message to the front */
+          memmove (buf,
+                   &buf[start],
+                   end - start);
+          end -= start;
+          start = 0;
+        }
+      {
+        struct PerfProbe probe;
+
+        perf_begin (&probe);
+        ret = read (STDIN_FILENO,
+                    &buf[end],
+                    sizeof (buf) - end);
+        perf_end (PERF_READ,
+                  &probe);
+      }
       if (0 >= ret)
-	break;
-      off += ret;
-      while (off > sizeof (struct GLAB_MessageHeader))
-	{
-	  memcpy (&hdr,
-		  buf,
-		  sizeof (hdr));
-	  size = ntohs (hdr.size);
-	  if (off < size)
-	    break;
+        {
+          if ( (-1 == ret) &&
+               (EINTR == errno) )
+            continue;
+          break;
+        }
+      end += ret;
+      loop_run_timers ();
+      while (end - start >= sizeof (struct GLAB_MessageHeader))
+        {
+          struct GLAB_MessageHeader hdr;
+          uint16_t size;
+
+          memcpy (&hdr,
+                  &buf[start],
+                  sizeof (hdr));
+          size = ntohs (hdr.size);
           if (size < sizeof (struct GLAB_MessageHeader))
             abort ();
-	  switch (ntohs (hdr.type)) {
-	  case 0: /* control */
-	    if (0 == have_mac)
-	      {
-		for (unsigned int i=0;i<(size - sizeof (hdr)) / sizeof (struct MacAddress);i++)
-		  {
-		    struct MacAddress mac;
-
-		    memcpy (&mac,
-			    &buf[sizeof (hdr) + i * sizeof (struct MacAddress)],
-			    sizeof (struct MacAddress));
-		    handle_mac (i + 1,
-				&mac);
-		  }
-		have_mac = 1;
-	      }
-	    else
-	      {
-		handle_control (&buf[sizeof (hdr)],
-				size - sizeof (hdr));
-	      }
-	    break;
-	  default:
-	    handle_frame (ntohs (hdr.type),
-			  (const void *) &buf[sizeof (hdr)],
-			  size - sizeof (hdr));
-	    break;
-	  }
-	  memmove (buf,
-		   &buf[size],
-		   off - size);
-	  off -= size;
-	}
+          if (end - start < size)
+            break;
+          loop_dispatch (&buf[start],
+                         size,
+                         &have_mac);
+          start += size;
+        }
+#ifdef GLAB_HANDLE_FRAMES
+      loop_frames_flush ();
+#endif
+      if (start == end)
+        {
+          /* everything consumed, restart at the front for free */
+          start = 0;
+          end = 0;
+        }
     }
+  if (0 != num_workers)
+    workers_quiesce ();
+  snapshot_finish ();
+  output_flush_all ();
+  output_stable = NULL;
 }
@@ -24,6 +24,7 @@
  * @author Philipp Tölke
  * @author Christian Grothoff
  */
+#define _GNU_SOURCE
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
@@ -62,6 +63,12 @@
  */
 #define FILTER_BY_MAC 0
 
+/**
+ * Environment variable that, if set, enables the XDP fast path
+ * for known unicast frames (see xdp.c).
+ */
+#define XDP_ENV "GLAB_XDP"
+
 /**
  * Where is the VLAN tag in the Ethernet frame?
  */
@@ -163,6 +170,10 @@ static int child_stdout;
 static pid_t chld;
 
 
+#include "xdp.c"
+#include "sflow.c"
+
+
 /**
  * Creates a tun-interface called dev;
  *
@@ -347,6 +358,62 @@ init_tun (char *dev,
 }
 
 
+/**
+ * Send @a frame out on all interfaces in @a targets using a single
+ * sendmmsg() on @a fd.  The egress interface is selected by the
+ * address (sll_ifindex) of each message: SO_BINDTODEVICE, which
+ * init_tun() sets, only limits what a packet socket receives, it does
+ * not restrict sending with an explicit address.
+ *
+ * @param fd socket to send on
+ * @param gifc array of interfaces
+ * @param targets indices into @a gifc
+ * @param num number of entries in @a targets
+ * @param frame the frame to send
+ * @param frame_size number of bytes in @a frame
+ * @return number of interfaces the frame was sent on, -1 on error
+ */
+static int
+send_multicast (int fd,
+                struct Interface *gifc,
+                const unsigned int *targets,
+                unsigned int num,
+                const unsigned char *frame,
+                size_t frame_size)
+{
+  struct mmsghdr msgs[num];
+  struct sockaddr_ll addrs[num];
+  struct iovec iov = {
+    .iov_base = (void *) frame,
+    .iov_len = frame_size
+  };
+
+  memset (msgs,
+          0,
+          sizeof (msgs));
+  memset (addrs,
+          0,
+          sizeof (addrs));
+  for (unsigned int i=0;i<num;i++)
+    {
+      addrs[i].sll_family = AF_PACKET;
+      addrs[i].sll_ifindex = gifc[targets[i]].if_idx.ifr_ifindex;
+      addrs[i].sll_halen = MAC_ADDR_SIZE;
+      memcpy (&addrs[i].sll_addr[0],
+              frame,
+              MAC_ADDR_SIZE);
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_ll);
+      msgs[i].msg_hdr.msg_iov = &iov;
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+  return sendmmsg (fd,
+                   msgs,
+                   num,
+                   0);
+}
+
+
 /**
  * Start forwarding to and from the tunnel.
  *
@@ -374,6 +441,12 @@ run (struct Interface *gifc,
   int fmax;
   /* We treat command-line input as a special 'network interface' */
   struct Interface cmd_line;
+  /* egress interfaces (indices into 'gifc') of the #GLAB_TYPE_MULTICAST
+     message at 'bufin_write_off', 0 if it is not a multicast message */
+  unsigned int mcast_targets[gifc_len];
+  unsigned int mcast_num = 0;
+  /* number of 'mcast_targets' we are done with */
+  unsigned int mcast_done = 0;
 
   /* read refers to reading from fd, currently writing to child's stdin */
   struct Interface *current_read = NULL;
@@ -451,11 +524,16 @@ run (struct Interface *gifc,
 		    STDIN_FILENO);
       }
 
+    struct timeval tv;
+    int timeout_ms = sflow_timeout_ms ();
+
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
     int r = select (fmax + 1,
                     &fds_r,
                     &fds_w,
                     NULL,
-                    NULL);
+                    (-1 == timeout_ms) ? NULL : &tv);
     if (-1 == r)
     {
       if (EINTR == errno)
@@ -466,6 +544,7 @@ run (struct Interface *gifc,
       return;
     }
 
+    sflow_tick ();
     if (0 == r)
       continue;
 
@@ -531,6 +610,44 @@ run (struct Interface *gifc,
       {
 	struct sockaddr_ll sadr_ll;
 
+        if (0 != mcast_num)
+          {
+            int sent;
+
+            sent = send_multicast (current_write->fd,
+                                   gifc,
+                                   &mcast_targets[mcast_done],
+                                   mcast_num - mcast_done,
+                                   bufin_write_off,
+                                   bufin_write_left);
+            if (sent <= 0)
+              {
+                fprintf (stderr,
+                         "write-error to tun: %s\n",
+                         strerror (errno));
+                return;
+              }
+            for (int j=0;j<sent;j++)
+              sflow_tx (mcast_targets[mcast_done + j],
+                        bufin_write_off,
+                        bufin_write_left);
+            mcast_done += sent;
+            if (mcast_done < mcast_num)
+              {
+                current_write = &gifc[mcast_targets[mcast_done]];
+                goto write_done;
+              }
+            bufin_write_off += bufin_write_left;
+            memmove (bufin,
+                     bufin_write_off,
+                     bufin_rpos - (bufin_write_off - bufin));
+            bufin_rpos -= (bufin_write_off - bufin);
+            bufin_write_left = 0;
+            bufin_write_off = NULL;
+            mcast_num = 0;
+            current_write = NULL; /* done! */
+            goto write_done;
+          }
 	sadr_ll.sll_ifindex = current_write->if_idx.ifr_ifindex;
 	sadr_ll.sll_halen = MAC_ADDR_SIZE;
 	memcpy (&sadr_ll.sll_addr[0],
@@ -557,6 +674,9 @@ run (struct Interface *gifc,
                      "write returned 0!?\n");
             return;
           }
+        sflow_tx (current_write - gifc,
+                  bufin_write_off,
+                  written);
         bufin_write_left -= written;
         bufin_write_off += written;
         if (0 == bufin_write_left)
@@ -569,6 +689,7 @@ run (struct Interface *gifc,
             current_write = NULL; /* done! */
           }
       }
+  write_done:
 
     if (NULL == current_read)
       {
@@ -633,6 +754,62 @@ run (struct Interface *gifc,
           {
             uint16_t n = ntohs (hd.type);
 
+            if (GLAB_TYPE_FDB_UPDATE == n)
+              {
+                xdp_handle_fdb_update (gifc,
+                                       gifc_len,
+                                       bufin,
+                                       s);
+                memmove (bufin,
+                         &bufin[s],
+                         bufin_rpos - s);
+                bufin_rpos -= s;
+                goto rbuf_again;
+              }
+            if (GLAB_TYPE_MULTICAST == n)
+              {
+                struct GLAB_MulticastHeader mh;
+                uint16_t ms;
+
+                memcpy (&mh,
+                        bufin,
+                        (s < sizeof (mh)) ? s : sizeof (mh));
+                ms = ntohs (mh.mask_size);
+                if ( (s < sizeof (mh)) ||
+                     (sizeof (mh) + ms > s) )
+                  {
+                    fprintf (stderr,
+                             "Malformed multicast message\n");
+                    return;
+                  }
+                mcast_num = 0;
+                mcast_done = 0;
+                for (unsigned int b=0;b<8u * ms;b++)
+                  {
+                    if (0 == (bufin[sizeof (mh) + b / 8] & (1 << (b % 8))))
+                      continue;
+                    if (b >= gifc_len)
+                      {
+                        fprintf (stderr,
+                                 "Invalid interface %u specified in message\n",
+                                 b + 1);
+                        return;
+                      }
+                    mcast_targets[mcast_num++] = b;
+                  }
+                if (0 == mcast_num)
+                  {
+                    memmove (bufin,
+                             &bufin[s],
+                             bufin_rpos - s);
+                    bufin_rpos -= s;
+                    goto rbuf_again;
+                  }
+                current_write = &gifc[mcast_targets[0]];
+                bufin_write_left = s - sizeof (mh) - ms;
+                bufin_write_off = &bufin[sizeof (mh) + ms];
+                goto rbuf_done;
+              }
             if (0 == n)
               {
                 fprintf (stdout,
@@ -659,6 +836,7 @@ run (struct Interface *gifc,
             bufin_write_off = &bufin[sizeof (hd)];
           }
       }
+  rbuf_done:
 
     /* read from network interfaces, if possible */
     for (unsigned int i=0;i<gifc_len;i++)
@@ -705,8 +883,10 @@ run (struct Interface *gifc,
                          strerror (errno));
                 return;
               }
-	    if (sadr_ll.sll_ifindex != ifc->if_idx.ifr_ifindex)
+	    if ( (sadr_ll.sll_ifindex != ifc->if_idx.ifr_ifindex) ||
+                 (PACKET_OUTGOING == sadr_ll.sll_pkttype) )
 	      {
+                /* wrong interface, or a frame we (or the host) sent */
 #if DEBUG
 		fprintf (stderr,
 			 "recvfrom for different interface, discarding\n");
@@ -757,6 +937,9 @@ run (struct Interface *gifc,
               ret += sizeof (*tag);
             }
 
+            sflow_rx (i,
+                      iov.iov_base,
+                      ret);
             ifc->buftun_size = (size_t) ret + sizeof (struct GLAB_MessageHeader);
             hdr.type = htons (i + 1);
             hdr.size = htons (ifc->buftun_size);
@@ -770,6 +953,7 @@ run (struct Interface *gifc,
                  (0 == (0x80 & ifc->buftun[sizeof (struct GLAB_MessageHeader)])) )
               {
                 /* Not unicast to me and not multicast, ignore! */
+                sflow_rx_discard (i);
                 ifc->buftun_size = 0;
               }
 	    else
@@ -826,6 +1010,26 @@ main (int argc,
       return 1;
     }
 
+  /* Tell child which optional messages we understand */
+  {
+    unsigned int features = GLAB_FEATURE_MULTICAST;
+    char fstr[16];
+
+    if (NULL != getenv (XDP_ENV))
+      features |= GLAB_FEATURE_FDB_OFFLOAD;
+    snprintf (fstr,
+              sizeof (fstr),
+              "%x",
+              features);
+    if (0 != setenv (GLAB_FEATURES_ENV,
+                     fstr,
+                     1))
+      {
+        perror ("setenv");
+        return 1;
+      }
+  }
+
   /* Launch child process */
   {
     int cin[2];
@@ -901,6 +1105,11 @@ main (int argc,
         goto cleanup;
       }
   }
+  if ( (NULL != getenv (XDP_ENV)) &&
+       (0 != xdp_init (gifc,
+                       end - 1)) )
+    fprintf (stderr,
+             "XDP offload unavailable, forwarding everything in userspace\n");
 
   {
     struct GLAB_MessageHeader gh;
@@ -960,6 +1169,15 @@ main (int argc,
 #endif
   }
 
+  if (0 != sflow_init (gifc,
+                       end - 1))
+  {
+    fprintf (stderr,
+             "Fatal: could not set up sFlow export\n");
+    global_ret = 4;
+    goto cleanup;
+  }
+
   if (SIG_ERR ==
       signal (SIGPIPE,
 	      SIG_IGN))
@@ -980,6 +1198,8 @@ main (int argc,
   for (unsigned int i=1;i<end;i++)
     if (-1 != gifc[i-1].fd)
       close (gifc[i-1].fd);
+  sflow_done ();
+  xdp_done ();
   free (gifc);
   return global_ret;
 }
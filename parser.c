@@ -26,16 +26,12 @@
 
 
 /**
- * Process frame received from @a interface.
+ * Process frame @a f received from @a f->interface.
  *
- * @param interface number of the interface on which we received @a frame
- * @param frame the frame
- * @param frame_size number of bytes in @a frame
+ * @param f the frame, parsed by loop.c
  */
 static void
-handle_frame (uint16_t interface,
-	      const void *frame,
-	      size_t frame_size)
+handle_frame (const struct GLAB_Frame *f)
 {
 	/* fill me in! */
 }
@@ -0,0 +1,490 @@
+/*
+     This file (was) part of GNUnet.
+     Copyright (C) 2018 Christian Grothoff
+
+     GNUnet is free software: you can redistribute it and/or modify it
+     under the terms of the GNU Affero General Public License as published
+     by the Free Software Foundation, either version 3 of the License,
+     or (at your option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Affero General Public License for more details.
+
+     You should have received a copy of the GNU Affero General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file perf.c
+ * @brief Per-stage cycle accounting for the data path.  Always
+ *        compiled in but off until enabled with the "perf start"
+ *        command or GLAB_PERF=1, so that production builds can be
+ *        measured without an external profiler; while off, each
+ *        probe costs one predictable branch.  Cycles come from the
+ *        TSC (nanoseconds where there is none); where the kernel
+ *        allows perf_event_open(), cache and branch misses are
+ *        counted as well.
+ */
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+/**
+ * Environment variable that enables measuring from the start.
+ */
+#define PERF_ENV "GLAB_PERF"
+
+/**
+ * Maximum number of threads we keep statistics for.
+ */
+#define PERF_THREADS_MAX 72
+
+
+/**
+ * Stages of the data path.
+ */
+enum PerfStage
+{
+  /**
+   * read() in loop().
+   */
+  PERF_READ = 0,
+
+  /**
+   * loop_parse_frame().
+   */
+  PERF_PARSE,
+
+  /**
+   * Table lookups and learning in the handlers.
+   */
+  PERF_LOOKUP,
+
+  /**
+   * Building or modifying headers in the handlers.
+   */
+  PERF_REWRITE,
+
+  /**
+   * Handing frames to the output layer (forward_to() and friends).
+   */
+  PERF_FORWARD,
+
+  /**
+   * Writing output to the parent, output_flush().
+   */
+  PERF_WRITE,
+
+  PERF_STAGE_MAX
+};
+
+
+/**
+ * Hardware events we try to count.
+ */
+enum PerfHw
+{
+  PERF_HW_CACHE_MISSES = 0,
+  PERF_HW_BRANCH_MISSES,
+  PERF_HW_MAX
+};
+
+
+/**
+ * Names of the stages, for the report.
+ */
+static const char *const perf_stage_names[PERF_STAGE_MAX] = {
+  "read",
+  "parse",
+  "lookup",
+  "rewrite",
+  "forward",
+  "write"
+};
+
+
+/**
+ * Totals of one stage.
+ */
+struct PerfTotals
+{
+  uint64_t calls;
+
+  uint64_t cycles;
+
+  uint64_t hw[PERF_HW_MAX];
+};
+
+
+/**
+ * Statistics and counters of one thread.
+ */
+struct PerfThread
+{
+  struct PerfTotals stage[PERF_STAGE_MAX];
+
+  /**
+   * Frames received (main thread only).
+   */
+  uint64_t frames;
+
+  /**
+   * perf_event_open() file descriptors, -1 if unavailable.
+   */
+  int hw_fd[PERF_HW_MAX];
+
+  /**
+   * Mapped control pages of @e hw_fd, for reading with rdpmc;
+   * NULL if unavailable.
+   */
+  struct perf_event_mmap_page *hw_page[PERF_HW_MAX];
+
+  /**
+   * Cycles (and hardware events) accounted to any stage so far; used
+   * to subtract nested stages from the enclosing one.
+   */
+  uint64_t accounted;
+  uint64_t hw_accounted[PERF_HW_MAX];
+
+  /**
+   * Generation of the statistics, see #perf_generation.
+   */
+  unsigned int generation;
+};
+
+
+/**
+ * Start of a measurement, see perf_begin().  Values are relative to
+ * what the thread had accounted at the time.
+ */
+struct PerfProbe
+{
+  uint64_t cycles;
+
+  uint64_t hw[PERF_HW_MAX];
+};
+
+
+/**
+ * Is measuring enabled?
+ */
+static _Atomic int perf_enabled;
+
+/**
+ * Incremented to make all threads reset their statistics.
+ */
+static _Atomic unsigned int perf_generation;
+
+/**
+ * Statistics of all threads that measured anything.
+ */
+static struct PerfThread *perf_threads[PERF_THREADS_MAX];
+
+/**
+ * Number of entries in #perf_threads.
+ */
+static _Atomic unsigned int perf_threads_len;
+
+/**
+ * Statistics of this thread, NULL until it first measures.
+ */
+static __thread struct PerfThread *perf_self;
+
+/**
+ * TSC and clock when measuring was (re)started, to calibrate.
+ */
+static uint64_t perf_start_cycles;
+static uint64_t perf_start_ns;
+
+
+/**
+ * Monotonic clock in ns.
+ */
+static uint64_t
+perf_clock_ns ()
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC,
+                 &ts);
+  return (uint64_t) ts.tv_sec * 1000000000LLU + ts.tv_nsec;
+}
+
+
+/**
+ * Current cycle count.
+ */
+static inline uint64_t
+perf_cycles ()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc ();
+#else
+  return perf_clock_ns ();
+#endif
+}
+
+
+/**
+ * Open hardware counter @a config for this thread.
+ *
+ * @param t thread to open the counter for
+ * @param i index of the counter
+ * @param config PERF_COUNT_HW_-value
+ */
+static void
+perf_open_hw (struct PerfThread *t,
+              unsigned int i,
+              uint64_t config)
+{
+  struct perf_event_attr attr;
+  void *page;
+
+  t->hw_fd[i] = -1;
+  t->hw_page[i] = NULL;
+  memset (&attr,
+          0,
+          sizeof (attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof (attr);
+  attr.config = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  t->hw_fd[i] = syscall (SYS_perf_event_open,
+                         &attr,
+                         0 /* this thread */,
+                         -1 /* any CPU */,
+                         -1,
+                         0);
+  if (-1 == t->hw_fd[i])
+    return;
+  page = mmap (NULL,
+               sysconf (_SC_PAGESIZE),
+               PROT_READ,
+               MAP_SHARED,
+               t->hw_fd[i],
+               0);
+  if (MAP_FAILED != page)
+    t->hw_page[i] = page;
+}
+
+
+/**
+ * Read hardware counter @a i of this thread, with rdpmc if the kernel
+ * allows it (no system call), otherwise with read().
+ */
+static uint64_t
+perf_read_hw (const struct PerfThread *t,
+              unsigned int i)
+{
+  uint64_t v = 0;
+
+  if (-1 == t->hw_fd[i])
+    return 0;
+#if defined(__x86_64__)
+  {
+    volatile struct perf_event_mmap_page *pc = t->hw_page[i];
+
+    if ( (NULL != pc) &&
+         (pc->cap_user_rdpmc) )
+      {
+        uint32_t seq;
+        uint32_t idx;
+        int64_t count;
+
+        do {
+          seq = pc->lock;
+          __sync_synchronize ();
+          idx = pc->index;
+          count = pc->offset;
+          if (0 != idx)
+            {
+              int64_t pmc = __rdpmc (idx - 1);
+              unsigned int shift = 64 - pc->pmc_width;
+
+              count += (pmc << shift) >> shift;
+            }
+          __sync_synchronize ();
+        } while (pc->lock != seq);
+        return (uint64_t) count;
+      }
+  }
+#endif
+  if (sizeof (v) != read (t->hw_fd[i],
+                          &v,
+                          sizeof (v)))
+    return 0;
+  return v;
+}
+
+
+/**
+ * Statistics of the calling thread, created on first use.
+ *
+ * @return NULL if there are too many threads
+ */
+static struct PerfThread *
+perf_thread ()
+{
+  struct PerfThread *t = perf_self;
+  unsigned int gen = atomic_load (&perf_generation);
+
+  if (NULL == t)
+    {
+      unsigned int i = atomic_fetch_add (&perf_threads_len,
+                                         1);
+
+      if (i >= PERF_THREADS_MAX)
+        return NULL;
+      t = calloc (1,
+                  sizeof (*t));
+      if (NULL == t)
+        abort ();
+      perf_open_hw (t,
+                    PERF_HW_CACHE_MISSES,
+                    PERF_COUNT_HW_CACHE_MISSES);
+      perf_open_hw (t,
+                    PERF_HW_BRANCH_MISSES,
+                    PERF_COUNT_HW_BRANCH_MISSES);
+      t->generation = gen;
+      perf_threads[i] = t;
+      perf_self = t;
+    }
+  if (t->generation != gen)
+    {
+      memset (t->stage,
+              0,
+              sizeof (t->stage));
+      t->frames = 0;
+      t->generation = gen;
+    }
+  return t;
+}
+
+
+/**
+ * Start measuring a stage.
+ *
+ * @param[out] p where to remember the start
+ */
+static inline void
+perf_begin (struct PerfProbe *p)
+{
+  struct PerfThread *t;
+
+  if (! atomic_load_explicit (&perf_enabled,
+                              memory_order_relaxed))
+    return;
+  t = perf_thread ();
+  if (NULL == t)
+    return;
+  if (-1 != t->hw_fd[0])
+    for (unsigned int i=0;i<PERF_HW_MAX;i++)
+      p->hw[i] = perf_read_hw (t,
+                               i) - t->hw_accounted[i];
+  p->cycles = perf_cycles () - t->accounted;
+}
+
+
+/**
+ * Finish measuring @a stage started with perf_begin().  Stages
+ * measured in between (nested) are not accounted to @a stage again.
+ *
+ * @param stage the stage
+ * @param p start of the measurement
+ */
+static inline void
+perf_end (enum PerfStage stage,
+          const struct PerfProbe *p)
+{
+  uint64_t now;
+  uint64_t delta;
+  struct PerfThread *t;
+  struct PerfTotals *s;
+
+  if (! atomic_load_explicit (&perf_enabled,
+                              memory_order_relaxed))
+    return;
+  now = perf_cycles ();
+  t = perf_self;
+  if (NULL == t)
+    return; /* enabled after perf_begin(), or too many threads */
+  s = &t->stage[stage];
+  s->calls++;
+  delta = now - t->accounted - p->cycles;
+  s->cycles += delta;
+  t->accounted += delta;
+  if (-1 != t->hw_fd[0])
+    for (unsigned int i=0;i<PERF_HW_MAX;i++)
+      {
+        delta = perf_read_hw (t,
+                              i) - t->hw_accounted[i] - p->hw[i];
+        s->hw[i] += delta;
+        t->hw_accounted[i] += delta;
+      }
+}
+
+
+/**
+ * Count a received frame (main thread).
+ */
+static inline void
+perf_frame ()
+{
+  struct PerfThread *t;
+
+  if (! atomic_load_explicit (&perf_enabled,
+                              memory_order_relaxed))
+    return;
+  t = perf_thread ();
+  if (NULL != t)
+    t->frames++;
+}
+
+
+/**
+ * Reset all statistics and start (or continue) measuring.
+ */
+static void
+perf_start ()
+{
+  atomic_fetch_add (&perf_generation,
+                    1);
+  perf_start_cycles = perf_cycles ();
+  perf_start_ns = perf_clock_ns ();
+  atomic_store (&perf_enabled,
+                1);
+  (void) perf_thread (); /* open the counters now, not in a stage */
+}
+
+
+/**
+ * Stop measuring; the statistics are kept.
+ */
+static void
+perf_stop ()
+{
+  atomic_store (&perf_enabled,
+                0);
+}
+
+
+/**
+ * Enable measuring if requested in the environment.  Called by
+ * loop().
+ */
+static void
+perf_init ()
+{
+  const char *env = getenv (PERF_ENV);
+
+  if ( (NULL != env) &&
+       (0 != atoi (env)) )
+    perf_start ();
+}
@@ -21,48 +21,829 @@
  * @brief Helper functions for printing and communication with the parent
  * @author Christian Grothoff
  */
+#include "ring.c"
+#include "timer.c"
+#include "trace.c"
+#include "perf.c"
+#include "snapshot.c"
 
 
 /**
- * Helper function to deal with partial writes.
+ * Maximum number of iovecs (and messages) we batch before flushing.
+ */
+#define OUTPUT_MAX_IOV 1024
+
+/**
+ * Size of the arena for message headers and copied frames.
+ */
+#define OUTPUT_ARENA_SIZE (4 * (UINT16_MAX + 1))
+
+/**
+ * Maximum number of bytes we queue per interface while our parent
+ * does not accept output.  Frames beyond this are dropped.
+ */
+#define OUTPUT_QUEUE_LIMIT (4 * (UINT16_MAX + 1))
+
+/**
+ * Index of the queue for control messages (never dropped).
+ */
+#define OUTPUT_QUEUE_CONTROL 0
+
+/**
+ * Index of the queue for #GLAB_TYPE_MULTICAST messages.
+ */
+#define OUTPUT_QUEUE_MULTICAST 1
+
+
+/**
+ * Messages that could not be written yet.
+ */
+struct OutputQueue
+{
+  /**
+   * Queued messages, starting at @e off.
+   */
+  char *buf;
+
+  /**
+   * Offset of the first unwritten byte in @e buf.
+   */
+  size_t off;
+
+  /**
+   * End of queued data in @e buf.
+   */
+  size_t len;
+
+  /**
+   * Allocated size of @e buf.
+   */
+  size_t cap;
+
+  /**
+   * Bytes left of the message at @e off if we wrote part of it
+   * already, 0 if @e off is at a message boundary.
+   */
+  size_t head_left;
+
+  /**
+   * Number of messages dropped because the queue was full.
+   */
+  uint64_t drops;
+};
+
+
+/**
+ * Pending output, written by output_flush().
+ */
+static struct iovec output_iov[OUTPUT_MAX_IOV];
+
+/**
+ * Number of entries used in #output_iov.
+ */
+static unsigned int output_iov_cnt;
+
+/**
+ * Type of each message in the pending output.
+ */
+static uint16_t output_msg_type[OUTPUT_MAX_IOV];
+
+/**
+ * Size of each message in the pending output.
+ */
+static uint16_t output_msg_size[OUTPUT_MAX_IOV];
+
+/**
+ * Number of messages in the pending output.
+ */
+static unsigned int output_msg_cnt;
+
+/**
+ * Memory for headers and for frames that we cannot reference.
+ */
+static char output_arena[OUTPUT_ARENA_SIZE];
+
+/**
+ * Number of bytes used in #output_arena.
+ */
+static size_t output_arena_len;
+
+/**
+ * Memory that stays valid until the next output_flush(), typically
+ * the input buffer of loop().  Frames in there are not copied.
+ */
+static const char *output_stable;
+
+/**
+ * Number of bytes at #output_stable.
+ */
+static size_t output_stable_size;
+
+/**
+ * Set in worker threads (see workers.c): output goes into this ring
+ * and the main thread writes it for us.
+ */
+static __thread struct GLAB_Ring *output_sink;
+
+/**
+ * Queues, see #OUTPUT_QUEUE_CONTROL and #OUTPUT_QUEUE_MULTICAST;
+ * interface n uses index n + 1.
+ */
+static struct OutputQueue *output_queues;
+
+/**
+ * Number of entries in #output_queues.
+ */
+static unsigned int output_queues_len;
+
+/**
+ * Total number of bytes in #output_queues.
+ */
+static size_t output_queued;
+
+/**
+ * Queue to start with when draining, for fairness.
+ */
+static unsigned int output_rr;
+
+
+/**
+ * Which queue do messages of @a type go to?
+ */
+static unsigned int
+output_queue_index (uint16_t type)
+{
+  if (GLAB_TYPE_MULTICAST == type)
+    return OUTPUT_QUEUE_MULTICAST;
+  if ( (0 == type) ||
+       (type >= GLAB_TYPE_RESERVED) )
+    return OUTPUT_QUEUE_CONTROL;
+  return type + 1;
+}
+
+
+/**
+ * Append @a size bytes of @a data to queue @a idx.
+ *
+ * @param idx queue index
+ * @param data bytes to queue
+ * @param size number of bytes in @a data
+ * @param force non-zero to ignore #OUTPUT_QUEUE_LIMIT
+ * @return 0 on success, -1 if the queue is full
+ */
+static int
+output_enqueue (unsigned int idx,
+                const void *data,
+                size_t size,
+                int force)
+{
+  struct OutputQueue *q;
+
+  if (idx >= output_queues_len)
+    {
+      output_queues = realloc (output_queues,
+                               (idx + 1) * sizeof (struct OutputQueue));
+      if (NULL == output_queues)
+        abort ();
+      memset (&output_queues[output_queues_len],
+              0,
+              (idx + 1 - output_queues_len) * sizeof (struct OutputQueue));
+      output_queues_len = idx + 1;
+    }
+  q = &output_queues[idx];
+  if ( (! force) &&
+       (OUTPUT_QUEUE_CONTROL != idx) &&
+       (q->len - q->off + size > OUTPUT_QUEUE_LIMIT) )
+    {
+      q->drops++;
+      return -1;
+    }
+  if (q->len + size > q->cap)
+    {
+      memmove (q->buf,
+               &q->buf[q->off],
+               q->len - q->off);
+      q->len -= q->off;
+      q->off = 0;
+    }
+  if (q->len + size > q->cap)
+    {
+      q->cap = 2 * (q->len + size);
+      q->buf = realloc (q->buf,
+                        q->cap);
+      if (NULL == q->buf)
+        abort ();
+    }
+  memcpy (&q->buf[q->len],
+          data,
+          size);
+  q->len += size;
+  output_queued += size;
+  return 0;
+}
+
+
+/**
+ * Mark @a size bytes of queue @a q as written.
+ */
+static void
+output_consume (struct OutputQueue *q,
+                size_t size)
+{
+  output_queued -= size;
+  while (size > 0)
+    {
+      struct GLAB_MessageHeader hdr;
+      size_t step;
+
+      if (0 == q->head_left)
+        {
+          memcpy (&hdr,
+                  &q->buf[q->off],
+                  sizeof (hdr));
+          q->head_left = ntohs (hdr.size);
+        }
+      step = (size < q->head_left) ? size : q->head_left;
+      q->head_left -= step;
+      q->off += step;
+      size -= step;
+    }
+  if (q->off == q->len)
+    {
+      q->off = 0;
+      q->len = 0;
+    }
+}
+
+
+/**
+ * Write as much queued output as our parent accepts right now.
+ * A partially written message is always continued first.
  * Fails hard (calls exit() on failures)!
+ */
+static void
+output_drain ()
+{
+  while (output_queued > 0)
+    {
+      struct iovec iov[output_queues_len];
+      unsigned int idx[output_queues_len];
+      unsigned int cnt = 0;
+      ssize_t ret;
+
+      for (unsigned int i=0;i<output_queues_len;i++)
+        if (0 != output_queues[i].head_left)
+          idx[cnt++] = i;
+      if (0 == cnt)
+        {
+          if (output_queues[OUTPUT_QUEUE_CONTROL].len >
+              output_queues[OUTPUT_QUEUE_CONTROL].off)
+            idx[cnt++] = OUTPUT_QUEUE_CONTROL;
+          for (unsigned int j=0;j<output_queues_len;j++)
+            {
+              unsigned int i = (output_rr + j) % output_queues_len;
+
+              if ( (OUTPUT_QUEUE_CONTROL != i) &&
+                   (output_queues[i].len > output_queues[i].off) )
+                idx[cnt++] = i;
+            }
+          output_rr++;
+        }
+      for (unsigned int i=0;i<cnt;i++)
+        {
+          struct OutputQueue *q = &output_queues[idx[i]];
+
+          iov[i].iov_base = &q->buf[q->off];
+          iov[i].iov_len = q->len - q->off;
+        }
+      ret = writev (STDOUT_FILENO,
+                    iov,
+                    cnt);
+      if (-1 == ret)
+        {
+          if (EINTR == errno)
+            continue;
+          if (EAGAIN == errno)
+            return;
+        }
+      if (ret <= 0)
+        {
+          fprintf (stderr,
+                   "Writing to %d failed: %s\n",
+                   STDOUT_FILENO,
+                   strerror (errno));
+          exit (1);
+        }
+      for (unsigned int i=0;(i<cnt) && (ret > 0);i++)
+        {
+          size_t step = ((size_t) ret < iov[i].iov_len) ? (size_t) ret : iov[i].iov_len;
+
+          output_consume (&output_queues[idx[i]],
+                          step);
+          ret -= step;
+        }
+    }
+}
+
+
+/**
+ * Move the pending output, except for the first @a written bytes,
+ * into the queues.  Frames for full queues are dropped.
  *
- * @param fd where to write to
- * @param buf what to write
- * @param buf_size number of bytes in @a buf
+ * @param written number of bytes of the pending output already written
  */
 static void
-write_all (int fd,
-	   const void *buf,
-	   size_t buf_size)
+output_queue_batch (size_t written)
 {
-  const char *cbuf = buf;
-  size_t off;
+  unsigned int iov_i = 0;
+  size_t iov_off = 0;
+  size_t pos = 0;
+
+  for (unsigned int m=0;m<output_msg_cnt;m++)
+    {
+      size_t size = output_msg_size[m];
+      size_t skip = 0;
+      char msg[size];
+      size_t got = 0;
+
+      if (pos + size <= written)
+        {
+          skip = size;
+        }
+      else if (pos < written)
+        {
+          skip = written - pos;
+        }
+      /* gather the message from the iovecs */
+      while (got < size)
+        {
+          size_t step = output_iov[iov_i].iov_len - iov_off;
+
+          if (step > size - got)
+            step = size - got;
+          memcpy (&msg[got],
+                  (const char *) output_iov[iov_i].iov_base + iov_off,
+                  step);
+          got += step;
+          iov_off += step;
+          if (iov_off == output_iov[iov_i].iov_len)
+            {
+              iov_i++;
+              iov_off = 0;
+            }
+        }
+      pos += size;
+      if (skip == size)
+        continue;
+      if (0 != skip)
+        {
+          /* partially written, the rest must follow next */
+          unsigned int idx = output_queue_index (output_msg_type[m]);
+
+          (void) output_enqueue (idx,
+                                 &msg[skip],
+                                 size - skip,
+                                 1);
+          output_queues[idx].head_left = size - skip;
+          continue;
+        }
+      (void) output_enqueue (output_queue_index (output_msg_type[m]),
+                             msg,
+                             size,
+                             0);
+    }
+}
+
 
-  off = 0;
-  while (off < buf_size)
+/**
+ * Write pending output to our parent, with a single writev() if
+ * possible.  Whatever our parent does not accept right now (if
+ * STDOUT_FILENO is non-blocking) is copied into per-interface queues
+ * which output_drain() empties later.
+ * Fails hard (calls exit() on failures)!
+ */
+static void
+output_flush ()
+{
+  struct iovec *iov = output_iov;
+  unsigned int cnt = output_iov_cnt;
+  size_t written = 0;
+
+  if (0 != output_queued)
+    output_drain ();
+  while ( (0 == output_queued) &&
+          (cnt > 0) )
     {
       ssize_t ret;
 
-      ret = write (fd,
-		   &cbuf[off],
-		   buf_size - off);
+      ret = writev (STDOUT_FILENO,
+                    iov,
+                    cnt);
+      if (-1 == ret)
+        {
+          if (EINTR == errno)
+            continue;
+          if (EAGAIN == errno)
+            break;
+        }
       if (ret <= 0)
-	{
-	  fprintf (stderr,
-		   "Writing %u bytes to %d failed: %s\n",
-		   (unsigned int) (buf_size - off),
-		   fd,
-		   strerror (errno));
-	  exit (1);
-	}
-      off += ret;
+        {
+          fprintf (stderr,
+                   "Writing to %d failed: %s\n",
+                   STDOUT_FILENO,
+                   strerror (errno));
+          exit (1);
+        }
+      written += ret;
+      while ( (cnt > 0) &&
+              ((size_t) ret >= iov->iov_len) )
+        {
+          ret -= iov->iov_len;
+          iov++;
+          cnt--;
+        }
+      if (cnt > 0)
+        {
+          iov->iov_base = (char *) iov->iov_base + ret;
+          iov->iov_len -= ret;
+        }
+    }
+  if (cnt > 0)
+    {
+      /* undo the adjustment of the partially written iovec */
+      size_t done = 0;
+
+      for (struct iovec *i = output_iov; i < iov; i++)
+        done += i->iov_len;
+      iov->iov_base = (char *) iov->iov_base - (written - done);
+      iov->iov_len += written - done;
+      output_queue_batch (written);
     }
+  output_iov_cnt = 0;
+  output_msg_cnt = 0;
+  output_arena_len = 0;
+}
+
+
+/**
+ * Write everything, waiting for our parent as long as needed.
+ * Used at exit.
+ */
+static void
+output_flush_all ()
+{
+  int flags = fcntl (STDOUT_FILENO,
+                     F_GETFL);
+
+  if ( (-1 != flags) &&
+       (0 != (flags & O_NONBLOCK)) )
+    (void) fcntl (STDOUT_FILENO,
+                  F_SETFL,
+                  flags & ~O_NONBLOCK);
+  output_flush ();
+  output_drain ();
 }
 
 
 /**
- * Print message to the user by sending to parent.
+ * Append @a size bytes at @a data to the pending output, copying them
+ * into the arena unless they are in stable memory.  The caller must
+ * have ensured there is room.
+ *
+ * @param data bytes to send
+ * @param size number of bytes in @a data
+ */
+static void
+output_append (const void *data,
+               size_t size)
+{
+  const char *cdata = data;
+
+  if (0 == size)
+    return;
+  if ( (NULL == output_stable) ||
+       (cdata < output_stable) ||
+       (cdata + size > output_stable + output_stable_size) )
+    {
+      memcpy (&output_arena[output_arena_len],
+              data,
+              size);
+      cdata = &output_arena[output_arena_len];
+      output_arena_len += size;
+    }
+  if ( (output_iov_cnt > 0) &&
+       ((const char *) output_iov[output_iov_cnt - 1].iov_base
+        + output_iov[output_iov_cnt - 1].iov_len == cdata) )
+    {
+      /* contiguous with what we queued last, e.g. header and copy */
+      output_iov[output_iov_cnt - 1].iov_len += size;
+      return;
+    }
+  output_iov[output_iov_cnt].iov_base = (void *) cdata;
+  output_iov[output_iov_cnt].iov_len = size;
+  output_iov_cnt++;
+}
+
+
+/**
+ * Queue a message for our parent.  The message is only written by
+ * the next output_flush(), which loop() does after every batch of
+ * input, or at exit.
+ *
+ * @param type message type (interface number, 0 for control)
+ * @param prefix bytes to send after the header, copied
+ * @param prefix_size number of bytes in @a prefix
+ * @param body bytes to send after @a prefix, not copied if in stable memory
+ * @param body_size number of bytes in @a body
+ */
+static void
+output_message (uint16_t type,
+                const void *prefix,
+                size_t prefix_size,
+                const void *body,
+                size_t body_size)
+{
+  static int registered;
+  struct GLAB_MessageHeader hdr;
+  size_t size = sizeof (hdr) + prefix_size + body_size;
+
+  if (size > UINT16_MAX)
+    {
+      fprintf (stderr,
+               "Message of %u bytes too large\n",
+               (unsigned int) size);
+      exit (1);
+    }
+  if (NULL != output_sink)
+    {
+      while (0 != ring_push (output_sink,
+                             type,
+                             prefix,
+                             prefix_size,
+                             body,
+                             body_size))
+        {
+          /* main thread is behind, give it time to catch up */
+          struct timespec ts = { 0, 20000 };
+
+          nanosleep (&ts,
+                     NULL);
+        }
+      return;
+    }
+  if (! registered)
+    {
+      atexit (&output_flush_all);
+      registered = 1;
+    }
+  if ( (output_iov_cnt + 3 > OUTPUT_MAX_IOV) ||
+       (output_msg_cnt + 1 > OUTPUT_MAX_IOV) ||
+       (output_arena_len + size > OUTPUT_ARENA_SIZE) )
+    output_flush ();
+  hdr.size = htons (size);
+  hdr.type = htons (type);
+  output_append (&hdr,
+                 sizeof (hdr));
+  output_append (prefix,
+                 prefix_size);
+  output_append (body,
+                 body_size);
+  output_msg_type[output_msg_cnt] = type;
+  output_msg_size[output_msg_cnt] = size;
+  output_msg_cnt++;
+}
+
+
+/**
+ * Queue @a frame for sending out on interface @a ifc_num.
+ *
+ * @param ifc_num number of the interface
+ * @param frame the frame
+ * @param frame_size number of bytes in @a frame
+ */
+static void
+output_frame (uint16_t ifc_num,
+              const void *frame,
+              size_t frame_size)
+{
+  struct PerfProbe probe;
+
+  perf_begin (&probe);
+  TRACE (TRACE_LEVEL_FRAME, TRACE_FRAME_OUT, ifc_num, frame_size,
+         (frame_size >= MAC_ADDR_SIZE) ? trace_mac (frame) : 0);
+  output_message (ifc_num,
+                  NULL,
+                  0,
+                  frame,
+                  frame_size);
+  perf_end (PERF_FORWARD,
+            &probe);
+}
+
+
+/**
+ * Size of the text buffer.  Text is sent to the user in control
+ * messages of at most this many bytes, split at line boundaries.
+ */
+#define PRINT_BUFFER_SIZE (UINT16_MAX - sizeof (struct GLAB_MessageHeader))
+
+/**
+ * Text not yet sent, plus room for the 0-terminator of vsnprintf().
+ */
+static char print_buffer[PRINT_BUFFER_SIZE + 1];
+
+/**
+ * Number of bytes in #print_buffer.
+ */
+static size_t print_len;
+
+/**
+ * Number of bytes of complete lines at the start of #print_buffer.
+ */
+static size_t print_lines;
+
+
+/**
+ * Send the first @a size bytes of #print_buffer to the user, which
+ * must be all of it or #print_lines.
+ */
+static void
+print_send (size_t size)
+{
+  if (0 == size)
+    return;
+  output_message (0,
+                  NULL,
+                  0,
+                  print_buffer,
+                  size);
+  memmove (print_buffer,
+           &print_buffer[size],
+           print_len - size);
+  print_len -= size;
+  print_lines = 0;
+}
+
+
+/**
+ * Send all buffered text to the user.  loop() calls it after every
+ * control message, so command handlers need not.
+ */
+static void
+print_flush ()
+{
+  print_send (print_len);
+}
+
+
+/**
+ * Make room for @a size more bytes of text, sending the complete
+ * lines (or, for very long lines, everything) if the buffer is full.
+ *
+ * @param size number of bytes needed, at most #PRINT_BUFFER_SIZE
+ * @return where to write the text, then call print_commit()
+ */
+static char *
+print_reserve (size_t size)
+{
+  if (print_len + size > PRINT_BUFFER_SIZE)
+    print_send ((0 != print_lines) ? print_lines : print_len);
+  if (print_len + size > PRINT_BUFFER_SIZE)
+    print_send (print_len);
+  return &print_buffer[print_len];
+}
+
+
+/**
+ * Add @a size bytes written at print_reserve()'s result to the text.
+ */
+static void
+print_commit (size_t size)
+{
+  const char *nl = memrchr (&print_buffer[print_len],
+                            '\n',
+                            size);
+
+  print_len += size;
+  if (NULL != nl)
+    print_lines = nl - print_buffer + 1;
+}
+
+
+/**
+ * Add @a size bytes of text at @a data.
+ */
+static void
+print_add (const char *data,
+           size_t size)
+{
+  while (size > 0)
+    {
+      size_t step = (size > PRINT_BUFFER_SIZE) ? PRINT_BUFFER_SIZE : size;
+
+      memcpy (print_reserve (step),
+              data,
+              step);
+      print_commit (step);
+      data += step;
+      size -= step;
+    }
+}
+
+
+/**
+ * Add string @a str to the text.
+ */
+static void
+print_add_str (const char *str)
+{
+  print_add (str,
+             strlen (str));
+}
+
+
+/**
+ * Add @a c to the text.
+ */
+static void
+print_add_char (char c)
+{
+  *print_reserve (1) = c;
+  print_commit (1);
+}
+
+
+/**
+ * Add @a v in decimal to the text.
+ */
+static void
+print_add_uint (unsigned long long v)
+{
+  char tmp[20];
+  unsigned int n = sizeof (tmp);
+  char *out;
+
+  do {
+    tmp[--n] = '0' + v % 10;
+    v /= 10;
+  } while (0 != v);
+  out = print_reserve (sizeof (tmp) - n);
+  memcpy (out,
+          &tmp[n],
+          sizeof (tmp) - n);
+  print_len += sizeof (tmp) - n;
+}
+
+
+/**
+ * Add @a mac to the text as "xx:xx:xx:xx:xx:xx".
+ */
+static void
+print_add_mac (const struct MacAddress *mac)
+{
+  static const char hex[] = "0123456789abcdef";
+  char *out = print_reserve (3 * MAC_ADDR_SIZE - 1);
+
+  for (unsigned int i=0;i<MAC_ADDR_SIZE;i++)
+    {
+      if (0 != i)
+        *out++ = ':';
+      *out++ = hex[mac->mac[i] >> 4];
+      *out++ = hex[mac->mac[i] & 15];
+    }
+  print_len += 3 * MAC_ADDR_SIZE - 1;
+}
+
+
+/**
+ * Add IPv4 address @a ip to the text in dotted-decimal notation.
+ */
+static void
+print_add_ipv4 (struct in_addr ip)
+{
+  const uint8_t *b = (const uint8_t *) &ip.s_addr;
+  char *start = print_reserve (INET_ADDRSTRLEN);
+  char *out = start;
+
+  for (unsigned int i=0;i<4;i++)
+    {
+      unsigned int v = b[i];
+
+      if (0 != i)
+        *out++ = '.';
+      if (v >= 100)
+        *out++ = '0' + v / 100;
+      if (v >= 10)
+        *out++ = '0' + (v / 10) % 10;
+      *out++ = '0' + v % 10;
+    }
+  print_len += out - start;
+}
+
+
+/**
+ * Print message to the user: add it to the text sent to the parent
+ * by the next print_flush(), like the print_add_*() functions do.
  *
  * @param fmt format string
  * @param ... arguments for @a fmt
@@ -73,7 +854,8 @@ print (const char *fmt,
 
 
 /**
- * Print message to the user by sending to parent.
+ * Print message to the user: add it to the text sent to the parent
+ * by the next print_flush(), like the print_add_*() functions do.
  *
  * @param fmt format string
  * @param ... arguments for @a fmt
@@ -82,32 +864,329 @@ static void
 print (const char *fmt,
        ...)
 {
-  char *str;
   va_list ap;
+  int n;
 
   va_start (ap,
-	    fmt);
-  vasprintf (&str,
-	     fmt,
-	     ap);
+            fmt);
+  n = vsnprintf (&print_buffer[print_len],
+                 sizeof (print_buffer) - print_len,
+                 fmt,
+                 ap);
   va_end (ap);
+  if (n < 0)
+    return;
+  if (print_len + n > PRINT_BUFFER_SIZE)
+    {
+      /* did not fit, send what we had and try again */
+      print_flush ();
+      va_start (ap,
+                fmt);
+      n = vsnprintf (print_buffer,
+                     sizeof (print_buffer),
+                     fmt,
+                     ap);
+      va_end (ap);
+      if (n > (int) PRINT_BUFFER_SIZE)
+        n = PRINT_BUFFER_SIZE; /* truncated */
+    }
+  print_len += n;
+}
+
+
+/**
+ * Which optional features does the driver support?
+ *
+ * @return bitmask of GLAB_FEATURE_* values
+ */
+static unsigned int
+glab_features ()
+{
+  static int features = -1;
+
+  if (-1 == features)
   {
-    size_t slen = strlen (str);
-    struct GLAB_MessageHeader hdr = {
-      .size = htons (slen + sizeof (struct GLAB_MessageHeader)),
-      .type = htons (0)
-    };
-    char buf[sizeof (hdr) + slen];
-
-    memcpy (buf,
-	    &hdr,
-	    sizeof (hdr));
-    memcpy (&buf[sizeof(hdr)],
-	    str,
-	    slen);
-    write_all (STDOUT_FILENO,
-	       buf,
-	       sizeof (buf));
+    const char *env = getenv (GLAB_FEATURES_ENV);
+    unsigned int f;
+
+    features = 0;
+    if ( (NULL != env) &&
+         (1 == sscanf (env,
+                       "%x",
+                       &f)) )
+      features = (int) f;
   }
-  free (str);
+  return (unsigned int) features;
+}
+
+
+/**
+ * Tell the driver that @a mac lives behind interface @a ifc_num, so
+ * that it may forward known unicast frames to @a mac without
+ * involving us.  Does nothing if the driver does not support this.
+ *
+ * @param ifc_num interface number, 0 if @a mac was forgotten
+ * @param mac the MAC address
+ */
+static void
+offload_fdb_entry (uint16_t ifc_num,
+                   const struct MacAddress *mac)
+{
+  struct GLAB_FdbUpdate fu;
+
+  if (0 == (glab_features () & GLAB_FEATURE_FDB_OFFLOAD))
+    return;
+  fu.mac = *mac;
+  fu.ifc_num = htons (ifc_num);
+  output_message (GLAB_TYPE_FDB_UPDATE,
+                  &fu.mac,
+                  sizeof (fu) - sizeof (fu.header),
+                  NULL,
+                  0);
+}
+
+
+/**
+ * Send the frame made of @a prefix followed by @a body out on all
+ * interfaces in @a ifc_nums, like forward_to_many().  Only @a prefix
+ * is copied, so a frame can go out with another header without
+ * copying (or changing) the rest of it.
+ *
+ * @param ifc_nums numbers of the interfaces to send on
+ * @param num_ifcs number of entries in @a ifc_nums
+ * @param prefix first bytes of the frame, at least the MAC addresses
+ *        if any, copied
+ * @param prefix_size number of bytes in @a prefix
+ * @param body rest of the frame, not copied if in stable memory
+ * @param body_size number of bytes in @a body
+ */
+static void
+forward_to_many_prefixed (const uint16_t *ifc_nums,
+                          unsigned int num_ifcs,
+                          const void *prefix,
+                          size_t prefix_size,
+                          const void *body,
+                          size_t body_size)
+{
+  size_t frame_size = prefix_size + body_size;
+  uint16_t max_ifc = 0;
+  size_t mask_size;
+
+  if (0 == num_ifcs)
+    return;
+  for (unsigned int i=0;i<num_ifcs;i++)
+    if (ifc_nums[i] > max_ifc)
+      max_ifc = ifc_nums[i];
+  mask_size = (max_ifc + 7) / 8;
+  if ( (num_ifcs > 1) &&
+       (0 != (glab_features () & GLAB_FEATURE_MULTICAST)) &&
+       (sizeof (struct GLAB_MulticastHeader) + mask_size + frame_size
+        <= UINT16_MAX) )
+    {
+      char mask[sizeof (uint16_t) + mask_size + prefix_size];
+      uint16_t ms = htons (mask_size);
+      struct PerfProbe probe;
+
+      perf_begin (&probe);
+
+      memcpy (mask,
+              &ms,
+              sizeof (ms));
+      memset (&mask[sizeof (ms)],
+              0,
+              mask_size);
+      for (unsigned int i=0;i<num_ifcs;i++)
+        mask[sizeof (ms) + (ifc_nums[i] - 1) / 8]
+          |= 1 << ((ifc_nums[i] - 1) % 8);
+      if (0 != prefix_size)
+        memcpy (&mask[sizeof (ms) + mask_size],
+                prefix,
+                prefix_size);
+      TRACE (TRACE_LEVEL_FRAME, TRACE_FRAME_OUT, 0, frame_size,
+             (frame_size >= MAC_ADDR_SIZE)
+             ? trace_mac ((0 != prefix_size) ? prefix : body) : 0);
+      output_message (GLAB_TYPE_MULTICAST,
+                      mask,
+                      sizeof (mask),
+                      body,
+                      body_size);
+      perf_end (PERF_FORWARD,
+                &probe);
+      return;
+    }
+  for (unsigned int i=0;i<num_ifcs;i++)
+    {
+      struct PerfProbe probe;
+
+      perf_begin (&probe);
+      TRACE (TRACE_LEVEL_FRAME, TRACE_FRAME_OUT, ifc_nums[i], frame_size,
+             (frame_size >= MAC_ADDR_SIZE)
+             ? trace_mac ((0 != prefix_size) ? prefix : body) : 0);
+      output_message (ifc_nums[i],
+                      prefix,
+                      prefix_size,
+                      body,
+                      body_size);
+      perf_end (PERF_FORWARD,
+                &probe);
+    }
+}
+
+
+/**
+ * Send @a frame out on all interfaces in @a ifc_nums.  Uses a single
+ * #GLAB_TYPE_MULTICAST message if the driver supports it, otherwise
+ * one message per interface.
+ *
+ * @param ifc_nums numbers of the interfaces to send on
+ * @param num_ifcs number of entries in @a ifc_nums
+ * @param frame the frame to send
+ * @param frame_size number of bytes in @a frame
+ */
+static void
+forward_to_many (const uint16_t *ifc_nums,
+                 unsigned int num_ifcs,
+                 const void *frame,
+                 size_t frame_size)
+{
+  forward_to_many_prefixed (ifc_nums,
+                            num_ifcs,
+                            NULL,
+                            0,
+                            frame,
+                            frame_size);
+}
+
+
+/**
+ * Report per-interface output queue state and drops to the user.
+ */
+static void
+output_print_stats ()
+{
+  for (unsigned int i=OUTPUT_QUEUE_MULTICAST;i<output_queues_len;i++)
+    {
+      const struct OutputQueue *q = &output_queues[i];
+      char name[32];
+
+      if (OUTPUT_QUEUE_MULTICAST == i)
+        snprintf (name,
+                  sizeof (name),
+                  "flood");
+      else
+        snprintf (name,
+                  sizeof (name),
+                  "interface %u",
+                  i - 1);
+      print ("%s queued=%u drops=%llu\n",
+             name,
+             (unsigned int) (q->len - q->off),
+             (unsigned long long) q->drops);
+    }
+}
+
+
+/**
+ * Handle the "trace" command: write the trace (see trace.c) to the
+ * trace file and tell the user how many records it has.
+ */
+static void
+trace_command ()
+{
+  long long n = trace_dump ();
+
+  if (-1 == n)
+    print ("trace: %s\n",
+           (ENOTSUP == errno)
+           ? "not compiled in, build with -DGLAB_TRACE_LEVEL=N"
+           : strerror (errno));
+  else
+    print ("trace: %lld records written\n",
+           n);
+}
+
+
+/**
+ * Handle the "perf" command (see perf.c).
+ *
+ * @param arg "start", "stop" or NULL to report cycles (and hardware
+ *        events) per received frame for each stage
+ */
+static void
+perf_command (const char *arg)
+{
+  struct PerfTotals sum[PERF_STAGE_MAX];
+  uint64_t frames = 0;
+  unsigned int gen = atomic_load (&perf_generation);
+  unsigned int num = atomic_load (&perf_threads_len);
+  int have_hw = 0;
+  uint64_t dns;
+
+  if ( (NULL != arg) &&
+       (0 == strcasecmp (arg,
+                         "start")) )
+    {
+      perf_start ();
+      print ("perf: measuring\n");
+      return;
+    }
+  if ( (NULL != arg) &&
+       (0 == strcasecmp (arg,
+                         "stop")) )
+    {
+      perf_stop ();
+      print ("perf: stopped\n");
+      return;
+    }
+  if (0 == gen)
+    {
+      print ("perf: not measuring, use `perf start' (or GLAB_PERF=1)\n");
+      return;
+    }
+  memset (sum,
+          0,
+          sizeof (sum));
+  if (num > PERF_THREADS_MAX)
+    num = PERF_THREADS_MAX;
+  for (unsigned int i=0;i<num;i++)
+    {
+      const struct PerfThread *t = perf_threads[i];
+
+      if ( (NULL == t) ||
+           (t->generation != gen) )
+        continue;
+      frames += t->frames;
+      if (-1 != t->hw_fd[0])
+        have_hw = 1;
+      for (unsigned int s=0;s<PERF_STAGE_MAX;s++)
+        {
+          sum[s].calls += t->stage[s].calls;
+          sum[s].cycles += t->stage[s].cycles;
+          for (unsigned int h=0;h<PERF_HW_MAX;h++)
+            sum[s].hw[h] += t->stage[s].hw[h];
+        }
+    }
+  dns = perf_clock_ns () - perf_start_ns;
+  print ("perf: %llu frames in %.3f s, %.2f cycles/ns%s\n",
+         (unsigned long long) frames,
+         dns / 1e9,
+         (0 == dns) ? 0.0 : (double) (perf_cycles () - perf_start_cycles) / dns,
+         have_hw ? "" : ", no hardware counters");
+  print ("%-8s %12s %12s %12s %12s\n",
+         "stage",
+         "calls",
+         "cycles/pkt",
+         "cmiss/pkt",
+         "bmiss/pkt");
+  for (unsigned int s=0;s<PERF_STAGE_MAX;s++)
+    {
+      double n = (0 == frames) ? 1.0 : (double) frames;
+
+      print ("%-8s %12llu %12.1f %12.3f %12.3f\n",
+             perf_stage_names[s],
+             (unsigned long long) sum[s].calls,
+             sum[s].cycles / n,
+             sum[s].hw[PERF_HW_CACHE_MISSES] / n,
+             sum[s].hw[PERF_HW_BRANCH_MISSES] / n);
+    }
 }
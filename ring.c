@@ -0,0 +1,333 @@
+/*
+     This file (was) part of GNUnet.
+     Copyright (C) 2018 Christian Grothoff
+
+     GNUnet is free software: you can redistribute it and/or modify it
+     under the terms of the GNU Affero General Public License as published
+     by the Free Software Foundation, either version 3 of the License,
+     or (at your option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Affero General Public License for more details.
+
+     You should have received a copy of the GNU Affero General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file ring.c
+ * @brief Lock-free single-producer/single-consumer queue of GLAB
+ *        messages, and a way to sleep until one arrives
+ */
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+
+/**
+ * Lets one thread sleep until another has something for it.
+ */
+struct GLAB_Waiter
+{
+  /**
+   * Non-zero while the owner is (about to be) asleep.
+   */
+  atomic_int sleeping;
+
+  /**
+   * Eventfd the owner blocks on.
+   */
+  int fd;
+};
+
+
+/**
+ * Message queue with one producer and one consumer thread.
+ */
+struct GLAB_Ring
+{
+  /**
+   * Bytes ever written, updated by the producer only.
+   */
+  _Atomic size_t head __attribute__ ((aligned (64)));
+
+  /**
+   * Bytes ever read, updated by the consumer only.
+   */
+  _Atomic size_t tail __attribute__ ((aligned (64)));
+
+  /**
+   * Woken whenever the producer adds a message; may be shared by
+   * several rings with the same consumer.
+   */
+  struct GLAB_Waiter *consumer;
+
+  /**
+   * The data, @e size bytes.
+   */
+  char *buf;
+
+  /**
+   * Size of @e buf, a power of two.
+   */
+  size_t size;
+};
+
+
+/**
+ * Initialize waiter @a w.
+ *
+ * @return 0 on success
+ */
+static int
+waiter_init (struct GLAB_Waiter *w)
+{
+  atomic_init (&w->sleeping,
+               0);
+  w->fd = eventfd (0,
+                   EFD_NONBLOCK);
+  return (-1 == w->fd) ? -1 : 0;
+}
+
+
+/**
+ * Announce that the owner of @a w is going to sleep.  The owner must
+ * check for work after this and before blocking on @e fd.
+ */
+static void
+waiter_prepare (struct GLAB_Waiter *w)
+{
+  atomic_store (&w->sleeping,
+                1);
+  /* order the store before the owner's check for work; pairs with
+     the fence in waiter_wake() */
+  atomic_thread_fence (memory_order_seq_cst);
+}
+
+
+/**
+ * Owner of @a w is awake again; consume pending wakeups.
+ */
+static void
+waiter_done (struct GLAB_Waiter *w)
+{
+  uint64_t v;
+
+  atomic_store (&w->sleeping,
+                0);
+  (void) read (w->fd,
+               &v,
+               sizeof (v));
+}
+
+
+/**
+ * Wake the owner of @a w if it is sleeping.
+ */
+static void
+waiter_wake (struct GLAB_Waiter *w)
+{
+  uint64_t one = 1;
+
+  /* order the caller's publication of work (e.g. the release store
+     of a ring's head) before the load of w->sleeping; otherwise both
+     sides may miss the other and the owner sleeps with work pending */
+  atomic_thread_fence (memory_order_seq_cst);
+  if ( (0 != atomic_load (&w->sleeping)) &&
+       (0 != atomic_exchange (&w->sleeping,
+                              0)) )
+    (void) write (w->fd,
+                  &one,
+                  sizeof (one));
+}
+
+
+/**
+ * Block until the owner of @a w is woken.
+ */
+static void
+waiter_sleep (struct GLAB_Waiter *w)
+{
+  struct pollfd pfd = {
+    .fd = w->fd,
+    .events = POLLIN
+  };
+
+  (void) poll (&pfd,
+               1,
+               -1);
+  waiter_done (w);
+}
+
+
+/**
+ * Initialize @a r with @a size bytes of space.
+ *
+ * @param r ring to initialize
+ * @param size power of two
+ * @param consumer how to wake the consumer
+ * @return 0 on success
+ */
+static int
+ring_init (struct GLAB_Ring *r,
+           size_t size,
+           struct GLAB_Waiter *consumer)
+{
+  atomic_init (&r->head,
+               0);
+  atomic_init (&r->tail,
+               0);
+  r->size = size;
+  r->consumer = consumer;
+  r->buf = malloc (size);
+  return (NULL == r->buf) ? -1 : 0;
+}
+
+
+/**
+ * Copy @a size bytes from @a data to position @a pos of @a r.
+ */
+static void
+ring_write (struct GLAB_Ring *r,
+            size_t pos,
+            const void *data,
+            size_t size)
+{
+  size_t off = pos & (r->size - 1);
+  size_t first = r->size - off;
+
+  if (0 == size)
+    return;
+  if (first > size)
+    first = size;
+  memcpy (&r->buf[off],
+          data,
+          first);
+  memcpy (r->buf,
+          (const char *) data + first,
+          size - first);
+}
+
+
+/**
+ * Copy @a size bytes at position @a pos of @a r to @a data.
+ */
+static void
+ring_read (const struct GLAB_Ring *r,
+           size_t pos,
+           void *data,
+           size_t size)
+{
+  size_t off = pos & (r->size - 1);
+  size_t first = r->size - off;
+
+  if (first > size)
+    first = size;
+  memcpy (data,
+          &r->buf[off],
+          first);
+  memcpy ((char *) data + first,
+          r->buf,
+          size - first);
+}
+
+
+/**
+ * Append a message to @a r (producer only) and wake the consumer.
+ *
+ * @param r ring to append to
+ * @param type message type
+ * @param prefix first part of the body
+ * @param prefix_size number of bytes in @a prefix
+ * @param body second part of the body
+ * @param body_size number of bytes in @a body
+ * @return 0 on success, -1 if there is no room
+ */
+static int
+ring_push (struct GLAB_Ring *r,
+           uint16_t type,
+           const void *prefix,
+           size_t prefix_size,
+           const void *body,
+           size_t body_size)
+{
+  size_t head = atomic_load_explicit (&r->head,
+                                      memory_order_relaxed);
+  size_t tail = atomic_load_explicit (&r->tail,
+                                      memory_order_acquire);
+  struct GLAB_MessageHeader hdr;
+  size_t size = sizeof (hdr) + prefix_size + body_size;
+
+  if (r->size - (head - tail) < size)
+    return -1;
+  hdr.size = htons (size);
+  hdr.type = htons (type);
+  ring_write (r,
+              head,
+              &hdr,
+              sizeof (hdr));
+  ring_write (r,
+              head + sizeof (hdr),
+              prefix,
+              prefix_size);
+  ring_write (r,
+              head + sizeof (hdr) + prefix_size,
+              body,
+              body_size);
+  atomic_store_explicit (&r->head,
+                         head + size,
+                         memory_order_release);
+  waiter_wake (r->consumer);
+  return 0;
+}
+
+
+/**
+ * Take the next message from @a r (consumer only).
+ *
+ * @param r ring to read from
+ * @param[out] msg where to copy the message, header included,
+ *             must have room for a maximum-size message
+ * @return size of the message, 0 if @a r is empty
+ */
+static uint16_t
+ring_pop (struct GLAB_Ring *r,
+          void *msg)
+{
+  size_t tail = atomic_load_explicit (&r->tail,
+                                      memory_order_relaxed);
+  size_t head = atomic_load_explicit (&r->head,
+                                      memory_order_acquire);
+  struct GLAB_MessageHeader hdr;
+  uint16_t size;
+
+  if (head == tail)
+    return 0;
+  ring_read (r,
+             tail,
+             &hdr,
+             sizeof (hdr));
+  size = ntohs (hdr.size);
+  ring_read (r,
+             tail,
+             msg,
+             size);
+  atomic_store_explicit (&r->tail,
+                         tail + size,
+                         memory_order_release);
+  return size;
+}
+
+
+/**
+ * Is @a r empty?  May be called from either side.
+ */
+static int
+ring_empty (struct GLAB_Ring *r)
+{
+  return atomic_load_explicit (&r->head,
+                               memory_order_acquire) ==
+    atomic_load_explicit (&r->tail,
+                          memory_order_acquire);
+}
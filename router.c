@@ -49,18 +49,6 @@
  */
 _Pragma("pack(push)") _Pragma("pack(1)")
 
-struct EthernetHeader
-{
-  struct MacAddress dst;
-  struct MacAddress src;
-
-  /**
-   * See ETH_P-values.
-   */
-  uint16_t tag;
-};
-
-
 /**
  * ARP header for Ethernet-IPv4.
  */
@@ -299,37 +287,6 @@ static unsigned int num_ifc;
 static struct Interface *gifc;
 
 
-/**
- * Forward @a frame to interface @a dst.
- *
- * @param dst target interface to send the frame out on
- * @param frame the frame to forward
- * @param frame_size number of bytes in @a frame
- */
-static void
-forward_to (struct Interface *dst,
-	    const void *frame,
-	    size_t frame_size)
-{
-  char iob[frame_size + sizeof (struct GLAB_MessageHeader)];
-  struct GLAB_MessageHeader hdr;
-
-  if (frame_size > dst->mtu)
-    abort ();
-  hdr.size = htons (sizeof (iob));
-  hdr.type = htons (dst->ifc_num);
-  memcpy (iob,
-	  &hdr,
-	  sizeof (hdr));
-  memcpy (&iob[sizeof (hdr)],
-	  frame,
-	  frame_size);
-  write_all (STDOUT_FILENO,
-	     iob,
-	     sizeof (iob));
-}
-
-
 /**
  * Create Ethernet frame and forward it via @a ifc to @a target_ha.
  *
@@ -346,23 +303,26 @@ forward_frame_payload_to (struct Interface *ifc,
                           const void *frame_payload,
                           size_t frame_payload_size)
 {
-  char frame[sizeof (struct EthernetHeader) + frame_payload_size];
   struct EthernetHeader eh;
+  struct PerfProbe probe;
 
   if (frame_payload_size + sizeof (struct EthernetHeader) > ifc->mtu)
     abort ();
+  perf_begin (&probe);
   eh.dst = *target_ha;
   eh.src = ifc->mac;
   eh.tag = ntohs (tag);
-  memcpy (frame,
-          &eh,
-          sizeof (eh));
-  memcpy (&frame[sizeof (eh)],
-          frame_payload,
-          frame_payload_size);
-  forward_to (ifc,
-              frame,
-              sizeof (frame));
+  perf_end (PERF_REWRITE,
+            &probe);
+  perf_begin (&probe);
+  /* header is copied, payload goes out without a copy if possible */
+  output_message (ifc->ifc_num,
+                  &eh,
+                  sizeof (eh),
+                  frame_payload,
+                  frame_payload_size);
+  perf_end (PERF_FORWARD,
+            &probe);
 }
 
 
@@ -401,56 +361,56 @@ handle_arp (struct Interface *ifc,
 
 
 /**
- * Parse and process frame received on @a ifc.
+ * Process frame @a f received on @a ifc.
  *
  * @param ifc interface we got the frame on
- * @param frame raw frame data
- * @param frame_size number of bytes in @a frame
+ * @param f the frame
  */
 static void
 parse_frame (struct Interface *ifc,
-	     const void *frame,
-	     size_t frame_size)
+	     const struct GLAB_Frame *f)
 {
-  struct EthernetHeader eh;
-  const char *cframe = frame;
+  const char *cframe = f->data;
 
-  if (frame_size < sizeof (eh))
+  if (f->size < sizeof (struct EthernetHeader))
   {
     fprintf (stderr,
 	     "Malformed frame\n");
     return;
   }
-  memcpy (&eh,
-	  frame,
-	  sizeof (eh));
-  switch (ntohs (eh.tag))
+  if (0 != f->num_tags)
+  {
+#if DEBUG
+    fprintf (stderr,
+             "Unsupported VLAN-tagged frame\n");
+#endif
+    return;
+  }
+  switch (f->ethertype)
   {
   case ETH_P_IPV4:
     {
-      struct IPv4Header ip;
+      struct PerfProbe probe;
 
-      if (frame_size < sizeof (struct EthernetHeader) + sizeof (struct IPv4Header))
+      if (0 == (f->flags & GLAB_FRAME_IPV4))
         {
           fprintf (stderr,
                    "Malformed frame\n");
           return;
         }
-      memcpy (&ip,
-              &cframe[sizeof (struct EthernetHeader)],
-              sizeof (struct IPv4Header));
       /* TODO: possibly do work here (ARP learning) */
+      perf_begin (&probe);
       route (ifc,
-             &ip,
-             &cframe[sizeof (struct EthernetHeader) + sizeof (struct IPv4Header)],
-             frame_size - sizeof (struct EthernetHeader) - sizeof (struct IPv4Header));
+             (const struct IPv4Header *) &cframe[f->l3_offset],
+             &cframe[f->l4_offset],
+             f->size - f->l4_offset);
+      perf_end (PERF_LOOKUP,
+                &probe);
       break;
     }
   case ETH_P_ARP:
     {
-      struct ArpHeaderEthernetIPv4 ah;
-
-      if (frame_size < sizeof (struct EthernetHeader) + sizeof (struct ArpHeaderEthernetIPv4))
+      if (f->size < f->l3_offset + sizeof (struct ArpHeaderEthernetIPv4))
         {
 #if DEBUG
           fprintf (stderr,
@@ -458,19 +418,16 @@ parse_frame (struct Interface *ifc,
 #endif
           return;
         }
-      memcpy (&ah,
-              &cframe[sizeof (struct EthernetHeader)],
-              sizeof (struct ArpHeaderEthernetIPv4));
       handle_arp (ifc,
-                  &eh,
-                  &ah);
+                  (const struct EthernetHeader *) cframe,
+                  (const struct ArpHeaderEthernetIPv4 *) &cframe[f->l3_offset]);
       break;
     }
   default:
 #if DEBUG
     fprintf (stderr,
              "Unsupported Ethernet tag %04X\n",
-             ntohs (eh.tag));
+             f->ethertype);
 #endif
     return;
   }
@@ -478,22 +435,17 @@ parse_frame (struct Interface *ifc,
 
 
 /**
- * Process frame received from @a interface.
+ * Process frame @a f received from @a f->interface.
  *
- * @param interface number of the interface on which we received @a frame
- * @param frame the frame
- * @param frame_size number of bytes in @a frame
+ * @param f the frame, parsed by loop.c
  */
 static void
-handle_frame (uint16_t interface,
-	      const void *frame,
-	      size_t frame_size)
+handle_frame (const struct GLAB_Frame *f)
 {
-  if (interface > num_ifc)
+  if (f->interface > num_ifc)
     abort ();
-  parse_frame (&gifc[interface - 1],
-	       frame,
-	       frame_size);
+  parse_frame (&gifc[f->interface - 1],
+	       f);
 }
 
 
@@ -898,9 +850,16 @@ handle_control (char *cmd,
   if (0 == strcasecmp (tok,
 		       "arp"))
     process_cmd_arp ();
+  else if (0 == strcasecmp (tok,
+			    "queues"))
+    output_print_stats ();
   else if (0 == strcasecmp (tok,
 			    "route"))
     process_cmd_route ();
+  else if (0 == strcasecmp (tok,
+			    "perf"))
+    perf_command (strtok (NULL,
+			  " "));
   else
     fprintf (stderr,
 	     "Unsupported command `%s'\n",
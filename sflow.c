@@ -0,0 +1,702 @@
+/*
+     This file (was) part of GNUnet.
+     Copyright (C) 2018 Christian Grothoff
+
+     GNUnet is free software: you can redistribute it and/or modify it
+     under the terms of the GNU Affero General Public License as published
+     by the Free Software Foundation, either version 3 of the License,
+     or (at your option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Affero General Public License for more details.
+
+     You should have received a copy of the GNU Affero General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file sflow.c
+ * @brief sFlow (version 5) style traffic sampling for network-driver.
+ *
+ * Every interface keeps a countdown of frames until its next sample,
+ * reloaded with a random value in [1, 2N-1] (mean N).  The sampling
+ * decision is thus a decrement and a branch per frame.  Sampled frame
+ * headers and periodic interface counters are encoded as sFlow v5
+ * datagrams and written either to a UNIX datagram socket (one sFlow
+ * datagram per message) or appended to a file, where each datagram is
+ * prefixed by its length as a 32-bit big-endian integer.
+ */
+#include <sys/un.h>
+
+
+/**
+ * Environment variable with the export destination: a file name, or
+ * "unix:PATH" for a UNIX datagram socket.  Sampling is off if unset.
+ */
+#define SFLOW_ENV "GLAB_SFLOW"
+
+/**
+ * Environment variable with the flow sampling rate N (1-in-N frames),
+ * 0 to only export counters.
+ */
+#define SFLOW_RATE_ENV "GLAB_SFLOW_RATE"
+
+/**
+ * Environment variable with the counter sampling interval in seconds.
+ */
+#define SFLOW_INTERVAL_ENV "GLAB_SFLOW_INTERVAL"
+
+/**
+ * Default 1-in-N sampling rate.
+ */
+#define SFLOW_DEFAULT_RATE 1000
+
+/**
+ * Default counter sampling interval (in s).
+ */
+#define SFLOW_DEFAULT_INTERVAL 20
+
+/**
+ * How many bytes of each sampled frame do we export?
+ */
+#define SFLOW_HEADER_BYTES 128
+
+/**
+ * Maximum size of an sFlow datagram we generate.
+ */
+#define SFLOW_DATAGRAM_SIZE 1400
+
+/**
+ * Flush pending flow samples at least this often (in ms).
+ */
+#define SFLOW_FLUSH_MS 1000
+
+/* sFlow v5 constants (see sflow_version_5.txt) */
+#define SFLOW_VERSION 5
+#define SFLOW_ADDRESS_IPV4 1
+#define SFLOW_FLOW_SAMPLE 1
+#define SFLOW_COUNTERS_SAMPLE 2
+#define SFLOW_FLOW_RAW_HEADER 1
+#define SFLOW_COUNTERS_GENERIC 1
+#define SFLOW_HEADER_ETHERNET 1
+#define SFLOW_IFTYPE_ETHERNET 6
+
+
+/**
+ * Per-interface counters and sampling state.
+ */
+struct SflowPort
+{
+  /**
+   * Frames left until the next flow sample.
+   */
+  uint32_t skip;
+
+  /**
+   * Total number of frames that could have been sampled.
+   */
+  uint32_t sample_pool;
+
+  /**
+   * Sequence number of the flow samples of this port.
+   */
+  uint32_t flow_seq;
+
+  /**
+   * Sequence number of the counter samples of this port.
+   */
+  uint32_t counter_seq;
+
+  uint64_t in_octets;
+  uint32_t in_ucast;
+  uint32_t in_mcast;
+  uint32_t in_bcast;
+  uint32_t in_discards;
+  uint64_t out_octets;
+  uint32_t out_ucast;
+  uint32_t out_mcast;
+  uint32_t out_bcast;
+  uint32_t out_errors;
+};
+
+
+/**
+ * Exporter state, `fd` is -1 if sampling is disabled.
+ */
+static struct
+{
+  /**
+   * Per-port state, indexed by interface number minus one.
+   */
+  struct SflowPort *ports;
+
+  /**
+   * Interfaces of the driver, same length as @e ports.
+   */
+  struct Interface *gifc;
+
+  unsigned int num_ports;
+
+  /**
+   * Where we write datagrams to.
+   */
+  int fd;
+
+  /**
+   * Non-zero if @e fd is a file and datagrams need length prefixes.
+   */
+  int is_file;
+
+  /**
+   * 1-in-N sampling rate, 0 for no flow samples.
+   */
+  uint32_t rate;
+
+  /**
+   * Counter sampling interval in ms.
+   */
+  uint64_t interval_ms;
+
+  /**
+   * xorshift32 state for the skip counts.
+   */
+  uint32_t rnd;
+
+  /**
+   * Datagram sequence number.
+   */
+  uint32_t seq;
+
+  /**
+   * Number of datagrams we failed to export.
+   */
+  uint32_t drops;
+
+  /**
+   * Time we started (in ms), for the uptime field.
+   */
+  uint64_t start_ms;
+
+  /**
+   * Time of the last counter export (in ms).
+   */
+  uint64_t last_counters_ms;
+
+  /**
+   * Time of the last datagram export (in ms).
+   */
+  uint64_t last_flush_ms;
+
+  /**
+   * Number of samples in @e buf.
+   */
+  uint32_t num_samples;
+
+  /**
+   * Number of bytes used in @e buf, the first 28 (plus the length
+   * prefix) are reserved for the datagram header.
+   */
+  size_t off;
+
+  /**
+   * Datagram under construction, with room for a length prefix.
+   */
+  unsigned char buf[sizeof (uint32_t) + SFLOW_DATAGRAM_SIZE];
+
+} sflow = {
+  .fd = -1
+};
+
+
+/**
+ * Offset of the first sample in `sflow.buf`.
+ */
+#define SFLOW_SAMPLES_OFF (sizeof (uint32_t) + 7 * sizeof (uint32_t))
+
+
+/**
+ * Return monotonic time in ms.
+ */
+static uint64_t
+sflow_now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC,
+                 &ts);
+  return (uint64_t) ts.tv_sec * 1000LLU + ts.tv_nsec / 1000000LLU;
+}
+
+
+/**
+ * Compute number of frames to skip until the next sample.
+ */
+static uint32_t
+sflow_next_skip (void)
+{
+  uint32_t x = sflow.rnd;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  sflow.rnd = x;
+  if (0 == sflow.rate)
+    return UINT32_MAX;
+  if (1 == sflow.rate)
+    return 1;
+  return 1 + x % (2 * sflow.rate - 1);
+}
+
+
+static void
+put32 (unsigned char **pos,
+       uint32_t v)
+{
+  v = htonl (v);
+  memcpy (*pos,
+          &v,
+          sizeof (v));
+  *pos += sizeof (v);
+}
+
+
+static void
+put64 (unsigned char **pos,
+       uint64_t v)
+{
+  put32 (pos,
+         (uint32_t) (v >> 32));
+  put32 (pos,
+         (uint32_t) v);
+}
+
+
+/**
+ * Finish the current datagram and export it.
+ */
+static void
+sflow_flush (void)
+{
+  unsigned char *pos;
+  size_t len;
+  ssize_t ret;
+
+  sflow.last_flush_ms = sflow_now_ms ();
+  if (0 == sflow.num_samples)
+    return;
+  len = sflow.off - sizeof (uint32_t);
+  pos = sflow.buf;
+  put32 (&pos, len);
+  put32 (&pos, SFLOW_VERSION);
+  put32 (&pos, SFLOW_ADDRESS_IPV4);
+  put32 (&pos, 0); /* agent address: unknown */
+  put32 (&pos, (uint32_t) getpid ()); /* sub-agent */
+  put32 (&pos, ++sflow.seq);
+  put32 (&pos, (uint32_t) (sflow.last_flush_ms - sflow.start_ms));
+  put32 (&pos, sflow.num_samples);
+  if (sflow.is_file)
+    ret = write (sflow.fd,
+                 sflow.buf,
+                 sflow.off);
+  else
+    ret = send (sflow.fd,
+                &sflow.buf[sizeof (uint32_t)],
+                len,
+                MSG_DONTWAIT);
+  if (ret <= 0)
+    sflow.drops++;
+  sflow.num_samples = 0;
+  sflow.off = SFLOW_SAMPLES_OFF;
+}
+
+
+/**
+ * Reserve @a size bytes for a new sample in the current datagram,
+ * flushing first if they do not fit.
+ *
+ * @return where to write the sample
+ */
+static unsigned char *
+sflow_reserve (size_t size)
+{
+  unsigned char *pos;
+
+  if (sflow.off + size > sizeof (sflow.buf))
+    sflow_flush ();
+  pos = &sflow.buf[sflow.off];
+  sflow.off += size;
+  sflow.num_samples++;
+  return pos;
+}
+
+
+/**
+ * Export a flow sample of @a frame received on @a port.
+ * Slow path of sflow_rx().
+ */
+static void
+sflow_sample (unsigned int port,
+              const unsigned char *frame,
+              size_t frame_size)
+{
+  struct SflowPort *p = &sflow.ports[port];
+  uint32_t ifindex = sflow.gifc[port].if_idx.ifr_ifindex;
+  uint32_t hlen = frame_size < SFLOW_HEADER_BYTES
+    ? frame_size
+    : SFLOW_HEADER_BYTES;
+  uint32_t hpad = (hlen + 3) & ~3;
+  uint32_t rec_len = 4 * sizeof (uint32_t) + hpad;
+  uint32_t sample_len = 8 * sizeof (uint32_t) + 2 * sizeof (uint32_t) + rec_len;
+  unsigned char *pos;
+
+  pos = sflow_reserve (2 * sizeof (uint32_t) + sample_len);
+  put32 (&pos, SFLOW_FLOW_SAMPLE);
+  put32 (&pos, sample_len);
+  put32 (&pos, ++p->flow_seq);
+  put32 (&pos, ifindex); /* source id: ifIndex */
+  put32 (&pos, sflow.rate);
+  put32 (&pos, p->sample_pool);
+  put32 (&pos, sflow.drops);
+  put32 (&pos, ifindex); /* input */
+  put32 (&pos, 0); /* output: unknown */
+  put32 (&pos, 1); /* one record */
+  put32 (&pos, SFLOW_FLOW_RAW_HEADER);
+  put32 (&pos, rec_len);
+  put32 (&pos, SFLOW_HEADER_ETHERNET);
+  put32 (&pos, frame_size);
+  put32 (&pos, 0); /* stripped */
+  put32 (&pos, hlen);
+  memcpy (pos,
+          frame,
+          hlen);
+  memset (pos + hlen,
+          0,
+          hpad - hlen);
+}
+
+
+/**
+ * Export counter samples for all interfaces.
+ */
+static void
+sflow_export_counters (void)
+{
+  const uint32_t rec_len = 88;
+  const uint32_t sample_len = 3 * sizeof (uint32_t) + 2 * sizeof (uint32_t) + rec_len;
+
+  for (unsigned int i=0;i<sflow.num_ports;i++)
+    {
+      struct SflowPort *p = &sflow.ports[i];
+      uint32_t ifindex = sflow.gifc[i].if_idx.ifr_ifindex;
+      unsigned char *pos;
+
+      pos = sflow_reserve (2 * sizeof (uint32_t) + sample_len);
+      put32 (&pos, SFLOW_COUNTERS_SAMPLE);
+      put32 (&pos, sample_len);
+      put32 (&pos, ++p->counter_seq);
+      put32 (&pos, ifindex);
+      put32 (&pos, 1); /* one record */
+      put32 (&pos, SFLOW_COUNTERS_GENERIC);
+      put32 (&pos, rec_len);
+      put32 (&pos, ifindex);
+      put32 (&pos, SFLOW_IFTYPE_ETHERNET);
+      put64 (&pos, 0); /* speed: unknown */
+      put32 (&pos, 0); /* direction: unknown */
+      put32 (&pos, 3); /* admin and operational status: up */
+      put64 (&pos, p->in_octets);
+      put32 (&pos, p->in_ucast);
+      put32 (&pos, p->in_mcast);
+      put32 (&pos, p->in_bcast);
+      put32 (&pos, p->in_discards);
+      put32 (&pos, 0); /* in errors */
+      put32 (&pos, 0); /* unknown protocols */
+      put64 (&pos, p->out_octets);
+      put32 (&pos, p->out_ucast);
+      put32 (&pos, p->out_mcast);
+      put32 (&pos, p->out_bcast);
+      put32 (&pos, 0); /* out discards */
+      put32 (&pos, p->out_errors);
+      put32 (&pos, 1); /* promiscuous */
+    }
+  sflow_flush ();
+}
+
+
+/**
+ * Account for a frame received on interface @a port, and sample it
+ * if its turn has come.
+ *
+ * @param port interface number minus one
+ * @param frame the frame
+ * @param frame_size number of bytes in @a frame
+ */
+static inline void
+sflow_rx (unsigned int port,
+          const unsigned char *frame,
+          size_t frame_size)
+{
+  struct SflowPort *p;
+
+  if (-1 == sflow.fd)
+    return;
+  p = &sflow.ports[port];
+  p->in_octets += frame_size;
+  if (0 == (frame[0] & 1))
+    p->in_ucast++;
+  else if (0xFF == frame[0])
+    p->in_bcast++;
+  else
+    p->in_mcast++;
+  p->sample_pool++;
+  if (0 != --p->skip)
+    return;
+  p->skip = sflow_next_skip ();
+  sflow_sample (port,
+                frame,
+                frame_size);
+}
+
+
+/**
+ * Account for a frame that was discarded after reception on @a port.
+ *
+ * @param port interface number minus one
+ */
+static inline void
+sflow_rx_discard (unsigned int port)
+{
+  if (-1 == sflow.fd)
+    return;
+  sflow.ports[port].in_discards++;
+}
+
+
+/**
+ * Account for a frame sent on interface @a port.
+ *
+ * @param port interface number minus one
+ * @param frame the frame
+ * @param frame_size number of bytes in @a frame, 0 on error
+ */
+static inline void
+sflow_tx (unsigned int port,
+          const unsigned char *frame,
+          size_t frame_size)
+{
+  struct SflowPort *p;
+
+  if (-1 == sflow.fd)
+    return;
+  p = &sflow.ports[port];
+  if (0 == frame_size)
+    {
+      p->out_errors++;
+      return;
+    }
+  p->out_octets += frame_size;
+  if (0 == (frame[0] & 1))
+    p->out_ucast++;
+  else if (0xFF == frame[0])
+    p->out_bcast++;
+  else
+    p->out_mcast++;
+}
+
+
+/**
+ * Export pending samples and counters if they are due.
+ * To be called from the main loop at least every
+ * sflow_timeout_ms() milliseconds.
+ */
+static void
+sflow_tick (void)
+{
+  uint64_t now;
+
+  if (-1 == sflow.fd)
+    return;
+  now = sflow_now_ms ();
+  if (now - sflow.last_counters_ms >= sflow.interval_ms)
+    {
+      sflow.last_counters_ms = now;
+      sflow_export_counters ();
+    }
+  else if (now - sflow.last_flush_ms >= SFLOW_FLUSH_MS)
+    {
+      sflow_flush ();
+    }
+}
+
+
+/**
+ * How long may the main loop sleep before calling sflow_tick()?
+ *
+ * @return timeout in ms, -1 for no limit
+ */
+static int
+sflow_timeout_ms (void)
+{
+  if (-1 == sflow.fd)
+    return -1;
+  return SFLOW_FLUSH_MS;
+}
+
+
+/**
+ * Parse an unsigned number from environment variable @a name.
+ *
+ * @param name variable to parse
+ * @param def value to return if @a name is not set
+ * @param[out] val set to the value
+ * @return 0 on success
+ */
+static int
+sflow_env_uint (const char *name,
+                unsigned int def,
+                unsigned int *val)
+{
+  const char *env = getenv (name);
+
+  *val = def;
+  if (NULL == env)
+    return 0;
+  if (1 != sscanf (env,
+                   "%u",
+                   val))
+    {
+      fprintf (stderr,
+               "Value `%s' of %s is not a number\n",
+               env,
+               name);
+      return -1;
+    }
+  return 0;
+}
+
+
+/**
+ * Set up sampling if #SFLOW_ENV is set.
+ *
+ * @param gifc array of interfaces
+ * @param gifc_len length of @a gifc
+ * @return 0 on success (including if sampling is disabled)
+ */
+static int
+sflow_init (struct Interface *gifc,
+            unsigned int gifc_len)
+{
+  const char *dst = getenv (SFLOW_ENV);
+  unsigned int rate;
+  unsigned int interval;
+
+  if (NULL == dst)
+    return 0;
+  if ( (0 != sflow_env_uint (SFLOW_RATE_ENV,
+                             SFLOW_DEFAULT_RATE,
+                             &rate)) ||
+       (0 != sflow_env_uint (SFLOW_INTERVAL_ENV,
+                             SFLOW_DEFAULT_INTERVAL,
+                             &interval)) )
+    return -1;
+  if (0 == interval)
+    {
+      fprintf (stderr,
+               "%s must be positive\n",
+               SFLOW_INTERVAL_ENV);
+      return -1;
+    }
+  if (0 == strncmp (dst,
+                    "unix:",
+                    strlen ("unix:")))
+    {
+      struct sockaddr_un un;
+      int fd;
+
+      memset (&un,
+              0,
+              sizeof (un));
+      un.sun_family = AF_UNIX;
+      dst += strlen ("unix:");
+      if (strlen (dst) >= sizeof (un.sun_path))
+        {
+          fprintf (stderr,
+                   "Socket path `%s' too long\n",
+                   dst);
+          return -1;
+        }
+      strcpy (un.sun_path,
+              dst);
+      fd = socket (AF_UNIX,
+                   SOCK_DGRAM,
+                   0);
+      if (-1 == fd)
+        {
+          perror ("socket");
+          return -1;
+        }
+      if (0 != connect (fd,
+                        (const struct sockaddr *) &un,
+                        sizeof (un)))
+        {
+          fprintf (stderr,
+                   "Failed to connect to sFlow collector `%s': %s\n",
+                   dst,
+                   strerror (errno));
+          close (fd);
+          return -1;
+        }
+      sflow.fd = fd;
+      sflow.is_file = 0;
+    }
+  else
+    {
+      sflow.fd = open (dst,
+                       O_WRONLY | O_CREAT | O_APPEND,
+                       S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+      if (-1 == sflow.fd)
+        {
+          fprintf (stderr,
+                   "Failed to open `%s': %s\n",
+                   dst,
+                   strerror (errno));
+          return -1;
+        }
+      sflow.is_file = 1;
+    }
+  sflow.ports = calloc (gifc_len,
+                        sizeof (struct SflowPort));
+  if (NULL == sflow.ports)
+    abort ();
+  sflow.gifc = gifc;
+  sflow.num_ports = gifc_len;
+  sflow.rate = rate;
+  sflow.interval_ms = 1000LLU * interval;
+  sflow.rnd = (uint32_t) getpid () ^ (uint32_t) time (NULL) ^ 0x9E3779B9u;
+  if (0 == sflow.rnd)
+    sflow.rnd = 1;
+  for (unsigned int i=0;i<gifc_len;i++)
+    sflow.ports[i].skip = sflow_next_skip ();
+  sflow.start_ms = sflow_now_ms ();
+  sflow.last_counters_ms = sflow.start_ms;
+  sflow.last_flush_ms = sflow.start_ms;
+  sflow.off = SFLOW_SAMPLES_OFF;
+  return 0;
+}
+
+
+/**
+ * Export what is left and release resources.
+ */
+static void
+sflow_done (void)
+{
+  if (-1 == sflow.fd)
+    return;
+  sflow_export_counters ();
+  close (sflow.fd);
+  sflow.fd = -1;
+  free (sflow.ports);
+  sflow.ports = NULL;
+}
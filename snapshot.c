@@ -0,0 +1,619 @@
+/*
+     This file (was) part of GNUnet.
+     Copyright (C) 2018 Christian Grothoff
+
+     GNUnet is free software: you can redistribute it and/or modify it
+     under the terms of the GNU Affero General Public License as published
+     by the Free Software Foundation, either version 3 of the License,
+     or (at your option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Affero General Public License for more details.
+
+     You should have received a copy of the GNU Affero General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file snapshot.c
+ * @brief Warm restart: programs write their tables to a snapshot
+ *        file in $GLAB_STATE_DIR periodically (and on exit) and map
+ *        it on startup instead of relearning everything.  A snapshot
+ *        is a header followed by a "binding" (which the program uses
+ *        to make sure the snapshot is for the same set of interfaces,
+ *        normally their MACs) and an array of fixed-size records.
+ *        Snapshots are replaced atomically with rename(), and
+ *        rejected on load unless magic, format version, the
+ *        program's schema version, sizes, binding and checksum all
+ *        match.  Periodic snapshots are written and synced by a
+ *        helper thread, so the disk never stalls forwarding; only
+ *        the final one on exit is written by the caller.
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+
+/**
+ * Environment variable with the directory for snapshots; without
+ * it, no snapshots are written or read.
+ */
+#define SNAPSHOT_DIR_ENV "GLAB_STATE_DIR"
+
+/**
+ * Environment variable with the number of seconds between snapshots.
+ */
+#define SNAPSHOT_INTERVAL_ENV "GLAB_STATE_INTERVAL"
+
+/**
+ * Default number of seconds between snapshots.
+ */
+#define SNAPSHOT_INTERVAL_DEFAULT 10
+
+/**
+ * Magic at the start of a snapshot.
+ */
+#define SNAPSHOT_MAGIC "GLABSNAP"
+
+/**
+ * Version of the snapshot file format (not of the records).
+ */
+#define SNAPSHOT_VERSION 1
+
+
+/**
+ * Header of a snapshot file, in host byte order (snapshots are for
+ * restarting on the same machine).  Followed by @e binding_size bytes
+ * of binding, padded to 8 bytes, and then @e count records.
+ */
+struct SnapshotHeader
+{
+  char magic[8];
+
+  /**
+   * #SNAPSHOT_VERSION.
+   */
+  uint32_t version;
+
+  /**
+   * Version of the program's record layout.
+   */
+  uint32_t schema;
+
+  uint32_t binding_size;
+
+  uint32_t record_size;
+
+  uint64_t count;
+
+  /**
+   * FNV-1a hash of binding and records.
+   */
+  uint64_t checksum;
+};
+
+
+/**
+ * A mapped snapshot, see snapshot_open().
+ */
+struct GLAB_Snapshot
+{
+  /**
+   * Mapping of the whole file.
+   */
+  void *map;
+
+  /**
+   * Size of @e map.
+   */
+  size_t map_size;
+
+  /**
+   * The records, in the mapping.
+   */
+  const void *records;
+
+  /**
+   * Number of entries in @e records.
+   */
+  size_t count;
+};
+
+
+/**
+ * Function that writes the program's snapshots.
+ */
+static void (*snapshot_save_cb)(void);
+
+/**
+ * Timer for periodic snapshots.
+ */
+static struct GLAB_Timer snapshot_timer;
+
+/**
+ * Milliseconds between snapshots.
+ */
+static uint64_t snapshot_interval_ms;
+
+/**
+ * Set by snapshot_finish(): write synchronously.
+ */
+static int snapshot_final;
+
+/**
+ * Thread writing the last periodic snapshot, if @e snapshot_writing
+ * or not yet joined.
+ */
+static pthread_t snapshot_writer;
+
+/**
+ * Is #snapshot_writer valid (started and not joined)?
+ */
+static int snapshot_writer_started;
+
+/**
+ * Set while #snapshot_writer writes.
+ */
+static _Atomic int snapshot_writing;
+
+
+/**
+ * A snapshot file image for #snapshot_writer.
+ */
+struct SnapshotJob
+{
+  char tmp[PATH_MAX];
+
+  char path[PATH_MAX];
+
+  void *image;
+
+  size_t image_size;
+};
+
+
+/**
+ * Round @a size up to a multiple of 8.
+ */
+static size_t
+snapshot_pad (size_t size)
+{
+  return (size + 7) & ~((size_t) 7);
+}
+
+
+/**
+ * Add @a size bytes at @a data to hash @a h.
+ */
+static uint64_t
+snapshot_hash (uint64_t h,
+               const void *data,
+               size_t size)
+{
+  const uint8_t *p = data;
+
+  for (size_t i=0;i<size;i++)
+    h = (h ^ p[i]) * 0x100000001b3LLU;
+  return h;
+}
+
+
+/**
+ * Build the name of snapshot @a name.
+ *
+ * @param[out] path where to write the file name
+ * @param path_size number of bytes in @a path
+ * @param name name of the snapshot, e.g. "fdb"
+ * @param suffix appended to the name
+ * @return 0 on success, -1 if there is no state directory
+ */
+static int
+snapshot_path (char *path,
+               size_t path_size,
+               const char *name,
+               const char *suffix)
+{
+  const char *dir = getenv (SNAPSHOT_DIR_ENV);
+
+  if ( (NULL == dir) ||
+       ('\0' == *dir) )
+    return -1;
+  if (snprintf (path,
+                path_size,
+                "%s/%s.snap%s",
+                dir,
+                name,
+                suffix) >= (int) path_size)
+    return -1;
+  return 0;
+}
+
+
+/**
+ * Write @a size bytes from @a data to @a fd.
+ *
+ * @return 0 on success
+ */
+static int
+snapshot_write_all (int fd,
+                    const void *data,
+                    size_t size)
+{
+  const char *pos = data;
+
+  while (size > 0)
+    {
+      ssize_t ret = write (fd,
+                           pos,
+                           size);
+
+      if (ret <= 0)
+        {
+          if ( (-1 == ret) &&
+               (EINTR == errno) )
+            continue;
+          return -1;
+        }
+      pos += ret;
+      size -= ret;
+    }
+  return 0;
+}
+
+
+/**
+ * Write @a image to @a tmp, sync it and rename it to @a path.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int
+snapshot_write (const char *tmp,
+                const char *path,
+                const void *image,
+                size_t image_size)
+{
+  int fd;
+
+  fd = open (tmp,
+             O_WRONLY | O_CREAT | O_TRUNC,
+             0644);
+  if (-1 == fd)
+    return -1;
+  if ( (0 != snapshot_write_all (fd,
+                                 image,
+                                 image_size)) ||
+       (0 != fdatasync (fd)) )
+    {
+      close (fd);
+      unlink (tmp);
+      return -1;
+    }
+  close (fd);
+  if (0 != rename (tmp,
+                   path))
+    {
+      unlink (tmp);
+      return -1;
+    }
+  return 0;
+}
+
+
+/**
+ * Main function of #snapshot_writer.
+ *
+ * @param cls the `struct SnapshotJob`, freed here
+ * @return NULL
+ */
+static void *
+snapshot_writer_run (void *cls)
+{
+  struct SnapshotJob *job = cls;
+
+  if (0 != snapshot_write (job->tmp,
+                           job->path,
+                           job->image,
+                           job->image_size))
+    fprintf (stderr,
+             "Failed to write snapshot `%s': %s\n",
+             job->path,
+             strerror (errno));
+  free (job->image);
+  free (job);
+  atomic_store (&snapshot_writing,
+                0);
+  return NULL;
+}
+
+
+/**
+ * Wait for #snapshot_writer, if any.
+ */
+static void
+snapshot_writer_join ()
+{
+  if (! snapshot_writer_started)
+    return;
+  pthread_join (snapshot_writer,
+                NULL);
+  snapshot_writer_started = 0;
+}
+
+
+/**
+ * Atomically replace snapshot @a name.  The data is copied, and,
+ * except for the final snapshot, written by a helper thread; if that
+ * is still busy with the previous snapshot, nothing is written.
+ *
+ * @param name name of the snapshot, e.g. "fdb"
+ * @param schema version of the record layout
+ * @param binding data the snapshot is only valid for
+ * @param binding_size number of bytes in @a binding
+ * @param records the records
+ * @param record_size size of each record
+ * @param count number of records
+ * @return 0 on success (or if the snapshot is being written), -1 on
+ *         error (or if there is no state directory, or the helper
+ *         thread is busy)
+ */
+static int
+snapshot_save (const char *name,
+               uint32_t schema,
+               const void *binding,
+               uint32_t binding_size,
+               const void *records,
+               uint32_t record_size,
+               size_t count)
+{
+  struct SnapshotJob *job;
+  struct SnapshotHeader hdr;
+  size_t binding_off = sizeof (hdr);
+  size_t records_off = binding_off + snapshot_pad (binding_size);
+  char *image;
+  int ret;
+
+  if ( (! snapshot_final) &&
+       (atomic_load (&snapshot_writing)) )
+    return -1;
+  job = calloc (1,
+                sizeof (*job));
+  if (NULL == job)
+    return -1;
+  job->image_size = records_off + (size_t) record_size * count;
+  if ( (0 != snapshot_path (job->tmp,
+                            sizeof (job->tmp),
+                            name,
+                            ".tmp")) ||
+       (0 != snapshot_path (job->path,
+                            sizeof (job->path),
+                            name,
+                            "")) ||
+       (NULL == (image = calloc (1,
+                                 job->image_size))) )
+    {
+      free (job);
+      return -1;
+    }
+  memset (&hdr,
+          0,
+          sizeof (hdr));
+  memcpy (hdr.magic,
+          SNAPSHOT_MAGIC,
+          sizeof (hdr.magic));
+  hdr.version = SNAPSHOT_VERSION;
+  hdr.schema = schema;
+  hdr.binding_size = binding_size;
+  hdr.record_size = record_size;
+  hdr.count = count;
+  hdr.checksum = snapshot_hash (snapshot_hash (0xcbf29ce484222325LLU,
+                                               binding,
+                                               binding_size),
+                                records,
+                                record_size * count);
+  memcpy (image,
+          &hdr,
+          sizeof (hdr));
+  memcpy (&image[binding_off],
+          binding,
+          binding_size);
+  memcpy (&image[records_off],
+          records,
+          (size_t) record_size * count);
+  job->image = image;
+  snapshot_writer_join (); /* done writing, see above */
+  if (! snapshot_final)
+    {
+      atomic_store (&snapshot_writing,
+                    1);
+      if (0 == pthread_create (&snapshot_writer,
+                               NULL,
+                               &snapshot_writer_run,
+                               job))
+        {
+          snapshot_writer_started = 1;
+          return 0;
+        }
+      atomic_store (&snapshot_writing,
+                    0);
+    }
+  ret = snapshot_write (job->tmp,
+                        job->path,
+                        job->image,
+                        job->image_size);
+  free (job->image);
+  free (job);
+  return ret;
+}
+
+
+/**
+ * Map snapshot @a name and validate it.
+ *
+ * @param[out] snap the mapped snapshot, release with snapshot_close()
+ * @param name name of the snapshot, e.g. "fdb"
+ * @param schema expected version of the record layout
+ * @param binding data the snapshot must have been written for
+ * @param binding_size number of bytes in @a binding
+ * @param record_size expected size of each record
+ * @return 0 on success, -1 if there is no valid snapshot
+ */
+static int
+snapshot_open (struct GLAB_Snapshot *snap,
+               const char *name,
+               uint32_t schema,
+               const void *binding,
+               uint32_t binding_size,
+               uint32_t record_size)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  struct SnapshotHeader hdr;
+  const char *base;
+  size_t off;
+  int fd;
+
+  memset (snap,
+          0,
+          sizeof (*snap));
+  if (0 != snapshot_path (path,
+                          sizeof (path),
+                          name,
+                          ""))
+    return -1;
+  fd = open (path,
+             O_RDONLY);
+  if (-1 == fd)
+    return -1;
+  if ( (0 != fstat (fd,
+                    &st)) ||
+       (st.st_size < (off_t) sizeof (hdr)) )
+    {
+      close (fd);
+      return -1;
+    }
+  snap->map_size = st.st_size;
+  snap->map = mmap (NULL,
+                    snap->map_size,
+                    PROT_READ,
+                    MAP_PRIVATE,
+                    fd,
+                    0);
+  close (fd);
+  if (MAP_FAILED == snap->map)
+    {
+      snap->map = NULL;
+      return -1;
+    }
+  base = snap->map;
+  memcpy (&hdr,
+          base,
+          sizeof (hdr));
+  off = sizeof (hdr) + snapshot_pad (binding_size);
+  if ( (0 != memcmp (hdr.magic,
+                     SNAPSHOT_MAGIC,
+                     sizeof (hdr.magic))) ||
+       (SNAPSHOT_VERSION != hdr.version) ||
+       (schema != hdr.schema) ||
+       (binding_size != hdr.binding_size) ||
+       (record_size != hdr.record_size) ||
+       (hdr.count > (snap->map_size - sizeof (hdr)) / record_size) ||
+       (off + hdr.count * record_size != snap->map_size) ||
+       (0 != memcmp (&base[sizeof (hdr)],
+                     binding,
+                     binding_size)) ||
+       (hdr.checksum !=
+        snapshot_hash (snapshot_hash (0xcbf29ce484222325LLU,
+                                      &base[sizeof (hdr)],
+                                      binding_size),
+                       &base[off],
+                       hdr.count * record_size)) )
+    {
+      fprintf (stderr,
+               "Ignoring stale or invalid snapshot `%s'\n",
+               path);
+      munmap (snap->map,
+              snap->map_size);
+      snap->map = NULL;
+      return -1;
+    }
+  snap->records = &base[off];
+  snap->count = hdr.count;
+  return 0;
+}
+
+
+/**
+ * Release a snapshot mapped with snapshot_open().
+ */
+static void
+snapshot_close (struct GLAB_Snapshot *snap)
+{
+  if (NULL != snap->map)
+    munmap (snap->map,
+            snap->map_size);
+  snap->map = NULL;
+}
+
+
+/**
+ * Timer callback: write snapshots and re-arm.
+ */
+static void
+snapshot_tick (void *cls)
+{
+  (void) cls;
+  snapshot_save_cb ();
+  timer_reschedule (&snapshot_timer,
+                    snapshot_interval_ms);
+}
+
+
+/**
+ * Call @a save periodically and when loop() returns if a state
+ * directory is configured.  @a save should only write snapshots
+ * whose tables changed.
+ *
+ * @param save function that writes the program's snapshots
+ * @return 1 if snapshots are enabled, 0 if not
+ */
+static int
+snapshot_start (void (*save)(void))
+{
+  const char *dir = getenv (SNAPSHOT_DIR_ENV);
+  const char *env = getenv (SNAPSHOT_INTERVAL_ENV);
+  unsigned int seconds = SNAPSHOT_INTERVAL_DEFAULT;
+
+  if ( (NULL == dir) ||
+       ('\0' == *dir) )
+    return 0;
+  if ( (NULL != env) &&
+       (1 != sscanf (env,
+                     "%u",
+                     &seconds)) )
+    seconds = SNAPSHOT_INTERVAL_DEFAULT;
+  if (0 == seconds)
+    seconds = 1;
+  snapshot_save_cb = save;
+  snapshot_interval_ms = 1000LLU * seconds;
+  timer_schedule (&snapshot_timer,
+                  snapshot_interval_ms,
+                  &snapshot_tick,
+                  NULL);
+  return 1;
+}
+
+
+/**
+ * Write final snapshots, called when loop() returns.
+ */
+static void
+snapshot_finish ()
+{
+  snapshot_writer_join ();
+  snapshot_final = 1;
+  if (NULL != snapshot_save_cb)
+    snapshot_save_cb ();
+}
@@ -21,178 +21,1462 @@
  * @brief Ethernet switch
  * @author Christian Grothoff
  */
+#define GLAB_HANDLE_FRAMES
+#define GLAB_WORKER_THREADS
 #include "glab.h"
+#include <pthread.h>
 #include "print.c"
-#include "stdbool.h"
+#include "fdb.c"
+
+
+/**
+ * Classes of flooded frames, policed separately.
+ */
+enum StormClass
+{
+  STORM_BROADCAST = 0,
+  STORM_MULTICAST,
+  STORM_UNKNOWN,
+  STORM_MAX
+};
+
+
+/**
+ * Names of the classes, for commands and environment variables.
+ */
+static const char *const storm_names[STORM_MAX] = {
+  "broadcast",
+  "multicast",
+  "unknown"
+};
+
+
+/**
+ * Token bucket policing one class of flooded frames of one port.
+ */
+struct StormBucket
+{
+  /**
+   * Tokens in thousandths of a frame.
+   */
+  uint64_t tokens;
+
+  /**
+   * Time of the last refill, in ms (timer_now()).
+   */
+  uint64_t last;
+
+  uint64_t passed;
+
+  uint64_t dropped;
+};
+
+
+/**
+ * Maximum number of interfaces in a link aggregation group.
+ */
+#define LAG_MAX_MEMBERS 16
+
+
+/**
+ * A static link aggregation group (LAG): several interfaces that act
+ * as one port.  The FDB, IGMP snooping and split horizon use the
+ * member with the lowest number to stand for the whole group; frames
+ * leave through the member selected by their flow hash, so the frames
+ * of a flow stay in order.
+ */
+struct Lag
+{
+  struct Lag *next;
+
+  /**
+   * Name of the group, e.g. "lag0".
+   */
+  char name[32];
+
+  /**
+   * Numbers of the member interfaces, ascending.
+   */
+  uint16_t members[LAG_MAX_MEMBERS];
+
+  /**
+   * Number of entries in @e members.
+   */
+  unsigned int num_members;
+};
+
+
+/**
+ * Per-interface context.
+ */
+struct Interface
+{
+  /**
+   * MAC of interface.
+   */
+  struct MacAddress mac;
+
+  /**
+   * Name of the interface (from the command line).
+   */
+  const char *name;
+
+  /**
+   * Link aggregation group the interface is in, NULL for none.
+   */
+  struct Lag *lag;
+
+  /**
+   * Number of FDB entries pointing to this interface.
+   */
+  unsigned int fdb_count;
+
+  /**
+   * Number of new MACs not learned because of #fdbPortMax.
+   */
+  uint64_t fdb_limited;
+
+  /**
+   * Storm control policers for frames received on this interface.
+   */
+  struct StormBucket storm[STORM_MAX];
+
+  /**
+   * Protects @e storm, as frames of different flows received on this
+   * interface are handled by different workers.
+   */
+  pthread_mutex_t storm_lock;
+
+  /**
+   * Until when (timer_now()) this is a multicast router port because
+   * we saw an IGMP query on it; 0 if it never was.
+   */
+  uint64_t mrouter_until;
+
+  /**
+   * Number of this interface.
+   */
+  uint16_t ifc_num;
+
+};
+
+/**
+ * Number of available contexts.
+ */
+static unsigned int num_ifc;
+
+/**
+ * All the contexts.
+ */
+static struct Interface *gifc;
+
+/**
+ * Compare two MacAddresses
+ * @param macAddress1
+ * @param macAddress2
+ * @return
+ */
+static int maccmp (const struct MacAddress *macAddress1, const struct MacAddress *macAddress2){
+    return memcmp(macAddress1, macAddress2, sizeof(struct MacAddress));
+}
+
+/**
+ * All link aggregation groups.
+ */
+static struct Lag *lags;
+
+/**
+ * Known MAC addresses and the ports they are at.
+ */
+static struct GLAB_Fdb switchFdb;
+
+/**
+ * Serializes learning of new and moved MACs, which also changes
+ * counters and may evict, among workers.  Refreshing known MACs and
+ * lookups take no lock.
+ */
+static pthread_mutex_t learnLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Environment variable with the FDB aging time in seconds, 0 to
+ * never age out entries.
+ */
+#define FDB_AGING_ENV "GLAB_FDB_AGING"
+
+/**
+ * Environment variable with the maximum number of FDB entries.
+ */
+#define FDB_MAX_ENV "GLAB_FDB_MAX"
+
+/**
+ * Environment variable with the maximum number of FDB entries per
+ * port, 0 for no limit.
+ */
+#define FDB_PORT_MAX_ENV "GLAB_FDB_PORT_MAX"
+
+/**
+ * Default aging time in seconds.
+ */
+#define FDB_AGING_DEFAULT 300
+
+/**
+ * Default maximum number of FDB entries.
+ */
+#define FDB_MAX_DEFAULT (1024 * 1024)
+
+/**
+ * Milliseconds between runs of the aging sweep.
+ */
+#define FDB_SWEEP_MS 1000
+
+/**
+ * Minimum number of slots one aging sweep looks at.
+ */
+#define FDB_SWEEP_MIN 4096
+
+/**
+ * FDB aging time in seconds, 0 for none.
+ */
+static unsigned int fdbAging = FDB_AGING_DEFAULT;
+
+/**
+ * Maximum number of FDB entries.
+ */
+static unsigned int fdbMax = FDB_MAX_DEFAULT;
+
+/**
+ * Maximum number of FDB entries per port, 0 for no limit.
+ */
+static unsigned int fdbPortMax;
+
+/**
+ * Timer for the aging sweep and freeing old FDB tables.
+ */
+static struct GLAB_Timer fdbSweepTimer;
+
+/**
+ * Environment variables with the storm control limits of the classes,
+ * as frames per second per port and optionally the burst size, e.g.
+ * GLAB_STORM_BROADCAST=1000 or GLAB_STORM_UNKNOWN=1000/50.
+ */
+static const char *const storm_env[STORM_MAX] = {
+  "GLAB_STORM_BROADCAST",
+  "GLAB_STORM_MULTICAST",
+  "GLAB_STORM_UNKNOWN"
+};
+
+/**
+ * Storm control limit of a class.
+ */
+struct StormLimit
+{
+  /**
+   * Frames per second per port, 0 for no limit.
+   */
+  unsigned int rate;
+
+  /**
+   * Frames that may pass at once after a quiet period.
+   */
+  unsigned int burst;
+};
+
+/**
+ * Storm control limits, indexed by `enum StormClass`.
+ */
+static struct StormLimit stormLimit[STORM_MAX];
+
+/**
+ * Environment variable to disable IGMP snooping (set to 0).
+ */
+#define IGMP_SNOOPING_ENV "GLAB_IGMP_SNOOPING"
+
+/**
+ * How long a port stays a member of a group after a report, in ms
+ * (the IGMP group membership interval: 2 * 125 s + 10 s).
+ */
+#define IGMP_MEMBERSHIP_MS (260 * 1000)
+
+/**
+ * How long a port stays a router port after a query, in ms (the IGMP
+ * other querier present interval).
+ */
+#define IGMP_ROUTER_MS (255 * 1000)
+
+/**
+ * How long a port stays a member after a leave, in ms, in case other
+ * hosts behind it still listen and answer the router's query (the
+ * IGMP last member query time).
+ */
+#define IGMP_LEAVE_MS (2 * 1000)
+
+/**
+ * Number of buckets of #mcastGroups, a power of two.
+ */
+#define MCAST_BUCKETS 256
+
+/**
+ * How often groups without members are freed, in ms.
+ */
+#define MCAST_AGE_MS 1000
+
+/**
+ * Kinds of IGMP messages.
+ */
+#define IGMP_QUERY 0x11
+#define IGMP_V1_REPORT 0x12
+#define IGMP_V2_REPORT 0x16
+#define IGMP_V2_LEAVE 0x17
+#define IGMP_V3_REPORT 0x22
+
+/**
+ * Kinds of IGMPv3 group records.
+ */
+#define IGMP_MODE_IS_INCLUDE 1
+#define IGMP_MODE_IS_EXCLUDE 2
+#define IGMP_CHANGE_TO_INCLUDE 3
+#define IGMP_CHANGE_TO_EXCLUDE 4
+#define IGMP_ALLOW_NEW_SOURCES 5
+
+/**
+ * A multicast group that has (or recently had) members.
+ */
+struct McastGroup
+{
+  struct McastGroup *next;
+
+  /**
+   * Address of the group.
+   */
+  struct in_addr group;
+
+  /**
+   * Until when (timer_now()) each port is a member, indexed by
+   * interface number minus one; 0 if it is not.
+   */
+  uint64_t member_until[];
+};
+
+/**
+ * Is IGMP snooping enabled?
+ */
+static int igmpSnooping = 1;
+
+/**
+ * Groups with members, hashed by address.
+ */
+static struct McastGroup *mcastGroups[MCAST_BUCKETS];
+
+/**
+ * Protects #mcastGroups, the members of the groups and the router
+ * ports against concurrent workers: IGMP messages are snooped under
+ * the write lock, other multicast frames forwarded under the read
+ * lock.  Groups are only freed by #mcastAgeTimer, which runs while
+ * workers are idle.
+ */
+static pthread_rwlock_t mcastLock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Frees groups without members; membership itself ends by time, see
+ * mcast_forward().
+ */
+static struct GLAB_Timer mcastAgeTimer;
+
+/**
+ * FDB statistics, for "mac stats".
+ */
+static struct
+{
+  uint64_t learned;
+  uint64_t moved;
+  uint64_t aged;
+  uint64_t evicted;
+  uint64_t flushed;
+} fdbStats;
+
+/**
+ * Version of the layout of `struct FdbRecord`.
+ */
+#define FDB_SNAPSHOT_SCHEMA 1
+
+/**
+ * Entry of #switchFdb in a snapshot.
+ */
+struct FdbRecord
+{
+  struct MacAddress mac;
+
+  /**
+   * Interface number, in host byte order.
+   */
+  uint16_t ifc_num;
+};
+
+/**
+ * Did #switchFdb change since the last snapshot?
+ */
+static int fdbDirty;
+
+
+/**
+ * Forward @a frame to interface @a dst.
+ *
+ * @param dst target interface to send the frame out on
+ * @param frame the frame to forward
+ * @param frame_size number of bytes in @a frame
+ */
+static void
+forward_to (struct Interface *dst,
+	    const void *frame,
+	    size_t frame_size)
+{
+  output_frame (dst->ifc_num,
+                frame,
+                frame_size);
+}
+
+
+/**
+ * Hash of the flow of @a f, see workers.c.
+ */
+static uint32_t
+workers_flow_hash (const struct GLAB_Frame *f);
+
+
+/**
+ * The port @a ifc belongs to: the first member of its link aggregation
+ * group, or @a ifc itself.
+ */
+static struct Interface *
+lag_port (struct Interface *ifc)
+{
+  if (NULL == ifc->lag)
+    return ifc;
+  return &gifc[ifc->lag->members[0] - 1];
+}
+
+
+/**
+ * Should frames with flow hash @a hash leave port lag_port(@a ifc)
+ * through @a ifc?
+ */
+static int
+lag_selected (const struct Interface *ifc,
+              uint32_t hash)
+{
+  return (NULL == ifc->lag) ||
+    (ifc->ifc_num == ifc->lag->members[hash % ifc->lag->num_members]);
+}
+
+
+/**
+ * Interface through which frames with flow hash @a hash leave port
+ * @a port.
+ */
+static struct Interface *
+lag_egress (struct Interface *port,
+            uint32_t hash)
+{
+  if (NULL == port->lag)
+    return port;
+  return &gifc[port->lag->members[hash % port->lag->num_members] - 1];
+}
+
+
+/**
+ * Current time for FDB entries, in seconds.
+ */
+static uint32_t
+fdb_now ()
+{
+  return (uint32_t) (timer_now () / 1000);
+}
+
+
+/**
+ * Forget FDB entry @a e for @a key, which is about to be removed.
+ *
+ * @param cls counter to increment, or NULL
+ * @param key key of the entry
+ * @param e the entry
+ */
+static void
+forget (void *cls,
+        uint64_t key,
+        const struct GLAB_FdbEntry *e)
+{
+  uint64_t *counter = cls;
+  struct MacAddress mac;
+
+  if (NULL != counter)
+    (*counter)++;
+  gifc[e->port - 1].fdb_count--;
+  fdb_key_mac (key,
+               &mac);
+  offload_fdb_entry (0,
+                     &mac);
+  fdbDirty = 1;
+}
+
+
+/**
+ * Learn that @a src is at @a ifc, or that it moved there.
+ *
+ * @param ifc port (see lag_port()) we got a frame from @a src on
+ * @param src source MAC of the frame
+ */
+static void
+learn (struct Interface *ifc,
+       const struct MacAddress *src)
+{
+  uint64_t key = fdb_key (src,
+                          0);
+  uint32_t now = fdb_now ();
+  struct GLAB_FdbEntry e;
+  struct GLAB_FdbEntry old;
+
+  if ( (fdb_get (&switchFdb,
+                 key,
+                 now,
+                 &e)) &&
+       (e.port == ifc->ifc_num) )
+    return;
+  pthread_mutex_lock (&learnLock);
+  if (fdb_get (&switchFdb,
+               key,
+               now,
+               &e))
+    {
+      if (e.port == ifc->ifc_num)
+        {
+          /* another worker was faster */
+          pthread_mutex_unlock (&learnLock);
+          return;
+        }
+      if ( (0 != fdbPortMax) &&
+           (ifc->fdb_count >= fdbPortMax) )
+        {
+          /* moved to a full port: the old entry is wrong, drop it */
+          ifc->fdb_limited++;
+          forget (NULL,
+                  key,
+                  &e);
+          (void) fdb_remove (&switchFdb,
+                             key);
+          pthread_mutex_unlock (&learnLock);
+          return;
+        }
+      gifc[e.port - 1].fdb_count--;
+      fdbStats.moved++;
+    }
+  else
+    {
+      if ( (0 != fdbPortMax) &&
+           (ifc->fdb_count >= fdbPortMax) )
+        {
+          ifc->fdb_limited++;
+          pthread_mutex_unlock (&learnLock);
+          return;
+        }
+      if (fdb_size (&switchFdb) >= fdbMax)
+        (void) fdb_evict (&switchFdb,
+                          &forget,
+                          &fdbStats.evicted);
+      fdbStats.learned++;
+    }
+  e.seen = now;
+  e.port = ifc->ifc_num;
+  e.referenced = 1;
+  (void) fdb_put (&switchFdb,
+                  key,
+                  &e,
+                  &old);
+  ifc->fdb_count++;
+  fdbDirty = 1;
+  TRACE (TRACE_LEVEL_EVENT, TRACE_FDB_LEARN, ifc->ifc_num,
+         trace_mac (src), 0);
+  /* the driver cannot spread frames over a LAG, keep those to us */
+  offload_fdb_entry ((NULL == ifc->lag) ? ifc->ifc_num : 0,
+                     src);
+  pthread_mutex_unlock (&learnLock);
+}
+
+
+/**
+ * May a frame of class @a sc received on @a ifc be flooded?  Takes a
+ * token from the policer if so.
+ *
+ * @param ifc interface the frame was received on
+ * @param sc class of the frame
+ * @return 1 to flood, 0 to drop
+ */
+static int
+storm_admit (struct Interface *ifc,
+             enum StormClass sc)
+{
+  const struct StormLimit *l = &stormLimit[sc];
+  struct StormBucket *b = &ifc->storm[sc];
+  uint64_t now;
+  uint64_t cap;
+  int ret = 1;
+
+  pthread_mutex_lock (&ifc->storm_lock);
+  if (0 != l->rate)
+    {
+      now = timer_now ();
+      cap = 1000LLU * l->burst;
+      b->tokens += (now - b->last) * l->rate;
+      b->last = now;
+      if (b->tokens > cap)
+        b->tokens = cap;
+      if (b->tokens < 1000)
+        ret = 0;
+      else
+        b->tokens -= 1000;
+    }
+  if (ret)
+    b->passed++;
+  else
+    b->dropped++;
+  pthread_mutex_unlock (&ifc->storm_lock);
+  return ret;
+}
+
+
+/**
+ * Set the storm control limit of class @a sc and refill the buckets.
+ *
+ * @param sc the class
+ * @param rate frames per second per port, 0 for no limit
+ * @param burst burst size in frames, 0 for a tenth of @a rate
+ */
+static void
+storm_set (enum StormClass sc,
+           unsigned int rate,
+           unsigned int burst)
+{
+  if (0 == burst)
+    burst = rate / 10;
+  if (0 == burst)
+    burst = 1;
+  stormLimit[sc].rate = rate;
+  stormLimit[sc].burst = burst;
+  for (unsigned int i=0;i<num_ifc;i++)
+    {
+      gifc[i].storm[sc].tokens = 1000LLU * burst;
+      gifc[i].storm[sc].last = timer_now ();
+    }
+}
+
+
+/**
+ * Read storm control limits from the environment.
+ */
+static void
+storm_init ()
+{
+  for (unsigned int sc=0;sc<STORM_MAX;sc++)
+    {
+      const char *env = getenv (storm_env[sc]);
+      unsigned int rate;
+      unsigned int burst = 0;
+
+      if ( (NULL == env) ||
+           (sscanf (env,
+                    "%u/%u",
+                    &rate,
+                    &burst) < 1) )
+        continue;
+      storm_set (sc,
+                 rate,
+                 burst);
+    }
+}
+
 
 /**
- * gcc 4.x-ism to pack structures (to be used before structs);
- * Using this still causes structs to be unaligned on the stack on Sparc
- * (See #670578 from Debian).
+ * Handle the "storm" command.
+ *
+ * @param arg NULL to show limits and counters, or "CLASS RATE [BURST]"
  */
-_Pragma("pack(push)") _Pragma("pack(1)")
-
-struct EthernetHeader
+static void
+storm_command (char *arg)
 {
-  struct MacAddress dst;
-  struct MacAddress src;
-  uint16_t tag;
-};
+  char *cls = strtok (arg,
+                      " ");
+  char *rate = strtok (NULL,
+                       " ");
+  char *burst = strtok (NULL,
+                        " ");
 
-_Pragma("pack(pop)")
+  if (NULL == cls)
+    {
+      for (unsigned int sc=0;sc<STORM_MAX;sc++)
+        {
+          if (0 == stormLimit[sc].rate)
+            print ("storm %s: no limit\n",
+                   storm_names[sc]);
+          else
+            print ("storm %s: %u frames/s, burst %u\n",
+                   storm_names[sc],
+                   stormLimit[sc].rate,
+                   stormLimit[sc].burst);
+        }
+      for (unsigned int i=0;i<num_ifc;i++)
+        for (unsigned int sc=0;sc<STORM_MAX;sc++)
+          print ("port %s %s: %llu flooded, %llu dropped\n",
+                 gifc[i].name,
+                 storm_names[sc],
+                 (unsigned long long) gifc[i].storm[sc].passed,
+                 (unsigned long long) gifc[i].storm[sc].dropped);
+      return;
+    }
+  for (unsigned int sc=0;sc<STORM_MAX;sc++)
+    {
+      if ( (0 != strcasecmp (cls,
+                             storm_names[sc])) ||
+           (NULL == rate) )
+        continue;
+      storm_set (sc,
+                 (unsigned int) strtoul (rate,
+                                         NULL,
+                                         10),
+                 (NULL == burst) ? 0 : (unsigned int) strtoul (burst,
+                                                               NULL,
+                                                               10));
+      print ("storm %s: %s\n",
+             storm_names[sc],
+             (0 == stormLimit[sc].rate) ? "no limit" : "limit set");
+      return;
+    }
+  print ("Usage: storm [broadcast|multicast|unknown RATE [BURST]]\n");
+}
 
 
 /**
- * Per-interface context.
+ * Bucket of #mcastGroups for @a group.
  */
-struct Interface
+static struct McastGroup **
+mcast_bucket (struct in_addr group)
 {
-  /**
-   * MAC of interface.
-   */
-  struct MacAddress mac;
+  uint32_t h = ntohl (group.s_addr) * 2654435761U;
 
-  /**
-   * Number of this interface.
-   */
-  uint16_t ifc_num;
+  return &mcastGroups[h >> 24 & (MCAST_BUCKETS - 1)];
+}
 
-};
 
 /**
- * Number of available contexts.
+ * Find the state of @a group.
+ *
+ * @return NULL if the group has no members
  */
-static unsigned int num_ifc;
+static struct McastGroup *
+mcast_find (struct in_addr group)
+{
+  for (struct McastGroup *g = *mcast_bucket (group); NULL != g; g = g->next)
+    if (g->group.s_addr == group.s_addr)
+      return g;
+  return NULL;
+}
+
 
 /**
- * All the contexts.
+ * Timer callback: free groups whose members all expired.
+ *
+ * @param cls NULL
  */
-static struct Interface *gifc;
+static void
+mcast_age (void *cls)
+{
+  uint64_t now = timer_now ();
+
+  (void) cls;
+  for (unsigned int b=0;b<MCAST_BUCKETS;b++)
+    for (struct McastGroup **pos = &mcastGroups[b]; NULL != *pos; )
+      {
+        struct McastGroup *g = *pos;
+        int members = 0;
+
+        for (unsigned int i=0;i<num_ifc;i++)
+          if (g->member_until[i] > now)
+            members = 1;
+        if (members)
+          {
+            pos = &g->next;
+            continue;
+          }
+        *pos = g->next;
+        free (g);
+      }
+  timer_reschedule (&mcastAgeTimer,
+                    MCAST_AGE_MS);
+}
+
 
 /**
- * Compare two MacAddresses
- * @param macAddress1
- * @param macAddress2
- * @return
+ * Make @a ifc a member of @a group for @a ms, or, if @a leave is set,
+ * for at most @a ms.  Caller must hold the write lock of #mcastLock.
+ *
+ * @param ifc the port
+ * @param group the group
+ * @param ms how long the membership lasts
+ * @param leave non-zero if the membership is ending
  */
-static int maccmp (const struct MacAddress *macAddress1, const struct MacAddress *macAddress2){
-    return memcmp(macAddress1, macAddress2, sizeof(struct MacAddress));
+static void
+mcast_update (struct Interface *ifc,
+              struct in_addr group,
+              uint64_t ms,
+              int leave)
+{
+  struct McastGroup *g = mcast_find (group);
+  uint64_t until = timer_now () + ms;
+  uint64_t *mu;
+
+  if (NULL == g)
+    {
+      struct McastGroup **b;
+
+      if (leave)
+        return;
+      g = calloc (1,
+                  sizeof (*g) + num_ifc * sizeof (uint64_t));
+      if (NULL == g)
+        return;
+      g->group = group;
+      b = mcast_bucket (group);
+      g->next = *b;
+      *b = g;
+    }
+  mu = &g->member_until[ifc->ifc_num - 1];
+  if (leave)
+    {
+      if ( (0 == *mu) ||
+           (*mu <= until) )
+        return;
+    }
+  *mu = until;
 }
 
+
 /**
- * Cache to store known mac addresses
+ * Learn from IGMP message @a f received on @a ifc: queries make @a ifc
+ * a router port, reports and leaves change group memberships of
+ * @a ifc.  Source lists of IGMPv3 are not tracked; a group is
+ * forwarded to a port if any host behind it wants any source.
+ *
+ * @param ifc interface the message was received on
+ * @param f the frame
+ * @return the IGMP message type, 0 if @a f is not a valid IGMP message
  */
-struct SwitchCache {
-    struct Interface *interface;
-    struct MacAddress macAddress;
-};
+static uint8_t
+igmp_snoop (struct Interface *ifc,
+            const struct GLAB_Frame *f)
+{
+  const uint8_t *p = f->data;
+  size_t end = f->l3_offset + f->ip_length;
+  size_t off = f->l4_offset;
+  struct in_addr group;
+  uint8_t type;
+
+  if (end > f->size)
+    end = f->size;
+  if (off + 8 > end)
+    return 0;
+  type = p[off];
+  pthread_rwlock_wrlock (&mcastLock);
+  switch (type)
+    {
+    case IGMP_QUERY:
+      ifc->mrouter_until = timer_now () + IGMP_ROUTER_MS;
+      break;
+    case IGMP_V1_REPORT:
+    case IGMP_V2_REPORT:
+    case IGMP_V2_LEAVE:
+      memcpy (&group,
+              &p[off + 4],
+              sizeof (group));
+      if (! IN_MULTICAST (ntohl (group.s_addr)))
+        {
+          type = 0;
+          break;
+        }
+      mcast_update (ifc,
+                    group,
+                    (IGMP_V2_LEAVE == p[off]) ? IGMP_LEAVE_MS : IGMP_MEMBERSHIP_MS,
+                    IGMP_V2_LEAVE == p[off]);
+      break;
+    case IGMP_V3_REPORT:
+      {
+        unsigned int records = (p[off + 6] << 8) | p[off + 7];
+
+        off += 8;
+        for (unsigned int i=0;i<records;i++)
+          {
+            uint8_t type;
+            unsigned int nsrc;
+            size_t len;
+
+            if (off + 8 > end)
+              break;
+            type = p[off];
+            nsrc = (p[off + 2] << 8) | p[off + 3];
+            len = 8 + 4 * nsrc + 4 * p[off + 1];
+            memcpy (&group,
+                    &p[off + 4],
+                    sizeof (group));
+            if (IN_MULTICAST (ntohl (group.s_addr)))
+              {
+                if ( (IGMP_MODE_IS_EXCLUDE == type) ||
+                     (IGMP_CHANGE_TO_EXCLUDE == type) ||
+                     ( ( (IGMP_MODE_IS_INCLUDE == type) ||
+                         (IGMP_ALLOW_NEW_SOURCES == type) ) &&
+                       (0 != nsrc) ) )
+                  mcast_update (ifc,
+                                group,
+                                IGMP_MEMBERSHIP_MS,
+                                0);
+                else if ( (IGMP_CHANGE_TO_INCLUDE == type) &&
+                          (0 == nsrc) )
+                  mcast_update (ifc,
+                                group,
+                                IGMP_LEAVE_MS,
+                                1);
+              }
+            off += len;
+          }
+      }
+      break;
+    default:
+      type = 0;
+      break;
+    }
+  pthread_rwlock_unlock (&mcastLock);
+  return type;
+}
 
-#define TABLE_SIZE 1024
-static struct SwitchCache switchCache[TABLE_SIZE];
 
-// Index
-static int switchTableIndex = 0;
 /**
- * Forward @a frame to interface @a dst.
+ * Forward IPv4 multicast frame @a f received on @a ifc if IGMP
+ * snooping knows where: IGMP reports and leaves go to the router
+ * ports, traffic for groups with members to the members and the
+ * router ports.  Queries, link-local groups (224.0.0.x) and groups
+ * without members are left to flooding.
  *
- * @param dst target interface to send the frame out on
- * @param frame the frame to forward
- * @param frame_size number of bytes in @a frame
+ * @param ifc port (see lag_port()) the frame was received on
+ * @param f the frame
+ * @param hash flow hash of @a f
+ * @return 1 if the frame was handled, 0 to flood it
  */
-static void
-forward_to (struct Interface *dst,
-	    const void *frame,
-	    size_t frame_size)
+static int
+mcast_forward (struct Interface *ifc,
+               const struct GLAB_Frame *f,
+               uint32_t hash)
 {
-  char iob[frame_size + sizeof (struct GLAB_MessageHeader)];
-  struct GLAB_MessageHeader hdr;
+  uint64_t now = timer_now ();
+  const struct McastGroup *g = NULL;
+  uint16_t egress[num_ifc];
+  unsigned int num_egress = 0;
+
+  if (IPPROTO_IGMP == f->ip_proto)
+    {
+      uint8_t type = igmp_snoop (ifc,
+                                 f);
+
+      if ( (0 == type) ||
+           (IGMP_QUERY == type) )
+        return 0;
+    }
+  else if (0xE0000000 == (ntohl (f->ip_dst.s_addr) & 0xFFFFFF00))
+    return 0; /* link-local, flood */
+  pthread_rwlock_rdlock (&mcastLock);
+  if ( (IPPROTO_IGMP != f->ip_proto) &&
+       (NULL == (g = mcast_find (f->ip_dst))) )
+    {
+      pthread_rwlock_unlock (&mcastLock);
+      return 0;
+    }
+  for (unsigned int i=0;i<num_ifc;i++)
+    {
+      const struct Interface *port = lag_port (&gifc[i]);
 
-  hdr.size = htons (sizeof (iob));
-  hdr.type = htons (dst->ifc_num);
-  memcpy (iob,
-	  &hdr,
-	  sizeof (hdr));
-  memcpy (&iob[sizeof (hdr)],
-	  frame,
-	  frame_size);
-  write_all (STDOUT_FILENO,
-	     iob,
-	     sizeof (iob));
+      if ( (port == ifc) ||
+           (! lag_selected (&gifc[i],
+                            hash)) )
+        continue;
+      if ( (port->mrouter_until > now) ||
+           ( (NULL != g) &&
+             (g->member_until[port->ifc_num - 1] > now) ) )
+        egress[num_egress++] = gifc[i].ifc_num;
+    }
+  pthread_rwlock_unlock (&mcastLock);
+  if ( (NULL == g) &&
+       (0 == num_egress) )
+    return 0; /* no router port known, flood the report */
+  forward_to_many (egress,
+                   num_egress,
+                   f->data,
+                   f->size);
+  return 1;
 }
 
 
 /**
- * Parse and process frame received on @a ifc.
+ * Process frame @a f received on @a ifc.
  *
  * @param ifc interface we got the frame on
- * @param frame raw frame data
- * @param frame_size number of bytes in @a frame
+ * @param f the frame
  */
 static void
-parse_frame (struct Interface *ifc, const void *frame, size_t frame_size)
+parse_frame (struct Interface *ifc, const struct GLAB_Frame *f)
 {
-  struct EthernetHeader eh;
+  const void *frame = f->data;
+  size_t frame_size = f->size;
+  const struct EthernetHeader *eh = frame;
+  struct Interface *port = lag_port (ifc);
+  uint32_t hash = (NULL == lags) ? 0 : workers_flow_hash (f);
+  struct PerfProbe probe;
 
-  if (frame_size < sizeof (eh))
+  if (frame_size < sizeof (*eh))
   {
     fprintf (stderr,
 	     "Malformed frame\n");
     return;
   }
-  memcpy (&eh, frame, sizeof (eh));
+  perf_begin (&probe);
+
+    learn (port, &eh->src);
 
-    // Flags if src or dst are found
-    bool srcAddressExists = false;
-    bool dstAddressExists = false;
+    {
+        struct GLAB_FdbEntry e;
 
-    for (int i = 0; i < switchTableIndex; i++) {
-        if (maccmp(&eh.src, &switchCache[i].macAddress) == 0){
-            srcAddressExists = true;
+        if (fdb_get (&switchFdb, fdb_key (&eh->dst, 0), 0, &e)) {
+            perf_end (PERF_LOOKUP, &probe);
+            // Never send a frame back out where it came from
+            if (e.port != port->ifc_num)
+                forward_to(lag_egress (&gifc[e.port - 1], hash), frame, frame_size);
+            return;
         }
     }
 
-    if ((!srcAddressExists) && (switchTableIndex < TABLE_SIZE)) {
-        switchCache[switchTableIndex].interface = ifc;
-        switchCache[switchTableIndex].macAddress = eh.src;
-        switchTableIndex++;
-    }
+    perf_end (PERF_LOOKUP, &probe);
+    if ( (igmpSnooping) &&
+         (0 != (eh->dst.mac[0] & 1)) &&
+         (0 != (f->flags & GLAB_FRAME_IPV4)) &&
+         (0 == (f->flags & GLAB_FRAME_FRAGMENT)) &&
+         (IN_MULTICAST (ntohl (f->ip_dst.s_addr))) &&
+         (mcast_forward (port, f, hash)))
+        return;
+    {
+        static const struct MacAddress broadcast = {{ 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF }};
+        uint16_t egress[num_ifc];
+        unsigned int num_egress = 0;
+        enum StormClass sc = (0 == (eh->dst.mac[0] & 1)) ? STORM_UNKNOWN
+            : (0 == maccmp (&eh->dst, &broadcast)) ? STORM_BROADCAST : STORM_MULTICAST;
 
-    for (int i = 0; i < switchTableIndex; i++) {
-        if (maccmp(&eh.dst, &switchCache[i].macAddress) == 0){
-            dstAddressExists = true;
-            forward_to(switchCache[i].interface, frame, frame_size);
+        if (! storm_admit (ifc, sc)) {
+            TRACE (TRACE_LEVEL_FRAME, TRACE_FRAME_DROP, ifc->ifc_num,
+                   frame_size, TRACE_DROP_STORM);
             return;
         }
-    }
 
-    if (!dstAddressExists) {
         for (int i = 0; i < num_ifc; i++) {
-            // Don't forward frame to the source interface
-            if (0 != maccmp(&(ifc->mac), &(gifc[i].mac))) {
-                forward_to(&gifc[i], frame, frame_size);
+            // Don't forward frame to the source interface (or its LAG),
+            // and only to one member of each LAG
+            if ( (0 != maccmp(&(ifc->mac), &(gifc[i].mac))) &&
+                 (lag_port (&gifc[i]) != port) &&
+                 (lag_selected (&gifc[i], hash)) ) {
+                egress[num_egress++] = gifc[i].ifc_num;
             }
         }
+        forward_to_many(egress, num_egress, frame, frame_size);
     }
 }
 
 
 /**
- * Process frame received from @a interface.
+ * Process frame @a f received from @a f->interface.
  *
- * @param interface number of the interface on which we received @a frame
- * @param frame the frame
- * @param frame_size number of bytes in @a frame
+ * @param f the frame, parsed by loop.c
  */
 static void
-handle_frame (uint16_t interface,
-	      const void *frame,
-	      size_t frame_size)
+handle_frame (const struct GLAB_Frame *f)
 {
-  if (interface > num_ifc)
+  if (f->interface > num_ifc)
     abort ();
-  parse_frame (&gifc[interface - 1],
-	       frame,
-	       frame_size);
+  parse_frame (&gifc[f->interface - 1],
+	       f);
+}
+
+
+/**
+ * Process @a n frames received at once: first prefetch the FDB
+ * buckets of their addresses, so the lookups of large tables do not
+ * wait for memory one after another.
+ *
+ * @param frames the frames, parsed by loop.c
+ * @param n number of entries in @a frames
+ */
+static void
+handle_frames (const struct GLAB_Frame *frames,
+               unsigned int n)
+{
+  for (unsigned int i=0;i<n;i++)
+    {
+      const struct EthernetHeader *eh = frames[i].data;
+
+      if (frames[i].size < sizeof (*eh))
+        continue;
+      fdb_prefetch (&switchFdb,
+                    fdb_key (&eh->src,
+                             0));
+      fdb_prefetch (&switchFdb,
+                    fdb_key (&eh->dst,
+                             0));
+    }
+  for (unsigned int i=0;i<n;i++)
+    handle_frame (&frames[i]);
+}
+
+
+/**
+ * Find interface @a name, given by name or number.
+ *
+ * @return NULL if there is no such interface
+ */
+static struct Interface *
+find_interface (const char *name)
+{
+  char *end;
+  unsigned long n = strtoul (name,
+                             &end,
+                             10);
+
+  if ( ('\0' == *end) &&
+       (end != name) &&
+       (n >= 1) &&
+       (n <= num_ifc) )
+    return &gifc[n - 1];
+  for (unsigned int i=0;i<num_ifc;i++)
+    if (0 == strcasecmp (name,
+                         gifc[i].name))
+      return &gifc[i];
+  return NULL;
+}
+
+
+/**
+ * Remove FDB entry @a e for @a key if it is for port @a cls.
+ *
+ * @param cls port (see lag_port()), NULL for all
+ * @return non-zero to remove the entry
+ */
+static int
+fdb_flush_entry (void *cls,
+                 uint64_t key,
+                 struct GLAB_FdbEntry *e)
+{
+  const struct Interface *ifc = cls;
+
+  (void) key;
+  return ( (NULL == ifc) ||
+           (e->port == ifc->ifc_num) );
+}
+
+
+/**
+ * Remove the FDB entries of port @a ifc, or all entries.
+ *
+ * @param ifc port (see lag_port()), NULL for all
+ */
+static void
+fdb_flush (const struct Interface *ifc)
+{
+  size_t pos = 0;
+
+  (void) fdb_scan (&switchFdb,
+                   &pos,
+                   fdb_slots (fdb_table (&switchFdb)),
+                   0,
+                   &fdb_flush_entry,
+                   (void *) ifc,
+                   &forget,
+                   &fdbStats.flushed);
+}
+
+
+/**
+ * Take @a ifc out of its link aggregation group, if any.  FDB entries
+ * of the group are flushed, as the port standing for it may change.
+ */
+static void
+lag_leave (struct Interface *ifc)
+{
+  struct Lag *lag = ifc->lag;
+  unsigned int j = 0;
+
+  if (NULL == lag)
+    return;
+  fdb_flush (lag_port (ifc));
+  for (unsigned int i=0;i<lag->num_members;i++)
+    if (lag->members[i] != ifc->ifc_num)
+      lag->members[j++] = lag->members[i];
+  lag->num_members = j;
+  ifc->lag = NULL;
+  if (0 != j)
+    return;
+  for (struct Lag **pos = &lags; NULL != *pos; pos = &(*pos)->next)
+    if (*pos == lag)
+      {
+        *pos = lag->next;
+        break;
+      }
+  free (lag);
+}
+
+
+/**
+ * Put @a ifc into link aggregation group @a name, creating it if
+ * needed.
+ *
+ * @return 0 on success, -1 if the group is full
+ */
+static int
+lag_join (struct Interface *ifc,
+          const char *name)
+{
+  struct Lag *lag;
+  unsigned int i;
+
+  lag_leave (ifc);
+  for (lag = lags; NULL != lag; lag = lag->next)
+    if (0 == strcasecmp (lag->name,
+                         name))
+      break;
+  if (NULL == lag)
+    {
+      lag = calloc (1,
+                    sizeof (*lag));
+      if (NULL == lag)
+        abort ();
+      snprintf (lag->name,
+                sizeof (lag->name),
+                "%s",
+                name);
+      lag->next = lags;
+      lags = lag;
+    }
+  if (LAG_MAX_MEMBERS == lag->num_members)
+    return -1;
+  fdb_flush (ifc);
+  if (0 != lag->num_members)
+    fdb_flush (lag_port (&gifc[lag->members[0] - 1]));
+  for (i = lag->num_members; (i > 0) && (lag->members[i - 1] > ifc->ifc_num); i--)
+    lag->members[i] = lag->members[i - 1];
+  lag->members[i] = ifc->ifc_num;
+  lag->num_members++;
+  ifc->lag = lag;
+  return 0;
+}
+
+
+/**
+ * Handle the "lag" command.
+ *
+ * @param arg empty to list the groups, "add IFC LAG" or "del IFC"
+ */
+static void
+lag_command (char *arg)
+{
+  char *sub = strtok (arg,
+                      " ");
+  char *name = strtok (NULL,
+                       " ");
+  char *lag = strtok (NULL,
+                      " ");
+  struct Interface *ifc;
+
+  if (NULL == sub)
+    {
+      for (const struct Lag *l = lags; NULL != l; l = l->next)
+        {
+          print_add_str (l->name);
+          print_add_char (':');
+          for (unsigned int i=0;i<l->num_members;i++)
+            {
+              print_add_char (' ');
+              print_add_str (gifc[l->members[i] - 1].name);
+            }
+          print_add_char ('\n');
+        }
+      print_flush ();
+      return;
+    }
+  if ( (NULL == name) ||
+       ( (0 != strcasecmp (sub,
+                           "add")) &&
+         (0 != strcasecmp (sub,
+                           "del")) ) ||
+       ( (0 == strcasecmp (sub,
+                           "add")) &&
+         (NULL == lag) ) )
+    {
+      print ("Usage: lag [add IFC LAG|del IFC]\n");
+      return;
+    }
+  if (NULL == (ifc = find_interface (name)))
+    {
+      print ("lag: unknown interface `%s'\n",
+             name);
+      return;
+    }
+  if (0 == strcasecmp (sub,
+                       "del"))
+    {
+      lag_leave (ifc);
+      print ("lag: %s removed\n",
+             ifc->name);
+      return;
+    }
+  if (0 != lag_join (ifc,
+                     lag))
+    print ("lag: %s is full\n",
+           lag);
+  else
+    print ("lag: %s added to %s\n",
+           ifc->name,
+           ifc->lag->name);
+}
+
+
+/**
+ * Print FDB entry @a e for @a key, for the "mac list" command.
+ *
+ * @param cls pointer to the current time, see fdb_now()
+ * @return 0 (keep the entry)
+ */
+static int
+mac_list_entry (void *cls,
+                uint64_t key,
+                struct GLAB_FdbEntry *e)
+{
+  const uint32_t *now = cls;
+  struct MacAddress mac;
+
+  fdb_key_mac (key,
+               &mac);
+  print_add_mac (&mac);
+  print_add_char (' ');
+  print_add_str (gifc[e->port - 1].name);
+  print_add_str (" age ");
+  print_add_uint (*now - e->seen);
+  print_add_str ("s\n");
+  return 0;
+}
+
+
+/**
+ * Handle the "mac" command.
+ *
+ * @param arg "list", "flush [PORT]" or "stats"
+ */
+static void
+mac_command (char *arg)
+{
+  char *sub = strtok (arg,
+                      " ");
+  char *port = strtok (NULL,
+                       " ");
+
+  if ( (NULL == sub) ||
+       (0 == strcasecmp (sub,
+                         "list")) )
+    {
+      uint32_t now = fdb_now ();
+
+      fdb_iterate (&switchFdb,
+                   &mac_list_entry,
+                   &now);
+      print ("%u entries\n",
+             (unsigned int) fdb_size (&switchFdb));
+      return;
+    }
+  if (0 == strcasecmp (sub,
+                       "flush"))
+    {
+      struct Interface *ifc = NULL;
+      uint64_t before = fdbStats.flushed;
+
+      if ( (NULL != port) &&
+           (NULL == (ifc = find_interface (port))) )
+        {
+          print ("mac: unknown port `%s'\n",
+                 port);
+          return;
+        }
+      fdb_flush (ifc);
+      print ("mac: %llu entries flushed\n",
+             (unsigned long long) (fdbStats.flushed - before));
+      return;
+    }
+  if (0 == strcasecmp (sub,
+                       "stats"))
+    {
+      print ("mac: %u entries (max %u), aging %u s, port limit %u\n",
+             (unsigned int) fdb_size (&switchFdb),
+             fdbMax,
+             fdbAging,
+             fdbPortMax);
+      print ("mac: learned %llu moved %llu aged %llu evicted %llu flushed %llu\n",
+             (unsigned long long) fdbStats.learned,
+             (unsigned long long) fdbStats.moved,
+             (unsigned long long) fdbStats.aged,
+             (unsigned long long) fdbStats.evicted,
+             (unsigned long long) fdbStats.flushed);
+      for (unsigned int i=0;i<num_ifc;i++)
+        print ("port %s: %u entries, %llu not learned (limit)\n",
+               gifc[i].name,
+               gifc[i].fdb_count,
+               (unsigned long long) gifc[i].fdb_limited);
+      return;
+    }
+  print ("Usage: mac [list|flush [PORT]|stats]\n");
+}
+
+
+/**
+ * Handle the "igmp" command: show router ports and group members.
+ */
+static void
+igmp_command ()
+{
+  uint64_t now = timer_now ();
+
+  print_add_str ("igmp snooping ");
+  print_add_str (igmpSnooping ? "on\nrouter ports:" : "off\nrouter ports:");
+  for (unsigned int i=0;i<num_ifc;i++)
+    if (gifc[i].mrouter_until > now)
+      {
+        print_add_char (' ');
+        print_add_str (gifc[i].name);
+      }
+  print_add_char ('\n');
+  for (unsigned int b=0;b<MCAST_BUCKETS;b++)
+    for (const struct McastGroup *g = mcastGroups[b]; NULL != g; g = g->next)
+      {
+        print_add_ipv4 (g->group);
+        print_add_char (':');
+        for (unsigned int i=0;i<num_ifc;i++)
+          if (g->member_until[i] > now)
+            {
+              print_add_char (' ');
+              print_add_str (gifc[i].name);
+              print_add_str (" (");
+              print_add_uint ((g->member_until[i] - now) / 1000);
+              print_add_str ("s)");
+            }
+        print_add_char ('\n');
+      }
+  print_flush ();
 }
 
 
@@ -207,11 +1491,237 @@ handle_control (char *cmd,
 		size_t cmd_len)
 {
   cmd[cmd_len - 1] = '\0';
+  if (0 == strcasecmp (cmd,
+                       "queues"))
+    {
+      output_print_stats ();
+      return;
+    }
+  if (0 == strcasecmp (cmd,
+                       "trace"))
+    {
+      trace_command ();
+      return;
+    }
+  if ( (0 == strncasecmp (cmd,
+                          "mac",
+                          strlen ("mac"))) &&
+       ( ('\0' == cmd[strlen ("mac")]) ||
+         (' ' == cmd[strlen ("mac")]) ) )
+    {
+      mac_command (&cmd[strlen ("mac")]);
+      return;
+    }
+  if (0 == strcasecmp (cmd,
+                       "igmp"))
+    {
+      igmp_command ();
+      return;
+    }
+  if ( (0 == strncasecmp (cmd,
+                          "lag",
+                          strlen ("lag"))) &&
+       ( ('\0' == cmd[strlen ("lag")]) ||
+         (' ' == cmd[strlen ("lag")]) ) )
+    {
+      lag_command (&cmd[strlen ("lag")]);
+      return;
+    }
+  if ( (0 == strncasecmp (cmd,
+                          "storm",
+                          strlen ("storm"))) &&
+       ( ('\0' == cmd[strlen ("storm")]) ||
+         (' ' == cmd[strlen ("storm")]) ) )
+    {
+      storm_command (&cmd[strlen ("storm")]);
+      return;
+    }
+  if ( (0 == strncasecmp (cmd,
+                          "perf",
+                          strlen ("perf"))) &&
+       ( ('\0' == cmd[strlen ("perf")]) ||
+         (' ' == cmd[strlen ("perf")]) ) )
+    {
+      const char *arg = &cmd[strlen ("perf")];
+
+      while (' ' == *arg)
+        arg++;
+      perf_command (('\0' == *arg) ? NULL : arg);
+      return;
+    }
   print ("Received command `%s' (ignored)\n",
 	 cmd);
 }
 
 
+/**
+ * Interface MACs, the binding of our snapshots: a snapshot is only
+ * restored for the same interfaces.
+ *
+ * @param[out] macs array of #num_ifc MACs
+ */
+static void
+fdb_binding (struct MacAddress *macs)
+{
+  for (unsigned int i=0;i<num_ifc;i++)
+    macs[i] = gifc[i].mac;
+}
+
+
+/**
+ * Add FDB entry @a e for @a key to a snapshot.
+ *
+ * @param cls pointer to the next record to fill
+ * @return 0 (keep the entry)
+ */
+static int
+fdb_save_entry (void *cls,
+                uint64_t key,
+                struct GLAB_FdbEntry *e)
+{
+  struct FdbRecord **next = cls;
+
+  fdb_key_mac (key,
+               &(*next)->mac);
+  (*next)->ifc_num = e->port;
+  (*next)++;
+  return 0;
+}
+
+
+/**
+ * Write #switchFdb to its snapshot if it changed.
+ */
+static void
+fdb_save ()
+{
+  struct MacAddress macs[num_ifc];
+  struct FdbRecord *rec;
+  struct FdbRecord *next;
+
+  if (! fdbDirty)
+    return;
+  rec = calloc (fdb_size (&switchFdb) + 1,
+                sizeof (struct FdbRecord));
+  if (NULL == rec)
+    return;
+  fdb_binding (macs);
+  next = rec;
+  fdb_iterate (&switchFdb,
+               &fdb_save_entry,
+               &next);
+  if (0 == snapshot_save ("switch-fdb",
+                          FDB_SNAPSHOT_SCHEMA,
+                          macs,
+                          sizeof (macs),
+                          rec,
+                          sizeof (struct FdbRecord),
+                          next - rec))
+    fdbDirty = 0;
+  free (rec);
+}
+
+
+/**
+ * Fill #switchFdb from its snapshot, if there is a valid one for
+ * our interfaces, and start writing snapshots.
+ */
+static void
+fdb_restore ()
+{
+  struct MacAddress macs[num_ifc];
+  struct GLAB_Snapshot snap;
+
+  if (! snapshot_start (&fdb_save))
+    return;
+  fdb_binding (macs);
+  if (0 != snapshot_open (&snap,
+                          "switch-fdb",
+                          FDB_SNAPSHOT_SCHEMA,
+                          macs,
+                          sizeof (macs),
+                          sizeof (struct FdbRecord)))
+    return;
+  for (size_t i = 0; i < snap.count; i++)
+    {
+      struct FdbRecord rec;
+
+      memcpy (&rec,
+              (const char *) snap.records + i * sizeof (rec),
+              sizeof (rec));
+      if ( (0 == rec.ifc_num) ||
+           (rec.ifc_num > num_ifc) )
+        continue;
+      learn (&gifc[rec.ifc_num - 1],
+             &rec.mac);
+    }
+  snapshot_close (&snap);
+  fdbDirty = 0;
+}
+
+
+/**
+ * Timer callback: free FDB tables that outgrew and age out FDB
+ * entries.  Each run looks at enough slots to cover the whole table
+ * every half aging time.  Workers are idle, so no frame handler can
+ * still use an old table.
+ *
+ * @param cls NULL
+ */
+static void
+fdb_sweep_tick (void *cls)
+{
+  size_t budget;
+
+  (void) cls;
+  fdb_reclaim (&switchFdb);
+  if (0 != fdbAging)
+    {
+      budget = fdb_slots (fdb_table (&switchFdb))
+        * FDB_SWEEP_MS / 500 / fdbAging;
+      if (budget < FDB_SWEEP_MIN)
+        budget = FDB_SWEEP_MIN;
+      fdb_sweep (&switchFdb,
+                 fdb_now (),
+                 fdbAging,
+                 budget,
+                 &forget,
+                 &fdbStats.aged);
+    }
+  timer_reschedule (&fdbSweepTimer,
+                    FDB_SWEEP_MS);
+}
+
+
+/**
+ * Read the FDB limits from the environment and start aging.
+ */
+static void
+fdb_init ()
+{
+  const char *env;
+
+  if (NULL != (env = getenv (FDB_AGING_ENV)))
+    fdbAging = (unsigned int) strtoul (env,
+                                       NULL,
+                                       10);
+  if (NULL != (env = getenv (FDB_MAX_ENV)))
+    fdbMax = (unsigned int) strtoul (env,
+                                     NULL,
+                                     10);
+  if (0 == fdbMax)
+    fdbMax = 1;
+  if (NULL != (env = getenv (FDB_PORT_MAX_ENV)))
+    fdbPortMax = (unsigned int) strtoul (env,
+                                         NULL,
+                                         10);
+  timer_schedule (&fdbSweepTimer,
+                  FDB_SWEEP_MS,
+                  &fdb_sweep_tick,
+                  NULL);
+}
+
+
 /**
  * Handle MAC information @a mac
  *
@@ -225,6 +1735,8 @@ handle_mac (uint16_t ifc_num,
   if (ifc_num > num_ifc)
     abort ();
   gifc[ifc_num - 1].mac = *mac;
+  if (ifc_num == num_ifc)
+    fdb_restore (); /* all MACs known */
 }
 
 
@@ -250,8 +1762,42 @@ main (int argc,
   num_ifc = argc - 1;
   gifc = ifc;
   for (unsigned int i=1;i<argc;i++)
-    ifc[i-1].ifc_num = i;
+    {
+      ifc[i-1].ifc_num = i;
+      ifc[i-1].name = argv[i];
+      pthread_mutex_init (&ifc[i-1].storm_lock,
+                          NULL);
+    }
+  for (unsigned int i=1;i<argc;i++)
+    {
+      /* "IFC@LAG" puts IFC into link aggregation group LAG */
+      char *at = strchr (argv[i],
+                         '@');
+
+      if (NULL == at)
+        continue;
+      *at = '\0';
+      if (0 != lag_join (&ifc[i-1],
+                         at + 1))
+        {
+          fprintf (stderr,
+                   "Too many interfaces in `%s'\n",
+                   at + 1);
+          return 1;
+        }
+    }
+  fdb_init ();
+  storm_init ();
+  {
+    const char *env = getenv (IGMP_SNOOPING_ENV);
 
+    if (NULL != env)
+      igmpSnooping = atoi (env);
+  }
+  timer_schedule (&mcastAgeTimer,
+                  MCAST_AGE_MS,
+                  &mcast_age,
+                  NULL);
   loop ();
   return 0;
 }
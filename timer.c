@@ -0,0 +1,406 @@
+/*
+     This file (was) part of GNUnet.
+     Copyright (C) 2018 Christian Grothoff
+
+     GNUnet is free software: you can redistribute it and/or modify it
+     under the terms of the GNU Affero General Public License as published
+     by the Free Software Foundation, either version 3 of the License,
+     or (at your option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Affero General Public License for more details.
+
+     You should have received a copy of the GNU Affero General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file timer.c
+ * @brief Hierarchical timer wheel with millisecond ticks.  Timers are
+ *        embedded in the caller's data structures, so scheduling,
+ *        cancelling and rescheduling are O(1) and never allocate.
+ *        loop() fires expired timers between batches of frames.
+ *        Only the main thread uses the wheel; worker threads may only
+ *        call timer_now().
+ */
+#include <stdatomic.h>
+
+
+/**
+ * Number of levels of the wheel.
+ */
+#define TIMER_LEVELS 4
+
+/**
+ * log2 of the number of slots per level.
+ */
+#define TIMER_SLOT_BITS 8
+
+/**
+ * Number of slots per level.
+ */
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+
+/**
+ * Function called when a timer expires.
+ *
+ * @param cls closure given to timer_schedule()
+ */
+typedef void
+(*GLAB_TimerCallback)(void *cls);
+
+
+/**
+ * A timer.  Embed it in whatever it is for; it must stay in place
+ * while scheduled.  Zero-initialize before first use.
+ */
+struct GLAB_Timer
+{
+  struct GLAB_Timer *next;
+
+  struct GLAB_Timer *prev;
+
+  /**
+   * Expiration time (tick, i.e. ms since start).
+   */
+  uint64_t expires;
+
+  GLAB_TimerCallback cb;
+
+  void *cls;
+
+  /**
+   * Non-zero while scheduled.
+   */
+  int pending;
+};
+
+
+/**
+ * A slot of the wheel, a doubly-linked list of timers.
+ */
+struct TimerSlot
+{
+  struct GLAB_Timer *head;
+};
+
+
+/**
+ * The wheel.
+ */
+static struct
+{
+  struct TimerSlot slots[TIMER_LEVELS][TIMER_SLOTS];
+
+  /**
+   * Number of timers per level.
+   */
+  uint64_t count[TIMER_LEVELS];
+
+  /**
+   * Current tick; all timers before it have fired.  Only the main
+   * thread writes it, workers read it with timer_now().
+   */
+  _Atomic uint64_t now;
+
+  /**
+   * Clock value (ms) of tick 0, set by timer_init().
+   */
+  uint64_t epoch;
+} timer_wheel;
+
+
+/**
+ * Monotonic clock in ms.
+ */
+static uint64_t
+timer_clock_ms ()
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC,
+                 &ts);
+  return (uint64_t) ts.tv_sec * 1000LLU + ts.tv_nsec / 1000000LLU;
+}
+
+
+/**
+ * Start the clock of the wheel.  Called by loop() before it starts
+ * workers; timers scheduled earlier count from then.
+ */
+static void
+timer_init ()
+{
+  timer_wheel.epoch = timer_clock_ms ();
+}
+
+
+/**
+ * Current time in ms (since the wheel started), as of the last
+ * time loop() ran timers.  Safe to call from any thread.
+ */
+static uint64_t
+timer_now ()
+{
+  return atomic_load_explicit (&timer_wheel.now,
+                               memory_order_relaxed);
+}
+
+
+/**
+ * Set the current tick to @a now (main thread only).
+ */
+static void
+timer_set_now (uint64_t now)
+{
+  atomic_store_explicit (&timer_wheel.now,
+                         now,
+                         memory_order_relaxed);
+}
+
+
+/**
+ * Put @a t into the slot for its expiration time.
+ */
+static void
+timer_insert (struct GLAB_Timer *t)
+{
+  uint64_t delta;
+  unsigned int level;
+  struct TimerSlot *slot;
+
+  if (t->expires < timer_now ())
+    t->expires = timer_now ();
+  delta = t->expires - timer_now ();
+  for (level = 0; level < TIMER_LEVELS - 1; level++)
+    if (delta < (1LLU << (TIMER_SLOT_BITS * (level + 1))))
+      break;
+  if (delta >= (1LLU << (TIMER_SLOT_BITS * TIMER_LEVELS)))
+    t->expires = timer_now ()
+      + (1LLU << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1; /* clamp */
+  slot = &timer_wheel.slots[level][(t->expires >> (TIMER_SLOT_BITS * level))
+                                   & (TIMER_SLOTS - 1)];
+  t->prev = NULL;
+  t->next = slot->head;
+  if (NULL != slot->head)
+    slot->head->prev = t;
+  slot->head = t;
+  t->pending = level + 1;
+  timer_wheel.count[level]++;
+}
+
+
+/**
+ * Remove @a t from its slot.
+ */
+static void
+timer_unlink (struct GLAB_Timer *t)
+{
+  unsigned int level = t->pending - 1;
+
+  if (NULL != t->prev)
+    t->prev->next = t->next;
+  else
+    timer_wheel.slots[level][(t->expires >> (TIMER_SLOT_BITS * level))
+                             & (TIMER_SLOTS - 1)].head = t->next;
+  if (NULL != t->next)
+    t->next->prev = t->prev;
+  timer_wheel.count[level]--;
+  t->pending = 0;
+}
+
+
+/**
+ * Cancel @a t.  Does nothing if @a t is not scheduled.
+ */
+static void
+timer_cancel (struct GLAB_Timer *t)
+{
+  if (t->pending)
+    timer_unlink (t);
+}
+
+
+/**
+ * Schedule @a t to call @a cb in @a delay_ms.  If @a t was already
+ * scheduled, it is moved.
+ *
+ * @param t the timer
+ * @param delay_ms delay in milliseconds
+ * @param cb function to call
+ * @param cls closure for @a cb
+ */
+static void
+timer_schedule (struct GLAB_Timer *t,
+                uint64_t delay_ms,
+                GLAB_TimerCallback cb,
+                void *cls)
+{
+  timer_cancel (t);
+  /* the current tick's slot may already have been run */
+  t->expires = timer_now () + ((0 == delay_ms) ? 1 : delay_ms);
+  t->cb = cb;
+  t->cls = cls;
+  timer_insert (t);
+}
+
+
+/**
+ * Move already initialized @a t to expire in @a delay_ms, keeping
+ * its callback.
+ */
+static void
+timer_reschedule (struct GLAB_Timer *t,
+                  uint64_t delay_ms)
+{
+  timer_schedule (t,
+                  delay_ms,
+                  t->cb,
+                  t->cls);
+}
+
+
+/**
+ * Are any timers scheduled?
+ */
+static int
+timer_pending ()
+{
+  for (unsigned int level = 0; level < TIMER_LEVELS; level++)
+    if (0 != timer_wheel.count[level])
+      return 1;
+  return 0;
+}
+
+
+/**
+ * Move timers of the current slot of @a level down (called when the
+ * lower level wraps around).
+ */
+static void
+timer_cascade (unsigned int level)
+{
+  struct TimerSlot *slot
+    = &timer_wheel.slots[level][(timer_now () >> (TIMER_SLOT_BITS * level))
+                                & (TIMER_SLOTS - 1)];
+  struct GLAB_Timer *t = slot->head;
+
+  slot->head = NULL;
+  while (NULL != t)
+    {
+      struct GLAB_Timer *next = t->next;
+
+      timer_wheel.count[level]--;
+      timer_insert (t);
+      t = next;
+    }
+}
+
+
+/**
+ * Advance the wheel by one tick: cascade where needed and fire the
+ * timers of the new current slot.
+ */
+static void
+timer_tick ()
+{
+  struct TimerSlot *slot;
+  unsigned int top = 0;
+  uint64_t now = timer_now () + 1;
+
+  timer_set_now (now);
+  while ( (top + 1 < TIMER_LEVELS) &&
+          (0 == (now
+                 & ((1LLU << (TIMER_SLOT_BITS * (top + 1))) - 1))) )
+    top++;
+  /* higher levels first, their timers may land in lower slots */
+  for (unsigned int level = top; level > 0; level--)
+    timer_cascade (level);
+  slot = &timer_wheel.slots[0][now & (TIMER_SLOTS - 1)];
+  while (NULL != slot->head)
+    {
+      struct GLAB_Timer *t = slot->head;
+
+      timer_unlink (t);
+      t->cb (t->cls); /* may (re)schedule any timer, including t */
+    }
+}
+
+
+/**
+ * Number of ticks until the next tick at which something happens
+ * (a timer fires or timers cascade), at most @a limit.
+ */
+static uint64_t
+timer_idle_ticks (uint64_t limit)
+{
+  uint64_t now = timer_now ();
+  uint64_t next_wrap = TIMER_SLOTS - (now & (TIMER_SLOTS - 1));
+
+  if (0 != timer_wheel.count[0])
+    for (uint64_t d = 1; d < next_wrap && d <= limit; d++)
+      if (NULL != timer_wheel.slots[0][(now + d) & (TIMER_SLOTS - 1)].head)
+        return d;
+  return (next_wrap < limit) ? next_wrap : limit;
+}
+
+
+/**
+ * Milliseconds until timer_run() has work, for poll(); -1 if no
+ * timer is scheduled.
+ */
+static int
+timer_timeout_ms ()
+{
+  uint64_t now;
+  uint64_t due;
+
+  if (! timer_pending ())
+    return -1;
+  now = timer_clock_ms () - timer_wheel.epoch;
+  due = timer_now () + timer_idle_ticks (INT32_MAX);
+  return (due <= now) ? 0 : (int) (due - now);
+}
+
+
+/**
+ * Might timer_run() fire a timer now?  Errs on the side of yes when
+ * timers are due to cascade, at most every #TIMER_SLOTS ms.
+ */
+static int
+timer_due ()
+{
+  if (! timer_pending ())
+    return 0;
+  return timer_now () + timer_idle_ticks (INT32_MAX)
+    <= timer_clock_ms () - timer_wheel.epoch;
+}
+
+
+/**
+ * Fire all timers that expired by now.  Called by loop().
+ */
+static void
+timer_run ()
+{
+  uint64_t target;
+
+  target = timer_clock_ms () - timer_wheel.epoch;
+  while (timer_now () < target)
+    {
+      uint64_t skip;
+
+      if (! timer_pending ())
+        {
+          timer_set_now (target);
+          break;
+        }
+      /* jump over ticks where nothing happens, then do one */
+      skip = timer_idle_ticks (target - timer_now ());
+      timer_set_now (timer_now () + skip - 1);
+      timer_tick ();
+    }
+}
@@ -0,0 +1,173 @@
+/*
+     This file (was) part of GNUnet.
+     Copyright (C) 2018 Christian Grothoff
+
+     GNUnet is free software: you can redistribute it and/or modify it
+     under the terms of the GNU Affero General Public License as published
+     by the Free Software Foundation, either version 3 of the License,
+     or (at your option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Affero General Public License for more details.
+
+     You should have received a copy of the GNU Affero General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file trace-decode.c
+ * @brief Renders a trace file written by trace.c as text, one event
+ *        per line:
+ *
+ *   +SECONDS.MICROS #SEQ ifc=N EVENT ARG=VALUE ARG=VALUE
+ *
+ * Times are relative to the first event.  Records that were being
+ * written while the trace was dumped are skipped.
+ */
+#include "glab.h"
+#define TRACE_FORMAT_ONLY
+#include "trace.c"
+
+
+/**
+ * Print argument @a v of kind @a kind named @a name.
+ */
+static void
+print_arg (const char *name,
+           enum TraceArgKind kind,
+           uint64_t v)
+{
+  switch (kind)
+    {
+    case TRACE_ARG_NONE:
+      return;
+    case TRACE_ARG_UINT:
+      printf (" %s=%llu",
+              name,
+              (unsigned long long) v);
+      return;
+    case TRACE_ARG_HEX:
+      printf (" %s=0x%llx",
+              name,
+              (unsigned long long) v);
+      return;
+    case TRACE_ARG_MAC:
+      printf (" %s=%02x:%02x:%02x:%02x:%02x:%02x",
+              name,
+              (unsigned int) (v >> 40) & 0xFF,
+              (unsigned int) (v >> 32) & 0xFF,
+              (unsigned int) (v >> 24) & 0xFF,
+              (unsigned int) (v >> 16) & 0xFF,
+              (unsigned int) (v >> 8) & 0xFF,
+              (unsigned int) v & 0xFF);
+      return;
+    case TRACE_ARG_IPV4:
+      printf (" %s=%u.%u.%u.%u",
+              name,
+              (unsigned int) (v >> 24) & 0xFF,
+              (unsigned int) (v >> 16) & 0xFF,
+              (unsigned int) (v >> 8) & 0xFF,
+              (unsigned int) v & 0xFF);
+      return;
+    }
+}
+
+
+int
+main (int argc,
+      char **argv)
+{
+  FILE *f = stdin;
+  struct TraceFileHeader hdr;
+  struct TraceRecord r;
+  uint64_t start = 0;
+  uint64_t shown = 0;
+  uint64_t torn = 0;
+
+  if (argc > 2)
+    {
+      fprintf (stderr,
+               "Usage: %s [TRACE-FILE]\n",
+               argv[0]);
+      return 1;
+    }
+  if ( (2 == argc) &&
+       (NULL == (f = fopen (argv[1],
+                            "rb"))) )
+    {
+      fprintf (stderr,
+               "Failed to open `%s': %s\n",
+               argv[1],
+               strerror (errno));
+      return 1;
+    }
+  if ( (1 != fread (&hdr,
+                    sizeof (hdr),
+                    1,
+                    f)) ||
+       (0 != memcmp (hdr.magic,
+                     TRACE_MAGIC,
+                     sizeof (hdr.magic))) ||
+       (sizeof (r) != hdr.record_size) )
+    {
+      fprintf (stderr,
+               "Not a trace file (or written on another architecture)\n");
+      return 1;
+    }
+  printf ("# pid %u, %llu records, %llu older records lost\n",
+          (unsigned int) hdr.pid,
+          (unsigned long long) hdr.count,
+          (unsigned long long) hdr.lost);
+  for (uint64_t i = 0; i < hdr.count; i++)
+    {
+      const struct TraceEventInfo *info;
+      uint64_t dt;
+
+      if (1 != fread (&r,
+                      sizeof (r),
+                      1,
+                      f))
+        {
+          fprintf (stderr,
+                   "Trace file truncated after %llu records\n",
+                   (unsigned long long) i);
+          return 1;
+        }
+      if (0 == r.seq)
+        {
+          torn++;
+          continue;
+        }
+      if (0 == shown)
+        start = r.time_ns;
+      shown++;
+      dt = (r.time_ns >= start) ? r.time_ns - start : 0;
+      printf ("+%llu.%06llu #%u ifc=%u",
+              (unsigned long long) (dt / 1000000000LLU),
+              (unsigned long long) (dt % 1000000000LLU) / 1000,
+              (unsigned int) r.seq,
+              (unsigned int) r.interface);
+      if (r.event >= TRACE_EVENT_MAX)
+        {
+          printf (" event-%u a0=0x%llx a1=0x%llx\n",
+                  (unsigned int) r.event,
+                  (unsigned long long) r.arg[0],
+                  (unsigned long long) r.arg[1]);
+          continue;
+        }
+      info = &trace_events[r.event];
+      printf (" %s",
+              info->name);
+      for (unsigned int j=0;j<2;j++)
+        print_arg (info->arg_name[j],
+                   info->arg_kind[j],
+                   r.arg[j]);
+      printf ("\n");
+    }
+  if (0 != torn)
+    printf ("# %llu incomplete records skipped\n",
+            (unsigned long long) torn);
+  return 0;
+}
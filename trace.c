@@ -0,0 +1,443 @@
+/*
+     This file (was) part of GNUnet.
+     Copyright (C) 2018 Christian Grothoff
+
+     GNUnet is free software: you can redistribute it and/or modify it
+     under the terms of the GNU Affero General Public License as published
+     by the Free Software Foundation, either version 3 of the License,
+     or (at your option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Affero General Public License for more details.
+
+     You should have received a copy of the GNU Affero General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file trace.c
+ * @brief In-memory binary trace of fixed-size event records, for
+ *        debugging the data path without printing to stderr.  Compile
+ *        with -DGLAB_TRACE_LEVEL=N to record events up to level N;
+ *        with the default of 0 all TRACE() calls compile to nothing.
+ *        The ring is written to a file on SIGUSR1 or with
+ *        trace_dump() (the "trace" command), and rendered as text by
+ *        trace-decode, which only includes the format definitions
+ *        (TRACE_FORMAT_ONLY).
+ */
+#include <stdatomic.h>
+
+
+#ifndef GLAB_TRACE_LEVEL
+/**
+ * Highest level of events that are recorded, 0 to disable tracing.
+ */
+#define GLAB_TRACE_LEVEL 0
+#endif
+
+/**
+ * Level of rare events (table changes, drops).
+ */
+#define TRACE_LEVEL_EVENT 1
+
+/**
+ * Level of per-frame events.
+ */
+#define TRACE_LEVEL_FRAME 2
+
+/**
+ * Number of records in the ring, a power of two.
+ */
+#define TRACE_RECORDS (1 << 16)
+
+/**
+ * Magic at the start of a trace file.
+ */
+#define TRACE_MAGIC "GLABTRC1"
+
+/**
+ * Environment variable with the name of the trace file; default is
+ * "glab-trace.PID".
+ */
+#define TRACE_FILE_ENV "GLAB_TRACE_FILE"
+
+
+/**
+ * Kinds of events.  Append only, the numbers are in trace files.
+ */
+enum TraceEvent
+{
+  TRACE_NONE = 0,
+  TRACE_FRAME_IN = 1,
+  TRACE_FRAME_OUT = 2,
+  TRACE_FRAME_DROP = 3,
+  TRACE_FDB_LEARN = 4,
+  TRACE_VLAN_IN = 5,
+  TRACE_VLAN_OUT = 6,
+  TRACE_ARP_IN = 7,
+  TRACE_ARP_REPLY = 8,
+  TRACE_EVENT_MAX = 9
+};
+
+
+/**
+ * Reasons for #TRACE_FRAME_DROP.  Append only, the numbers are in
+ * trace files.
+ */
+enum TraceDropReason
+{
+  TRACE_DROP_OTHER = 0,
+  TRACE_DROP_STORM = 1
+};
+
+
+/**
+ * How trace-decode renders an argument of an event.
+ */
+enum TraceArgKind
+{
+  TRACE_ARG_NONE = 0,
+  TRACE_ARG_UINT,
+  TRACE_ARG_HEX,
+  TRACE_ARG_MAC,
+  TRACE_ARG_IPV4
+};
+
+
+/**
+ * Description of an event, for trace-decode.
+ */
+struct TraceEventInfo
+{
+  const char *name;
+
+  const char *arg_name[2];
+
+  enum TraceArgKind arg_kind[2];
+};
+
+
+/**
+ * Descriptions of all events, indexed by `enum TraceEvent`.
+ */
+static const struct TraceEventInfo trace_events[TRACE_EVENT_MAX] = {
+  [TRACE_NONE] = { "none", { NULL, NULL },
+                   { TRACE_ARG_NONE, TRACE_ARG_NONE } },
+  [TRACE_FRAME_IN] = { "frame-in", { "size", "dst" },
+                       { TRACE_ARG_UINT, TRACE_ARG_MAC } },
+  [TRACE_FRAME_OUT] = { "frame-out", { "size", "dst" },
+                        { TRACE_ARG_UINT, TRACE_ARG_MAC } },
+  [TRACE_FRAME_DROP] = { "frame-drop", { "size", "reason" },
+                         { TRACE_ARG_UINT, TRACE_ARG_UINT } },
+  [TRACE_FDB_LEARN] = { "fdb-learn", { "mac", "vlan" },
+                        { TRACE_ARG_MAC, TRACE_ARG_UINT } },
+  [TRACE_VLAN_IN] = { "vlan-in", { "vlan", "tagged" },
+                      { TRACE_ARG_UINT, TRACE_ARG_UINT } },
+  [TRACE_VLAN_OUT] = { "vlan-out", { "vlan", "tagged" },
+                       { TRACE_ARG_UINT, TRACE_ARG_UINT } },
+  [TRACE_ARP_IN] = { "arp-in", { "oper", "target" },
+                     { TRACE_ARG_UINT, TRACE_ARG_IPV4 } },
+  [TRACE_ARP_REPLY] = { "arp-reply", { "sender", "target" },
+                        { TRACE_ARG_IPV4, TRACE_ARG_IPV4 } }
+};
+
+
+/**
+ * One trace record.
+ */
+struct TraceRecord
+{
+  /**
+   * CLOCK_MONOTONIC time of the event in ns.
+   */
+  uint64_t time_ns;
+
+  /**
+   * Position of the record in the trace plus one, written last so
+   * that readers can tell complete records; 0 if never written.
+   */
+  _Atomic uint32_t seq;
+
+  /**
+   * An `enum TraceEvent`.
+   */
+  uint16_t event;
+
+  /**
+   * Interface the event is about, 0 for none (or several, for
+   * #TRACE_FRAME_OUT of a multicast message).
+   */
+  uint16_t interface;
+
+  /**
+   * Event-specific arguments, see #trace_events.
+   */
+  uint64_t arg[2];
+};
+
+
+/**
+ * Header of a trace file, followed by @e count records, oldest first.
+ * Integers are in host byte order; decode on the same architecture.
+ */
+struct TraceFileHeader
+{
+  char magic[8];
+
+  /**
+   * sizeof (struct TraceRecord).
+   */
+  uint32_t record_size;
+
+  /**
+   * Process that wrote the trace.
+   */
+  uint32_t pid;
+
+  /**
+   * Number of records following.
+   */
+  uint64_t count;
+
+  /**
+   * Records lost because the ring wrapped around.
+   */
+  uint64_t lost;
+};
+
+
+#ifndef TRACE_FORMAT_ONLY
+
+/**
+ * Pack @a mac into a trace argument.
+ */
+static uint64_t __attribute__ ((unused))
+trace_mac (const struct MacAddress *mac)
+{
+  uint64_t v = 0;
+
+  for (unsigned int i=0;i<MAC_ADDR_SIZE;i++)
+    v = (v << 8) | mac->mac[i];
+  return v;
+}
+
+
+/**
+ * Pack IPv4 address @a ip into a trace argument.
+ */
+static uint64_t __attribute__ ((unused))
+trace_ipv4 (struct in_addr ip)
+{
+  return ntohl (ip.s_addr);
+}
+
+
+#if GLAB_TRACE_LEVEL > 0
+
+/**
+ * The ring.  Written by any thread, without locks.
+ */
+static struct TraceRecord trace_ring[TRACE_RECORDS];
+
+/**
+ * Number of records ever started.
+ */
+static _Atomic uint64_t trace_next;
+
+/**
+ * Name of the file trace_dump() writes, set by trace_start().
+ */
+static char trace_file[256] = "glab-trace";
+
+
+/**
+ * Append a record to the trace.  Use TRACE() instead.
+ */
+static void
+trace_record (uint16_t event,
+              uint16_t interface,
+              uint64_t arg0,
+              uint64_t arg1)
+{
+  uint64_t pos = atomic_fetch_add_explicit (&trace_next,
+                                            1,
+                                            memory_order_relaxed);
+  struct TraceRecord *r = &trace_ring[pos & (TRACE_RECORDS - 1)];
+  struct timespec ts;
+
+  atomic_store_explicit (&r->seq,
+                         0,
+                         memory_order_relaxed);
+  clock_gettime (CLOCK_MONOTONIC,
+                 &ts);
+  r->time_ns = (uint64_t) ts.tv_sec * 1000000000LLU + ts.tv_nsec;
+  r->event = event;
+  r->interface = interface;
+  r->arg[0] = arg0;
+  r->arg[1] = arg1;
+  atomic_store_explicit (&r->seq,
+                         (uint32_t) (pos + 1),
+                         memory_order_release);
+}
+
+
+/**
+ * Write @a size bytes from @a buf to @a fd.
+ *
+ * @return 0 on success
+ */
+static int
+trace_write_all (int fd,
+                 const void *buf,
+                 size_t size)
+{
+  const char *pos = buf;
+
+  while (size > 0)
+    {
+      ssize_t ret = write (fd,
+                           pos,
+                           size);
+
+      if (ret <= 0)
+        return -1;
+      pos += ret;
+      size -= ret;
+    }
+  return 0;
+}
+
+
+/**
+ * Write the trace to the trace file.  Only uses async-signal-safe
+ * functions, so it may also be called from a signal handler.
+ *
+ * @return number of records written, -1 on error
+ */
+static long long
+trace_dump ()
+{
+  uint64_t next = atomic_load (&trace_next);
+  uint64_t first = (next > TRACE_RECORDS) ? next - TRACE_RECORDS : 0;
+  size_t start = first & (TRACE_RECORDS - 1);
+  size_t count = next - first;
+  size_t part = (start + count > TRACE_RECORDS)
+    ? TRACE_RECORDS - start : count;
+  struct TraceFileHeader hdr;
+  int fd;
+
+  fd = open (trace_file,
+             O_WRONLY | O_CREAT | O_TRUNC,
+             0644);
+  if (-1 == fd)
+    return -1;
+  memset (&hdr,
+          0,
+          sizeof (hdr));
+  memcpy (hdr.magic,
+          TRACE_MAGIC,
+          sizeof (hdr.magic));
+  hdr.record_size = sizeof (struct TraceRecord);
+  hdr.pid = getpid ();
+  hdr.count = count;
+  hdr.lost = first;
+  /* oldest first: from the oldest slot to the end of the ring, then
+     the rest from its beginning */
+  if ( (0 != trace_write_all (fd,
+                              &hdr,
+                              sizeof (hdr))) ||
+       (0 != trace_write_all (fd,
+                              &trace_ring[start],
+                              part * sizeof (struct TraceRecord))) ||
+       (0 != trace_write_all (fd,
+                              &trace_ring[0],
+                              (count - part) * sizeof (struct TraceRecord))) )
+    {
+      close (fd);
+      return -1;
+    }
+  close (fd);
+  return (long long) count;
+}
+
+
+/**
+ * Signal handler that dumps the trace.
+ */
+static void
+trace_on_signal (int sig)
+{
+  int saved = errno;
+
+  (void) sig;
+  (void) trace_dump ();
+  errno = saved;
+}
+
+
+/**
+ * Determine the trace file name and make SIGUSR1 dump the trace.
+ * Called by loop().
+ */
+static void
+trace_start ()
+{
+  const char *fn = getenv (TRACE_FILE_ENV);
+  struct sigaction sa;
+
+  if (NULL != fn)
+    snprintf (trace_file,
+              sizeof (trace_file),
+              "%s",
+              fn);
+  else
+    snprintf (trace_file,
+              sizeof (trace_file),
+              "glab-trace.%u",
+              (unsigned int) getpid ());
+  memset (&sa,
+          0,
+          sizeof (sa));
+  sa.sa_handler = &trace_on_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset (&sa.sa_mask);
+  (void) sigaction (SIGUSR1,
+                    &sa,
+                    NULL);
+}
+
+
+/**
+ * Record event @a event at level @a level about @a interface with
+ * arguments @a a0 and @a a1 (see #trace_events).  Compiles to nothing
+ * if @a level is above #GLAB_TRACE_LEVEL.
+ */
+#define TRACE(level, event, interface, a0, a1)                  \
+  do {                                                          \
+    if ((level) <= GLAB_TRACE_LEVEL)                            \
+      trace_record ((event), (interface), (a0), (a1));          \
+  } while (0)
+
+#else
+
+static long long
+trace_dump ()
+{
+  errno = ENOTSUP;
+  return -1;
+}
+
+
+static void
+trace_start ()
+{
+}
+
+
+#define TRACE(level, event, interface, a0, a1) do { } while (0)
+
+#endif
+
+#endif
@@ -21,8 +21,11 @@
  * @brief Ethernet switch
  * @author Christian Grothoff
  */
+#define GLAB_WORKER_THREADS
 #include "glab.h"
+#include <pthread.h>
 #include "print.c"
+#include "fdb.c"
 #include "stdbool.h"
 
 /**
@@ -43,48 +46,58 @@
 #define DEFAULT_VLAN 0
 
 /**
- * gcc 4.x-ism to pack structures (to be used before structs);
- * Using this still causes structs to be unaligned on the stack on Sparc
- * (See #670578 from Debian).
+ * TPID of 802.1Q tags.
  */
-_Pragma("pack(push)") _Pragma("pack(1)")
+#define ETH_802_1Q_TAG 0x8100
 
-struct EthernetHeader
-{
-  struct MacAddress dst;
-  struct MacAddress src;
-  uint16_t tag;
-  uint16_t vlanId;
-};
+/**
+ * Number of 64-bit words in a VLAN bitmap (one bit per VLAN ID).
+ */
+#define VLAN_BITMAP_WORDS (4096 / 64)
 
-struct SwitchCache {
-    struct Interface *interface;
-    struct MacAddress macAddress;
-};
+/**
+ * Environment variable with the FDB aging time in seconds, 0 to
+ * never age out entries.
+ */
+#define FDB_AGING_ENV "GLAB_FDB_AGING"
 
-static struct SwitchCache switchCache[500];
-static int switchTableIndex = 0;
-
-static void printMac(struct MacAddress *mac) {
-  fprintf(stderr,
-          "%02X:%02X:%02X:%02X:%02X:%02X:",
-          mac->mac[0],
-          mac->mac[1],
-          mac->mac[2],
-          mac->mac[3],
-          mac->mac[4],
-          mac->mac[5]);
-}
+/**
+ * Environment variable with the maximum number of FDB entries.
+ */
+#define FDB_MAX_ENV "GLAB_FDB_MAX"
 
 /**
- * Compare two MacAddresses
- * @param macAddress1
- * @param macAddress2
- * @return
+ * Default aging time in seconds.
  */
-static int maccmp (const struct MacAddress *macAddress1, const struct MacAddress *macAddress2){
-    return memcmp(macAddress1, macAddress2, sizeof(struct MacAddress));
-}
+#define FDB_AGING_DEFAULT 300
+
+/**
+ * Default maximum number of (VLAN, MAC) pairs we learn.
+ */
+#define FDB_MAX_DEFAULT (1 << 20)
+
+/**
+ * Milliseconds between runs of the aging sweep, which also frees FDB
+ * tables that outgrew.
+ */
+#define FDB_SWEEP_MS 1000
+
+/**
+ * Minimum number of slots one aging sweep looks at.
+ */
+#define FDB_SWEEP_MIN 4096
+
+/**
+ * Maximum number of threads we keep traffic counters for.
+ */
+#define STATS_THREADS_MAX 72
+
+/**
+ * gcc 4.x-ism to pack structures (to be used before structs);
+ * Using this still causes structs to be unaligned on the stack on Sparc
+ * (See #670578 from Debian).
+ */
+_Pragma("pack(push)") _Pragma("pack(1)")
 
 /**
  * IEEE 802.1Q header.
@@ -120,9 +133,15 @@ struct Interface
 
   /**
    * Which tagged VLANs does this interface participate in?
-   * Array terminated by #NO_VLAN entry.
+   * Bit i is set for VLAN i, see vlan_member().
+   */
+  uint64_t tagged_vlans[VLAN_BITMAP_WORDS];
+
+  /**
+   * Which VLANs leave this interface untagged?  At most
+   * @e untagged_vlan.
    */
-  int16_t tagged_vlans[MAX_VLANS + 1];
+  uint64_t untagged_vlans[VLAN_BITMAP_WORDS];
 
   /**
    * Which untagged VLAN does this interface participate in?
@@ -132,34 +151,149 @@ struct Interface
 
 };
 
+
 /**
- * Forward @a frame to interface @a dst.
- *
- * @param dst target interface to send the frame out on
- * @param frame the frame to forward
- * @param frame_size number of bytes in @a frame
+ * Interfaces of a VLAN, for flooding.
+ */
+struct FloodList
+{
+  /**
+   * Number of interfaces that send the VLAN untagged; they come first
+   * in @e ports.
+   */
+  unsigned int num_untagged;
+
+  /**
+   * Number of interfaces that send the VLAN tagged; they follow the
+   * untagged ones in @e ports.
+   */
+  unsigned int num_tagged;
+
+  /**
+   * Interface numbers.
+   */
+  uint16_t ports[];
+};
+
+
+/**
+ * Reasons for dropping frames.
+ */
+enum DropReason
+{
+  /**
+   * Frame too short.
+   */
+  DROP_MALFORMED = 0,
+
+  /**
+   * Tagged frame for a VLAN the interface is not a member of.
+   */
+  DROP_VLAN_NOT_PERMITTED,
+
+  /**
+   * Untagged frame on an interface that only carries tagged VLANs.
+   */
+  DROP_UNTAGGED_ON_TRUNK,
+
+  /**
+   * Destination is on the interface the frame came from.
+   */
+  DROP_SAME_INTERFACE,
+
+  /**
+   * No other interface is (still) in the VLAN.
+   */
+  DROP_NO_EGRESS,
+
+  DROP_MAX
+};
+
+
+/**
+ * Names of the drop reasons, for "vlan stats".
+ */
+static const char *const drop_names[DROP_MAX] = {
+  "malformed",
+  "vlan-not-permitted",
+  "untagged-on-trunk",
+  "same-interface",
+  "no-egress"
+};
+
+
+/**
+ * Frame and byte counters.
+ */
+struct TrafficCounters
+{
+  uint64_t frames;
+
+  uint64_t bytes;
+};
+
+
+/**
+ * Counters of an interface, in its own cache line.
+ */
+struct PortCounters
+{
+  struct TrafficCounters rx;
+
+  struct TrafficCounters tx;
+
+  uint64_t drops[DROP_MAX];
+} __attribute__((aligned (64)));
+
+
+/**
+ * Counters of a VLAN.
+ */
+struct VlanCounters
+{
+  struct TrafficCounters rx;
+
+  struct TrafficCounters tx;
+};
+
+
+/**
+ * Counters of one thread; threads only write their own, so the hot
+ * path needs no atomics and threads share no cache lines.
+ */
+struct ThreadCounters
+{
+  struct VlanCounters vlans[4096];
+
+  /**
+   * Counters of the interfaces, #num_ifc entries.
+   */
+  struct PortCounters ports[];
+};
+
+
+/**
+ * Is VLAN @a vlan in @a bitmap?
+ */
+static inline bool
+vlan_member (const uint64_t *bitmap,
+             uint16_t vlan)
+{
+  return 0 != (bitmap[vlan / 64] & (1LLU << (vlan % 64)));
+}
+
+
+/**
+ * Add VLAN @a vlan to @a bitmap.
  */
 static void
-forward_to (struct Interface *dst,
-	    const void *frame,
-	    size_t frame_size)
+vlan_add (uint64_t *bitmap,
+          uint16_t vlan)
 {
-  char iob[frame_size + sizeof (struct GLAB_MessageHeader)];
-  struct GLAB_MessageHeader hdr;
-
-  hdr.size = htons (sizeof(iob));
-  hdr.type = htons (dst->ifc_num);
-  memcpy (iob,
-	  &hdr,
-	  sizeof(hdr));
-  memcpy (&iob[sizeof (hdr)],
-	  frame,
-	  frame_size);
-  write_all (STDOUT_FILENO,
-	     iob,
-	     sizeof(iob));
+  bitmap[vlan / 64] |= 1LLU << (vlan % 64);
 }
 
+
 /**
  * Number of available contexts.
  */
@@ -170,273 +304,651 @@ static unsigned int num_ifc;
  */
 static struct Interface *gifc;
 
+/**
+ * Members of each VLAN, NULL for VLANs without any, see
+ * flood_lists_build().
+ */
+static struct FloodList *floodLists[4096];
+
+/**
+ * Known (VLAN, MAC) pairs and the interfaces they are at.
+ */
+static struct GLAB_Fdb vswitchFdb;
+
+/**
+ * Serializes learning of new and moved MACs, which may evict, among
+ * workers.  Refreshing known MACs and lookups take no lock.
+ */
+static pthread_mutex_t learnLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Timer for aging FDB entries and freeing tables that outgrew.
+ */
+static struct GLAB_Timer fdbSweepTimer;
+
+/**
+ * FDB aging time in seconds, 0 for none.
+ */
+static unsigned int fdbAging = FDB_AGING_DEFAULT;
+
+/**
+ * Maximum number of FDB entries.
+ */
+static unsigned int fdbMax = FDB_MAX_DEFAULT;
+
+/**
+ * FDB statistics, for "vlan stats".
+ */
+static struct
+{
+  uint64_t learned;
+  uint64_t moved;
+  uint64_t aged;
+  uint64_t evicted;
+} fdbStats;
+
+/**
+ * Counters of all threads that handled frames.
+ */
+static struct ThreadCounters *threadCounters[STATS_THREADS_MAX];
+
+/**
+ * Number of entries in #threadCounters.
+ */
+static _Atomic unsigned int threadCountersLen;
+
+/**
+ * Counters of this thread, NULL until it handles its first frame.
+ */
+static __thread struct ThreadCounters *counters;
+
+
+/**
+ * Counters of the calling thread, created on first use.
+ */
+static struct ThreadCounters *
+counters_get ()
+{
+  struct ThreadCounters *c = counters;
+  size_t size = sizeof (*c) + num_ifc * sizeof (struct PortCounters);
+  unsigned int i;
+
+  if (NULL != c)
+    return c;
+  i = atomic_fetch_add (&threadCountersLen,
+                        1);
+  if (i >= STATS_THREADS_MAX)
+    abort ();
+  c = aligned_alloc (64,
+                     (size + 63) & ~((size_t) 63));
+  if (NULL == c)
+    abort ();
+  memset (c,
+          0,
+          size);
+  threadCounters[i] = c;
+  counters = c;
+  return c;
+}
+
+
+/**
+ * Current time for FDB entries, in seconds.
+ */
+static uint32_t
+fdb_now ()
+{
+  return (uint32_t) (timer_now () / 1000);
+}
+
+
+/**
+ * Count FDB entry @a e for @a key, which is about to be removed.
+ *
+ * @param cls counter to increment
+ * @param key key of the entry
+ * @param e the entry
+ */
 static void
-print_frame(uint16_t interface,
-            const void *frame,
-            size_t frame_size) {
-    const uint8_t *frame1 = frame;
-    unsigned int index;
-
-    fprintf(stderr, "\n");
-    for (index = 0; index < frame_size; index++) {
-        fprintf(stderr, "%02X:",
-                frame1[index]);
-    };
-    fprintf(stderr, "\n");
-    fprintf(stderr, "frame_size: %lu", frame_size);
-    fprintf(stderr, "source: ");
-
-    for (index = 0; index < 6; index++) {
-        fprintf(stderr, "%02X:", frame1[index]);
-    };
-
-    fprintf(stderr, " destination: ");
-    for (index = 6; index < 12; index++) {
-        fprintf(stderr, "%02X:", frame1[index]);
-    };
-
-    fprintf(stderr, " payload: ");
-    for (index = 12; index < 20; index++) {
-        fprintf(stderr, "%02X:", frame1[index]);
-    };
-
-    fprintf(stderr, " fsc: ");
-    for (index = frame_size - 4; index < frame_size; index++) {
-        fprintf(stderr, "%02X:", frame1[index]);
-    };
-
-    fprintf(stderr, "\n");
+forget (void *cls,
+        uint64_t key,
+        const struct GLAB_FdbEntry *e)
+{
+  uint64_t *counter = cls;
+
+  (void) key;
+  (void) e;
+  (*counter)++;
 }
 
+
 /**
- * Parse and process frame received on @a ifc.
+ * Learn that @a src is at @a ifc in VLAN @a vlan, or that it moved
+ * there.  If the FDB is full, the entry unused for longest is evicted.
  *
- * @param ifc interface we got the frame on
- * @param frame raw frame data
- * @param frame_size number of bytes in @a frame
+ * @param ifc interface we got a frame from @a src on
+ * @param src source MAC of the frame
+ * @param vlan VLAN of the frame
  */
 static void
-parse_frame (struct Interface *ifc,
-	     const void *frame,
-	     size_t frame_size)
+learn (struct Interface *ifc,
+       const struct MacAddress *src,
+       uint16_t vlan)
 {
-  const uint8_t *framec = frame;
-  struct EthernetHeader ethernetHeader;
+  uint64_t key = fdb_key (src,
+                          vlan);
+  uint32_t now = fdb_now ();
+  struct GLAB_FdbEntry e;
+  struct GLAB_FdbEntry old;
+
+  if ( (fdb_get (&vswitchFdb,
+                 key,
+                 now,
+                 &e)) &&
+       (e.port == ifc->ifc_num) )
+    return;
+  pthread_mutex_lock (&learnLock);
+  if (fdb_get (&vswitchFdb,
+               key,
+               now,
+               &e))
+    {
+      if (e.port == ifc->ifc_num)
+        {
+          /* another worker was faster */
+          pthread_mutex_unlock (&learnLock);
+          return;
+        }
+      fdbStats.moved++;
+    }
+  else
+    {
+      if (fdb_size (&vswitchFdb) >= fdbMax)
+        (void) fdb_evict (&vswitchFdb,
+                          &forget,
+                          &fdbStats.evicted);
+      fdbStats.learned++;
+    }
+  memset (&e,
+          0,
+          sizeof (e));
+  e.seen = now;
+  e.port = ifc->ifc_num;
+  e.referenced = 1;
+  if (FDB_PUT_NEW == fdb_put (&vswitchFdb,
+                              key,
+                              &e,
+                              &old))
+    TRACE (TRACE_LEVEL_EVENT, TRACE_FDB_LEARN, ifc->ifc_num,
+           trace_mac (src), vlan);
+  pthread_mutex_unlock (&learnLock);
+}
+
 
-  if (frame_size < sizeof (ethernetHeader))
+/**
+ * (Re)compute #floodLists from the VLAN bitmaps of the interfaces.
+ * Call at startup and whenever VLAN membership changes, while no
+ * frame handler runs.
+ */
+static void
+flood_lists_build ()
+{
+  for (unsigned int vlan = 0; vlan < 4096; vlan++)
   {
-    fprintf (stderr,
-	     "Malformed frame\n");
-    return;
-  }
-  memcpy (&ethernetHeader,
-	  frame,
-	  sizeof (ethernetHeader));
-  /* DO work here! */
-
-  ethernetHeader.vlanId = htons(ethernetHeader.vlanId);
-  for (int i = 0; ifc->tagged_vlans[i] != NO_VLAN; i++) {
-    fprintf(stderr, "tagged_vlans: %04X\n", ifc->tagged_vlans[i]);
+    unsigned int num = 0;
+    struct FloodList *fl;
+
+    free (floodLists[vlan]);
+    floodLists[vlan] = NULL;
+    for (unsigned int i = 0; i < num_ifc; i++)
+      if ( (vlan_member (gifc[i].untagged_vlans,
+                         vlan)) ||
+           (vlan_member (gifc[i].tagged_vlans,
+                         vlan)) )
+        num++;
+    if (0 == num)
+      continue;
+    fl = malloc (sizeof (*fl) + num * sizeof (uint16_t));
+    if (NULL == fl)
+      abort ();
+    fl->num_untagged = 0;
+    fl->num_tagged = 0;
+    for (unsigned int i = 0; i < num_ifc; i++)
+      if (vlan_member (gifc[i].untagged_vlans,
+                       vlan))
+        fl->ports[fl->num_untagged++] = gifc[i].ifc_num;
+    for (unsigned int i = 0; i < num_ifc; i++)
+      if ( (! vlan_member (gifc[i].untagged_vlans,
+                           vlan)) &&
+           (vlan_member (gifc[i].tagged_vlans,
+                         vlan)) )
+        fl->ports[fl->num_untagged + fl->num_tagged++] = gifc[i].ifc_num;
+    floodLists[vlan] = fl;
   }
+}
 
-  fprintf(stderr, "ethernet header tag: %04X\n", ethernetHeader.tag);
-  fprintf(stderr, "ethernet header vlanId: %04X\n", ethernetHeader.vlanId);
 
-  for (int i = 0; i < num_ifc; i++) {
-    fprintf(stderr, "ifc_name: %s\n", gifc[i].ifc_name);
-    fprintf(stderr, "ifc_num: %d\n", gifc[i].ifc_num);
-    fprintf(stderr, "untagged_vlan: %04X\n", gifc[i].untagged_vlan);
+/**
+ * Timer callback: free FDB tables that outgrew and age out entries,
+ * looking at enough slots per run to pass the whole table twice per
+ * aging time.  Workers are idle, so no frame handler can still use
+ * the old tables or change the table meanwhile.
+ *
+ * @param cls NULL
+ */
+static void
+fdb_sweep_tick (void *cls)
+{
+  size_t budget;
 
-    for (int j = 0; gifc[i].tagged_vlans[j] != NO_VLAN; j++) {
-      fprintf(stderr, "tagged_vlans: %04X\n", gifc[i].tagged_vlans[j]);
+  (void) cls;
+  fdb_reclaim (&vswitchFdb);
+  if (0 != fdbAging)
+    {
+      budget = fdb_slots (fdb_table (&vswitchFdb))
+        * FDB_SWEEP_MS / 500 / fdbAging;
+      if (budget < FDB_SWEEP_MIN)
+        budget = FDB_SWEEP_MIN;
+      fdb_sweep (&vswitchFdb,
+                 fdb_now (),
+                 fdbAging,
+                 budget,
+                 &forget,
+                 &fdbStats.aged);
     }
-  }
+  timer_reschedule (&fdbSweepTimer,
+                    FDB_SWEEP_MS);
+}
+
+
+/**
+ * Read the FDB limits from the environment and start aging.
+ */
+static void
+fdb_init ()
+{
+  const char *env;
+
+  if (NULL != (env = getenv (FDB_AGING_ENV)))
+    fdbAging = (unsigned int) strtoul (env,
+                                       NULL,
+                                       10);
+  if (NULL != (env = getenv (FDB_MAX_ENV)))
+    fdbMax = (unsigned int) strtoul (env,
+                                     NULL,
+                                     10);
+  if (0 == fdbMax)
+    fdbMax = 1;
+  timer_schedule (&fdbSweepTimer,
+                  FDB_SWEEP_MS,
+                  &fdb_sweep_tick,
+                  NULL);
+}
+
 
-  if (ethernetHeader.tag == 0x0081) {
-    for (int i = 0; ifc->tagged_vlans[i] != ethernetHeader.vlanId; i++) {
-      if (ifc -> tagged_vlans[i] == NO_VLAN) {
-        return;
-      }
+/**
+ * Push an 802.1Q tag for VLAN @a vlan onto frame @a f in place, by
+ * moving the MAC addresses into the headroom.
+ *
+ * @param f the frame, must not be tagged yet
+ * @param vlan VLAN to tag the frame with
+ * @return start of the tagged frame, 4 bytes before @a f's data
+ */
+static const uint8_t *
+vlan_push (const struct GLAB_Frame *f,
+           uint16_t vlan)
+{
+  uint8_t *frame = (uint8_t *) f->data - sizeof (struct Q);
+  struct Q q = { htons (ETH_802_1Q_TAG), htons (vlan) };
+
+  if (f->headroom < sizeof (struct Q))
+    abort ();
+  memmove (frame,
+           f->data,
+           2 * MAC_ADDR_SIZE);
+  memcpy (&frame[2 * MAC_ADDR_SIZE],
+          &q,
+          sizeof (q));
+  return frame;
+}
+
+
+/**
+ * Pop the 802.1Q tag of frame @a f in place, by moving the MAC
+ * addresses over it.
+ *
+ * @param f the frame, must be tagged
+ * @return start of the untagged frame, 4 bytes after @a f's data
+ */
+static const uint8_t *
+vlan_pop (const struct GLAB_Frame *f)
+{
+  uint8_t *frame = (uint8_t *) f->data + sizeof (struct Q);
+
+  memmove (frame,
+           f->data,
+           2 * MAC_ADDR_SIZE);
+  return frame;
+}
+
+
+/**
+ * Send frame @a f of VLAN @a vlan untagged to the interfaces
+ * @a untagged and with an 802.1Q tag to the interfaces @a tagged.
+ * The variant that differs from the frame as received is built in
+ * place if only it is sent, otherwise it is sent as a new header
+ * followed by the rest of @a f, so that @a f is never copied.
+ *
+ * @param f the frame as received
+ * @param vlan VLAN of the frame
+ * @param untagged interface numbers to send to without tag
+ * @param num_untagged number of entries in @a untagged
+ * @param tagged interface numbers to send to with tag
+ * @param num_tagged number of entries in @a tagged
+ */
+static void
+output_vlan (const struct GLAB_Frame *f,
+             uint16_t vlan,
+             const uint16_t *untagged,
+             unsigned int num_untagged,
+             const uint16_t *tagged,
+             unsigned int num_tagged)
+{
+  bool is_tagged = (0 != f->num_tags);
+  const uint16_t *same = is_tagged ? tagged : untagged;
+  unsigned int num_same = is_tagged ? num_tagged : num_untagged;
+  const uint16_t *other = is_tagged ? untagged : tagged;
+  unsigned int num_other = is_tagged ? num_untagged : num_tagged;
+  size_t other_size = is_tagged
+    ? f->size - sizeof (struct Q)
+    : f->size + sizeof (struct Q);
+  struct ThreadCounters *c = counters_get ();
+  struct VlanCounters *vc = &c->vlans[vlan];
+  uint8_t prefix[2 * MAC_ADDR_SIZE + sizeof (struct Q)];
+  size_t skip;
+
+  for (unsigned int i=0;i<num_same;i++)
+    {
+      struct PortCounters *pc = &c->ports[same[i] - 1];
+
+      pc->tx.frames++;
+      pc->tx.bytes += f->size;
+      TRACE (TRACE_LEVEL_FRAME, TRACE_VLAN_OUT, same[i],
+             vlan, is_tagged);
     }
+  for (unsigned int i=0;i<num_other;i++)
+    {
+      struct PortCounters *pc = &c->ports[other[i] - 1];
 
-    if (ifc -> untagged_vlan != NO_VLAN) {
-      return;
+      pc->tx.frames++;
+      pc->tx.bytes += other_size;
+      TRACE (TRACE_LEVEL_FRAME, TRACE_VLAN_OUT, other[i],
+             vlan, ! is_tagged);
     }
-  }
-  else {
-    if (ifc -> untagged_vlan == NO_VLAN) {
+  vc->tx.frames += num_same + num_other;
+  vc->tx.bytes += num_same * f->size + num_other * other_size;
+  forward_to_many (same,
+                   num_same,
+                   f->data,
+                   f->size);
+  if (0 == num_other)
+    return;
+  if (0 == num_same)
+    {
+      forward_to_many (other,
+                       num_other,
+                       is_tagged
+                       ? vlan_pop (f)
+                       : vlan_push (f,
+                                    vlan),
+                       other_size);
       return;
     }
-  }
+  /* output refers to the frame as received until it is flushed, so
+     only the header of the other variant is built, in a copy */
+  memcpy (prefix,
+          f->data,
+          2 * MAC_ADDR_SIZE);
+  skip = 2 * MAC_ADDR_SIZE;
+  if (is_tagged)
+    {
+      skip += sizeof (struct Q);
+    }
+  else
+    {
+      struct Q q = { htons (ETH_802_1Q_TAG), htons (vlan) };
 
-  bool foundEntry = false;
-  for (int i = 0; i < switchTableIndex; i++){
-    if (0 == maccmp(&switchCache[i].macAddress, &ethernetHeader.src)) {
-      foundEntry = true;
-      switchCache[i].interface = ifc;
+      memcpy (&prefix[2 * MAC_ADDR_SIZE],
+              &q,
+              sizeof (q));
     }
-  }
+  forward_to_many_prefixed (other,
+                            num_other,
+                            prefix,
+                            is_tagged
+                            ? 2 * MAC_ADDR_SIZE
+                            : sizeof (prefix),
+                            (const uint8_t *) f->data + skip,
+                            f->size - skip);
+}
 
-  if (!foundEntry && switchTableIndex < 500)
+
+/**
+ * Process frame @a f received on @a ifc.
+ *
+ * @param ifc interface we got the frame on
+ * @param f the frame
+ */
+static void
+parse_frame (struct Interface *ifc,
+	     const struct GLAB_Frame *f)
+{
+  const struct EthernetHeader *eh = f->data;
+  bool tagged = (0 != f->num_tags);
+  uint16_t vlan;
+  uint16_t tagged_egress[num_ifc];
+  uint16_t untagged_egress[num_ifc];
+  unsigned int num_tagged = 0;
+  unsigned int num_untagged = 0;
+  struct GLAB_FdbEntry e;
+  struct ThreadCounters *c = counters_get ();
+  struct PortCounters *pc = &c->ports[ifc->ifc_num - 1];
+
+  pc->rx.frames++;
+  pc->rx.bytes += f->size;
+  if (f->size < sizeof (*eh) + sizeof (uint16_t)) /* TCI */
   {
-    switchCache[switchTableIndex].interface = ifc;
-    switchCache[switchTableIndex].macAddress = ethernetHeader.src;
-    switchTableIndex++;
+    fprintf (stderr,
+	     "Malformed frame\n");
+    pc->drops[DROP_MALFORMED]++;
+    return;
   }
-
-  fprintf(stderr, "ethernetHeader dst:\n");
-  printMac(&ethernetHeader.dst);
-  fprintf(stderr, "\n");
-
-  for (int i = 0; i < switchTableIndex; i++) {
-    if (0 == maccmp(&ethernetHeader.dst, &switchCache[i].macAddress)) {
-      if (ethernetHeader.tag == htons(0x8100)) {
-        if (ethernetHeader.vlanId == switchCache[i].interface -> untagged_vlan) {
-          const uint8_t *frame1 = frame;
-          uint8_t frame2[frame_size - 4];
-          memcpy(&frame2, &frame1, 12);
-          memcpy(&frame2[12], &frame1[16], frame_size - 12);
-          forward_to(switchCache[i].interface, frame2, sizeof(frame2));
-          return;
-        }
-        else {
-          for (int j = 0; switchCache[i].interface->tagged_vlans[j] != ethernetHeader.vlanId; j++) {
-            if (switchCache[i].interface -> tagged_vlans[j] == NO_VLAN) {
-              return;
-            }
-          }
-
-          forward_to(switchCache[i].interface, frame, frame_size);
-          return;
-        }
-      }
-      else {
-        if (ifc -> untagged_vlan == switchCache[i].interface -> untagged_vlan) {
-          forward_to(switchCache[i].interface, frame, frame_size);
-          return;
-        }
-        else {
-          for (int j = 0; switchCache[i].interface->tagged_vlans[j] != ifc->untagged_vlan; j++) {
-            if (switchCache[i].interface -> tagged_vlans[j] == NO_VLAN) {
-              return;
-            }
-          }
-
-          const uint8_t *frame1 = frame;
-          uint8_t frame2[frame_size + 4];
-          struct Q q = {htons(0x8100), ifc->untagged_vlan};
-
-          memcpy(&frame2, frame1, 12);
-          memcpy(&frame2[12], &q, sizeof(struct Q));
-          memcpy(&frame2[16], &frame1[12], frame_size - 16);
-
-          forward_to(switchCache[i].interface, frame1, sizeof(frame1));
-          return;
-        }
-      }
+  if (tagged)
+  {
+    vlan = f->tci[0] & 0xFFF;
+    if (! vlan_member (ifc->tagged_vlans,
+                       vlan))
+    {
+      pc->drops[DROP_VLAN_NOT_PERMITTED]++;
+      return;
     }
   }
+  else
+  {
+    if (NO_VLAN == ifc->untagged_vlan)
+    {
+      pc->drops[DROP_UNTAGGED_ON_TRUNK]++;
+      return;
+    }
+    vlan = ifc->untagged_vlan;
+  }
+  c->vlans[vlan].rx.frames++;
+  c->vlans[vlan].rx.bytes += f->size;
+  TRACE (TRACE_LEVEL_FRAME, TRACE_VLAN_IN, ifc->ifc_num,
+         vlan, tagged);
+  learn (ifc,
+         &eh->src,
+         vlan);
+  if (fdb_get (&vswitchFdb,
+               fdb_key (&eh->dst,
+                        vlan),
+               0,
+               &e))
+  {
+    struct Interface *dst = &gifc[e.port - 1];
 
-  for (int i = 0; i < num_ifc; i++) {
-    if (0 != maccmp(&ifc->mac, &gifc[i].mac)) {
-      if (ethernetHeader.tag == htons(0x8100)) {
-        if (ethernetHeader.vlanId == gifc[i].untagged_vlan) {
-          const uint8_t *frame1 = frame;
-          uint8_t frame2[frame_size - 4];
-
-          print_frame(gifc[i].ifc_num, frame, frame_size);
-
-          memcpy(&frame2, frame, 12);
-          memcpy(&frame2[12], &frame[16], frame_size - 12);
-          struct EthernetHeader ethernetHeader1;
-          
-          forward_to(&gifc[i], frame2, sizeof(frame2));
-        }
-        else {
-          bool doSendFrame = true;
-          for (int j = 0; gifc[i].tagged_vlans[j] != ethernetHeader.vlanId; j++) {
-            if (gifc[i].tagged_vlans[j] == NO_VLAN) {
-              doSendFrame = false;
-              break;
-            }
-          }
-
-          if (doSendFrame) {
-            const uint8_t *frame1 = frame;
-            uint8_t frame2[frame_size + 4];
-            struct Q q = {htons(0x8100), htons(ifc->untagged_vlan)};
-
-            memcpy(&frame2[16], &frame1[12], frame_size - 16);
-            forward_to(&gifc[i], frame, frame_size);
-          }
-        }
-      }
-      else {
-        if (ifc-> untagged_vlan == gifc[i].untagged_vlan) {
-          printMac(&gifc[i].mac);
-          forward_to(&gifc[i], frame, frame_size);
-        }
-        else {
-          bool doSendFrame = true;
-          for (int j = 0; gifc[i].tagged_vlans[j] != ifc->untagged_vlan; j++) {
-            if (gifc[i].tagged_vlans[j] == NO_VLAN) {
-              doSendFrame = false;
-              break;
-            }
-          }
-
-          if (doSendFrame) {
-            const uint8_t *frame1 = frame;
-            uint8_t frame2[frame_size + 4];
-
-            fprintf(stderr, "dest address: ");
-            printMac(&gifc[i].mac);
-            fprintf(stderr, ", dest: %s\n", gifc[i].ifc_name);
-
-            struct Q q = {0x0081, 0x0100};
-            memcpy(&frame2, frame1, 12);
-            memcpy(&frame2[12], &q, sizeof(struct Q));
-            memcpy(&frame2[16], &frame1[12], frame_size - 12);
-
-            struct EthernetHeader ethernetHeader1;
-            memcpy(&ethernetHeader1, frame1, sizeof(ethernetHeader1));
-
-
-            fprintf(stderr, "ethernetHeader.src:\n");
-            printMac(&ethernetHeader1.src);
-            fprintf(stderr, "ethernetHeader.dst:\n");
-            printMac(&ethernetHeader1.dst);
-            fprintf(stderr, "ethernetHeader.vlanId: %04X\n", ethernetHeader1.vlanId);
-            fprintf(stderr, "ethernetHeader.vlanId: %04X\n", ethernetHeader1.tag);
-
-            forward_to(&gifc[i], frame2, sizeof(frame2));
-          }
-        }
-      }
+    /* Never send a frame back out where it came from */
+    if (dst == ifc)
+    {
+      pc->drops[DROP_SAME_INTERFACE]++;
+      return;
     }
+    if (vlan_member (dst->untagged_vlans,
+                     vlan))
+      untagged_egress[num_untagged++] = dst->ifc_num;
+    else if (vlan_member (dst->tagged_vlans,
+                          vlan))
+      tagged_egress[num_tagged++] = dst->ifc_num;
+  }
+  else if (NULL != floodLists[vlan])
+  {
+    const struct FloodList *fl = floodLists[vlan];
+    const uint16_t *tagged_ports = &fl->ports[fl->num_untagged];
+
+    for (unsigned int i = 0; i < fl->num_untagged; i++)
+      if (fl->ports[i] != ifc->ifc_num)
+        untagged_egress[num_untagged++] = fl->ports[i];
+    for (unsigned int i = 0; i < fl->num_tagged; i++)
+      if (tagged_ports[i] != ifc->ifc_num)
+        tagged_egress[num_tagged++] = tagged_ports[i];
+  }
+  if (0 == num_untagged + num_tagged)
+  {
+    pc->drops[DROP_NO_EGRESS]++;
+    return;
   }
+  output_vlan (f,
+               vlan,
+               untagged_egress,
+               num_untagged,
+               tagged_egress,
+               num_tagged);
 }
 
 
 /**
- * Process frame received from @a interface.
+ * Process frame @a f received from @a f->interface.
  *
- * @param interface number of the interface on which we received @a frame
- * @param frame the frame
- * @param frame_size number of bytes in @a frame
+ * @param f the frame, parsed by loop.c
  */
 static void
-handle_frame (uint16_t interface,
-	      const void *frame,
-	      size_t frame_size)
+handle_frame (const struct GLAB_Frame *f)
 {
-  if (interface > num_ifc)
+  if (f->interface > num_ifc)
     abort ();
-  parse_frame (&gifc[interface - 1],
-	       frame,
-	       frame_size);
+  parse_frame (&gifc[f->interface - 1],
+	       f);
 }
 
+/**
+ * Add @a rx and @a tx to the output of the "vlan stats" command.
+ */
+static void
+print_traffic (const struct TrafficCounters *rx,
+               const struct TrafficCounters *tx)
+{
+  print_add_str (" rx ");
+  print_add_uint (rx->frames);
+  print_add_str (" frames ");
+  print_add_uint (rx->bytes);
+  print_add_str (" bytes, tx ");
+  print_add_uint (tx->frames);
+  print_add_str (" frames ");
+  print_add_uint (tx->bytes);
+  print_add_str (" bytes");
+}
+
+
+/**
+ * Handle the "vlan stats" command: show the traffic and drops of each
+ * interface, the traffic of each VLAN that has members or traffic,
+ * and how the FDB fares.
+ */
+static void
+vlan_stats ()
+{
+  unsigned int nt = atomic_load (&threadCountersLen);
+
+  for (unsigned int i = 0; i < num_ifc; i++)
+  {
+    struct PortCounters sum;
+
+    memset (&sum,
+            0,
+            sizeof (sum));
+    for (unsigned int t = 0; t < nt; t++)
+    {
+      const struct PortCounters *pc = &threadCounters[t]->ports[i];
+
+      sum.rx.frames += pc->rx.frames;
+      sum.rx.bytes += pc->rx.bytes;
+      sum.tx.frames += pc->tx.frames;
+      sum.tx.bytes += pc->tx.bytes;
+      for (unsigned int r = 0; r < DROP_MAX; r++)
+        sum.drops[r] += pc->drops[r];
+    }
+    print_add_str ("port ");
+    print_add_str (gifc[i].ifc_name);
+    print_add_char (':');
+    print_traffic (&sum.rx,
+                   &sum.tx);
+    print_add_str (", drops");
+    for (unsigned int r = 0; r < DROP_MAX; r++)
+    {
+      print_add_char (' ');
+      print_add_str (drop_names[r]);
+      print_add_char (' ');
+      print_add_uint (sum.drops[r]);
+    }
+    print_add_char ('\n');
+  }
+  for (unsigned int vlan = 0; vlan < 4096; vlan++)
+  {
+    struct VlanCounters sum;
+
+    memset (&sum,
+            0,
+            sizeof (sum));
+    for (unsigned int t = 0; t < nt; t++)
+    {
+      const struct VlanCounters *vc = &threadCounters[t]->vlans[vlan];
+
+      sum.rx.frames += vc->rx.frames;
+      sum.rx.bytes += vc->rx.bytes;
+      sum.tx.frames += vc->tx.frames;
+      sum.tx.bytes += vc->tx.bytes;
+    }
+    if ( (NULL == floodLists[vlan]) &&
+         (0 == sum.rx.frames) )
+      continue;
+    print_add_str ("vlan ");
+    print_add_uint (vlan);
+    print_add_char (':');
+    print_traffic (&sum.rx,
+                   &sum.tx);
+    print_add_char ('\n');
+  }
+  print ("fdb: %u entries (max %u), aging %u s, learned %llu moved %llu aged %llu evicted %llu\n",
+         (unsigned int) fdb_size (&vswitchFdb),
+         fdbMax,
+         fdbAging,
+         (unsigned long long) fdbStats.learned,
+         (unsigned long long) fdbStats.moved,
+         (unsigned long long) fdbStats.aged,
+         (unsigned long long) fdbStats.evicted);
+}
+
+
 /**
  * Handle control message @a cmd.
  *
@@ -448,6 +960,40 @@ handle_control (char *cmd,
 		size_t cmd_len)
 {
   cmd[cmd_len - 1] = '\0';
+  if (0 == strcasecmp (cmd,
+                       "trace"))
+    {
+      trace_command ();
+      return;
+    }
+  if ( (0 == strncasecmp (cmd,
+                          "perf",
+                          strlen ("perf"))) &&
+       ( ('\0' == cmd[strlen ("perf")]) ||
+         (' ' == cmd[strlen ("perf")]) ) )
+    {
+      const char *arg = &cmd[strlen ("perf")];
+
+      while (' ' == *arg)
+        arg++;
+      perf_command (('\0' == *arg) ? NULL : arg);
+      return;
+    }
+  if (0 == strncasecmp (cmd,
+                        "vlan",
+                        strlen ("vlan")))
+    {
+      const char *arg = &cmd[strlen ("vlan")];
+
+      while (' ' == *arg)
+        arg++;
+      if (0 == strcasecmp (arg,
+                           "stats"))
+        vlan_stats ();
+      else
+        print ("Usage: vlan stats\n");
+      return;
+    }
   fprintf (stderr,
            "Received command `%s' (ignored)\n",
            cmd);
@@ -485,7 +1031,6 @@ parse_tagged (const char *start,
 	      struct Interface *ifc)
 {
   char *spec;
-  unsigned int pos;
 
   if (':' != *start)
   {
@@ -502,7 +1047,6 @@ parse_tagged (const char *start,
     perror ("strndup");
     return 1;
   }
-  pos = 0;
   for (const char *tok = strtok (spec,
 				 ",");
        NULL != tok;
@@ -511,14 +1055,6 @@ parse_tagged (const char *start,
   {
     unsigned int tag;
 
-    if (pos == MAX_VLANS)
-    {
-      fprintf (stderr,
-	       "Too many VLANs specified for interface #%d\n",
-	       off);
-      free (spec);
-      return 1;
-    }
     if (1 != sscanf (tok,
 		     "%u",
 		     &tag))
@@ -538,9 +1074,9 @@ parse_tagged (const char *start,
       free (spec);
       return 1;
     }
-    ifc->tagged_vlans[pos++] = (int16_t) tag;
+    vlan_add (ifc->tagged_vlans,
+              (uint16_t) tag);
   }
-  ifc->tagged_vlans[pos] = NO_VLAN;
   free (spec);
   return 0;
 }
@@ -600,6 +1136,8 @@ parse_untagged (const char *start,
     return 1;
   }
   ifc->untagged_vlan = (int16_t) tag;
+  vlan_add (ifc->untagged_vlans,
+            (uint16_t) tag);
   free (spec);
   return 0;
 }
@@ -610,7 +1148,7 @@ parse_untagged (const char *start,
  *
  * @param arg command-line argument
  * @param off offset of @a arg for error reporting
- * @param ifc interface to initialize (ifc_name, tagged_vlans and untagged_vlan).
+ * @param ifc interface to initialize (ifc_name, tagged_vlans, untagged_vlans and untagged_vlan), zeroed.
  * @return 0 on success
  */
 static int
@@ -621,7 +1159,6 @@ parse_vlan_args (const char *arg,
   const char *openbracket;
   const char *closebracket;
 
-  ifc->tagged_vlans[0] = NO_VLAN;
   ifc->untagged_vlan = NO_VLAN;
   openbracket = strchr (arg,
 			(unsigned char) '[');
@@ -634,6 +1171,8 @@ parse_vlan_args (const char *arg,
       return 1;
     }
     ifc->untagged_vlan = DEFAULT_VLAN;
+    vlan_add (ifc->untagged_vlans,
+              DEFAULT_VLAN);
     return 0;
   }
   ifc->ifc_name = strndup (arg,
@@ -693,7 +1232,6 @@ main (int argc,
 {
   struct Interface ifc[argc-1];
 
-  (void) print;
   memset (ifc,
 	  0,
 	  sizeof (ifc));
@@ -706,6 +1244,8 @@ main (int argc,
       return 1;
     }
   }
+  flood_lists_build ();
+  fdb_init ();
   loop ();
   return 0;
 }
@@ -0,0 +1,431 @@
+/*
+     This file (was) part of GNUnet.
+     Copyright (C) 2018 Christian Grothoff
+
+     GNUnet is free software: you can redistribute it and/or modify it
+     under the terms of the GNU Affero General Public License as published
+     by the Free Software Foundation, either version 3 of the License,
+     or (at your option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Affero General Public License for more details.
+
+     You should have received a copy of the GNU Affero General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file workers.c
+ * @brief Optional worker threads for loop.c.  Programs whose frame
+ *        handlers are thread-safe opt in by defining
+ *        GLAB_WORKER_THREADS before including loop.c; with
+ *        GLAB_WORKERS=K (K > 1) in the environment, frames are then
+ *        handled by K threads,
+ *        each frame by the thread its flow hashes to, so frames of a
+ *        flow are handled and sent in order.  Commands, MACs and
+ *        timers are handled by the main thread while all workers are
+ *        idle, so they never run concurrently with frame handlers.
+ *        Frame handlers of different flows DO run concurrently and
+ *        must only touch shared state that tolerates this (such as
+ *        tables that only commands modify).
+ */
+#include <pthread.h>
+
+
+/**
+ * Environment variable with the number of worker threads.
+ */
+#define WORKERS_ENV "GLAB_WORKERS"
+
+/**
+ * Upper bound for the number of workers.
+ */
+#define WORKERS_MAX 64
+
+/**
+ * Size of each worker's input and output ring.
+ */
+#define WORKER_RING_SIZE (1 << 21)
+
+/**
+ * Size of the buffer into which a worker takes frames from its ring.
+ */
+#define WORKER_BUF_SIZE (1 << 20)
+
+/**
+ * Largest frame that still fits into a ring message together with
+ * its descriptor.
+ */
+#define WORKER_DESCRIBED_MAX (UINT16_MAX - sizeof (struct GLAB_MessageHeader) \
+                              - sizeof (struct GLAB_Frame))
+
+/**
+ * Set in the type of ring messages with a frame too large to carry
+ * its descriptor along (see #WORKER_DESCRIBED_MAX); the worker parses
+ * those itself.
+ */
+#define WORKER_UNPARSED 0x8000
+
+
+/**
+ * State of a worker thread.
+ */
+struct Worker
+{
+  /**
+   * Frames from the main thread.
+   */
+  struct GLAB_Ring in;
+
+  /**
+   * Output for the main thread to write.
+   */
+  struct GLAB_Ring out;
+
+  /**
+   * The worker sleeps on this when @e in is empty.
+   */
+  struct GLAB_Waiter wait;
+
+  /**
+   * Number of frames the worker has handled.
+   */
+  _Atomic uint64_t done __attribute__ ((aligned (64)));
+
+  /**
+   * Number of frames given to the worker, main thread only.
+   */
+  uint64_t pushed __attribute__ ((aligned (64)));
+
+  pthread_t thread;
+};
+
+
+/**
+ * All workers, NULL if we run single-threaded.
+ */
+static struct Worker *workers;
+
+/**
+ * Number of entries in #workers.
+ */
+static unsigned int num_workers;
+
+/**
+ * The main thread sleeps on this; woken by output from workers.
+ */
+static struct GLAB_Waiter workers_main;
+
+
+/**
+ * Hash of the flow @a f belongs to: IP addresses, protocol and ports
+ * where available, otherwise the MAC addresses.
+ */
+static uint32_t
+workers_flow_hash (const struct GLAB_Frame *f)
+{
+  const unsigned char *p = f->data;
+  uint32_t h = 2166136261u;
+  uint16_t l3 = f->l3_offset;
+  unsigned int off = 0;
+  unsigned int len = 2 * MAC_ADDR_SIZE;
+  unsigned int l4 = 0;
+  uint8_t proto = 0;
+
+  if (0 != (f->flags & GLAB_FRAME_IPV4))
+    {
+      off = l3 + 12; /* source and destination address */
+      len = 8;
+      proto = f->ip_proto;
+      if (0 == (f->flags & GLAB_FRAME_FRAGMENT))
+        l4 = f->l4_offset;
+    }
+  else if ( (0x86DD == f->ethertype) &&
+            (f->size >= l3 + 40) )
+    {
+      off = l3 + 8;
+      len = 32;
+      proto = p[l3 + 6];
+      l4 = l3 + 40;
+    }
+  for (unsigned int i=0;i<len;i++)
+    h = (h ^ p[off + i]) * 16777619u;
+  h = (h ^ proto) * 16777619u;
+  if ( (0 != l4) &&
+       ( (IPPROTO_TCP == proto) ||
+         (IPPROTO_UDP == proto) ) &&
+       (f->size >= l4 + 4) )
+    for (unsigned int i=0;i<4;i++)
+      h = (h ^ p[l4 + i]) * 16777619u;
+  h ^= h >> 16;
+  return h;
+}
+
+
+/**
+ * Main function of a worker thread.
+ *
+ * @param cls the `struct Worker`
+ * @return NULL
+ */
+static void *
+worker_run (void *cls)
+{
+  struct Worker *w = cls;
+  char *buf = malloc (WORKER_BUF_SIZE);
+
+  if (NULL == buf)
+    abort ();
+  output_sink = &w->out;
+  while (1)
+    {
+      size_t off = 0;
+      unsigned int n = 0;
+#ifdef GLAB_HANDLE_FRAMES
+      struct GLAB_Frame frames[LOOP_MAX_FRAMES];
+#endif
+
+      /* take as many frames as fit */
+      while ( (n < LOOP_MAX_FRAMES) &&
+              (WORKER_BUF_SIZE - off > UINT16_MAX) )
+        {
+          struct GLAB_MessageHeader hdr;
+          uint16_t size = ring_pop (&w->in,
+                                    &buf[off]);
+          uint16_t type;
+#ifdef GLAB_HANDLE_FRAMES
+          struct GLAB_Frame *f = &frames[n];
+#else
+          struct GLAB_Frame single;
+          struct GLAB_Frame *f = &single;
+#endif
+
+          if (0 == size)
+            break;
+          memcpy (&hdr,
+                  &buf[off],
+                  sizeof (hdr));
+          type = ntohs (hdr.type);
+          if (0 != (type & WORKER_UNPARSED))
+            {
+              loop_parse_frame (f,
+                                type & ~WORKER_UNPARSED,
+                                &buf[off + sizeof (hdr)],
+                                size - sizeof (hdr));
+            }
+          else
+            {
+              /* parsed by workers_dispatch(); the descriptor's bytes
+                 are free now and serve as headroom */
+              memcpy (f,
+                      &buf[off + sizeof (hdr)],
+                      sizeof (*f));
+              f->data = &buf[off + sizeof (hdr) + sizeof (*f)];
+            }
+#ifndef GLAB_HANDLE_FRAMES
+          handle_frame (f);
+#endif
+          off += size;
+          n++;
+        }
+#ifdef GLAB_HANDLE_FRAMES
+      if (0 != n)
+        handle_frames (frames,
+                       n);
+#endif
+      if (0 != n)
+        {
+          atomic_fetch_add (&w->done,
+                            n);
+          waiter_wake (&workers_main);
+          continue;
+        }
+      waiter_prepare (&w->wait);
+      if (ring_empty (&w->in))
+        waiter_sleep (&w->wait);
+      else
+        waiter_done (&w->wait);
+    }
+  return NULL;
+}
+
+
+/**
+ * Start workers if requested in the environment and supported by
+ * the program (see #GLAB_WORKER_THREADS).
+ *
+ * @return 0 on success (including if no workers were requested)
+ */
+static int
+workers_start ()
+{
+  const char *env = getenv (WORKERS_ENV);
+  unsigned int k;
+
+#ifndef GLAB_WORKER_THREADS
+  if (NULL != env)
+    fprintf (stderr,
+             "%s ignored, frame handlers are not thread-safe\n",
+             WORKERS_ENV);
+  return 0;
+#endif
+  if ( (NULL == env) ||
+       (1 != sscanf (env,
+                     "%u",
+                     &k)) ||
+       (k < 2) )
+    return 0;
+  if (k > WORKERS_MAX)
+    k = WORKERS_MAX;
+  (void) glab_features (); /* cache before threads read it */
+  if (0 != waiter_init (&workers_main))
+    return -1;
+  if (0 != posix_memalign ((void **) &workers,
+                           64,
+                           k * sizeof (struct Worker)))
+    return -1;
+  memset (workers,
+          0,
+          k * sizeof (struct Worker));
+  for (unsigned int i=0;i<k;i++)
+    {
+      struct Worker *w = &workers[i];
+
+      atomic_init (&w->done,
+                   0);
+      if ( (0 != waiter_init (&w->wait)) ||
+           (0 != ring_init (&w->in,
+                            WORKER_RING_SIZE,
+                            &w->wait)) ||
+           (0 != ring_init (&w->out,
+                            WORKER_RING_SIZE,
+                            &workers_main)) ||
+           (0 != pthread_create (&w->thread,
+                                 NULL,
+                                 &worker_run,
+                                 w)) )
+        return -1;
+      num_workers = i + 1;
+    }
+  return 0;
+}
+
+
+/**
+ * Pass output of the workers on to the output layer (main thread).
+ */
+static void
+workers_collect ()
+{
+  static char msg[UINT16_MAX + 1];
+
+  for (unsigned int i=0;i<num_workers;i++)
+    {
+      uint16_t size;
+
+      while (0 != (size = ring_pop (&workers[i].out,
+                                    msg)))
+        {
+          struct GLAB_MessageHeader hdr;
+
+          memcpy (&hdr,
+                  msg,
+                  sizeof (hdr));
+          output_message (ntohs (hdr.type),
+                          NULL,
+                          0,
+                          &msg[sizeof (hdr)],
+                          size - sizeof (hdr));
+        }
+    }
+}
+
+
+/**
+ * Does any worker have output for us?
+ */
+static int
+workers_have_output ()
+{
+  for (unsigned int i=0;i<num_workers;i++)
+    if (! ring_empty (&workers[i].out))
+      return 1;
+  return 0;
+}
+
+
+/**
+ * Wait a little for the workers (main thread).
+ */
+static void
+workers_wait ()
+{
+  struct pollfd pfd = {
+    .fd = workers_main.fd,
+    .events = POLLIN
+  };
+
+  waiter_prepare (&workers_main);
+  if (! workers_have_output ())
+    (void) poll (&pfd,
+                 1,
+                 1);
+  waiter_done (&workers_main);
+}
+
+
+/**
+ * Hand frame to the worker responsible for its flow, together with
+ * its descriptor, so that the frame is only parsed once.
+ *
+ * @param interface interface the frame was received on
+ * @param frame the frame
+ * @param frame_size number of bytes in @a frame
+ */
+static void
+workers_dispatch (uint16_t interface,
+                  const char *frame,
+                  uint16_t frame_size)
+{
+  struct GLAB_Frame f;
+  struct Worker *w;
+  int described = (frame_size <= WORKER_DESCRIBED_MAX);
+
+  loop_parse_frame (&f,
+                    interface,
+                    frame,
+                    frame_size);
+  w = &workers[workers_flow_hash (&f) % num_workers];
+  while (0 != ring_push (&w->in,
+                         described ? interface : (interface | WORKER_UNPARSED),
+                         described ? &f : NULL,
+                         described ? sizeof (f) : 0,
+                         frame,
+                         frame_size))
+    {
+      /* worker is behind; it may be waiting for us to take output */
+      workers_collect ();
+      workers_wait ();
+    }
+  w->pushed++;
+}
+
+
+/**
+ * Wait until all workers have handled every frame given to them and
+ * collect their output.  Afterwards the main thread may run handlers
+ * without racing with them (workers only wake up for new frames).
+ */
+static void
+workers_quiesce ()
+{
+  for (unsigned int i=0;i<num_workers;i++)
+    while (atomic_load (&workers[i].done) != workers[i].pushed)
+      {
+        workers_collect ();
+        workers_wait ();
+      }
+  workers_collect ();
+}
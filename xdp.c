@@ -0,0 +1,490 @@
+/*
+     This file (was) part of GNUnet.
+     Copyright (C) 2018 Christian Grothoff
+
+     GNUnet is free software: you can redistribute it and/or modify it
+     under the terms of the GNU Affero General Public License as published
+     by the Free Software Foundation, either version 3 of the License,
+     or (at your option) any later version.
+
+     GNUnet is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Affero General Public License for more details.
+
+     You should have received a copy of the GNU Affero General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file xdp.c
+ * @brief Optional XDP fast path for network-driver.  The child
+ *        mirrors its learned MAC table into a BPF hash map
+ *        (via #GLAB_TYPE_FDB_UPDATE messages), and an XDP program
+ *        on each interface redirects known unicast frames straight
+ *        to the egress interface.  Broadcast, multicast, unknown
+ *        destinations and frames from stations that are not (or no
+ *        longer) known on the ingress port still go to the child.
+ *
+ * The program is assembled by hand, so we need neither clang nor
+ * libbpf.  We attach in generic (SKB) mode, which works on any
+ * device including veth pairs.
+ */
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+
+
+/**
+ * Maximum number of MACs we mirror into the kernel.
+ */
+#define XDP_FDB_SIZE 65536
+
+/**
+ * Maximum number of interfaces we can redirect to.
+ */
+#define XDP_MAX_PORTS 256
+
+
+/**
+ * Value in the FDB map, indexed by the destination MAC
+ * (zero-padded to 8 bytes).
+ */
+struct XdpFdbValue
+{
+  /**
+   * Index into the port map, interface number minus one.
+   */
+  uint32_t port;
+
+  /**
+   * Kernel interface index of @e port, to detect hairpins and moves.
+   */
+  uint32_t ifindex;
+};
+
+
+/**
+ * BPF hash map from MAC to `struct XdpFdbValue`, -1 if offload is off.
+ */
+static int xdp_fdb_fd = -1;
+
+/**
+ * BPF device map from port to kernel interface index.
+ */
+static int xdp_ports_fd = -1;
+
+/**
+ * The XDP program.
+ */
+static int xdp_prog_fd = -1;
+
+
+#define BPF_INSN(CODE, DST, SRC, OFF, IMM)          \
+  ((struct bpf_insn) { .code = (CODE), .dst_reg = (DST), \
+                       .src_reg = (SRC), .off = (OFF), .imm = (IMM) })
+#define BPF_MOV64_REG(DST, SRC) \
+  BPF_INSN (BPF_ALU64 | BPF_MOV | BPF_X, DST, SRC, 0, 0)
+#define BPF_MOV64_IMM(DST, IMM) \
+  BPF_INSN (BPF_ALU64 | BPF_MOV | BPF_K, DST, 0, 0, IMM)
+#define BPF_ALU64_IMM(OP, DST, IMM) \
+  BPF_INSN (BPF_ALU64 | (OP) | BPF_K, DST, 0, 0, IMM)
+#define BPF_LDX_MEM(SIZE, DST, SRC, OFF) \
+  BPF_INSN (BPF_LDX | (SIZE) | BPF_MEM, DST, SRC, OFF, 0)
+#define BPF_STX_MEM(SIZE, DST, SRC, OFF) \
+  BPF_INSN (BPF_STX | (SIZE) | BPF_MEM, DST, SRC, OFF, 0)
+#define BPF_ST_MEM(SIZE, DST, OFF, IMM) \
+  BPF_INSN (BPF_ST | (SIZE) | BPF_MEM, DST, 0, OFF, IMM)
+#define BPF_JMP_REG(OP, DST, SRC, OFF) \
+  BPF_INSN (BPF_JMP | (OP) | BPF_X, DST, SRC, OFF, 0)
+#define BPF_JMP_IMM(OP, DST, IMM, OFF) \
+  BPF_INSN (BPF_JMP | (OP) | BPF_K, DST, 0, OFF, IMM)
+#define BPF_CALL_FUNC(FUNC) \
+  BPF_INSN (BPF_JMP | BPF_CALL, 0, 0, 0, FUNC)
+#define BPF_EXIT_INSN() \
+  BPF_INSN (BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+
+/**
+ * Invoke the bpf() system call.
+ */
+static int
+bpf_sys (int cmd,
+         union bpf_attr *attr)
+{
+  return syscall (__NR_bpf,
+                  cmd,
+                  attr,
+                  sizeof (*attr));
+}
+
+
+/**
+ * Assembler state for building the XDP program.
+ */
+struct XdpAsm
+{
+  struct bpf_insn insn[96];
+
+  /**
+   * Instructions that jump to the "pass to userspace" label.
+   */
+  unsigned int pass_jumps[8];
+
+  unsigned int pc;
+
+  unsigned int num_pass_jumps;
+};
+
+
+static void
+emit (struct XdpAsm *a,
+      struct bpf_insn insn)
+{
+  if (a->pc == sizeof (a->insn) / sizeof (a->insn[0]))
+    abort ();
+  a->insn[a->pc++] = insn;
+}
+
+
+/**
+ * Emit conditional jump to the "pass" label (patched later).
+ */
+static void
+emit_pass_jump (struct XdpAsm *a,
+                struct bpf_insn insn)
+{
+  if (a->num_pass_jumps == sizeof (a->pass_jumps) / sizeof (a->pass_jumps[0]))
+    abort ();
+  a->pass_jumps[a->num_pass_jumps++] = a->pc;
+  emit (a,
+        insn);
+}
+
+
+/**
+ * Emit 64-bit immediate load of map @a fd into register @a dst.
+ */
+static void
+emit_map_fd (struct XdpAsm *a,
+             int dst,
+             int fd)
+{
+  emit (a,
+        BPF_INSN (BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd));
+  emit (a,
+        BPF_INSN (0, 0, 0, 0, 0));
+}
+
+
+/**
+ * Emit FDB lookup for the MAC at stack offset @a key_off, continuing
+ * only if the entry exists, leaving the value pointer in r0 and the
+ * entry's interface index in r2 and the ingress index in r3.
+ */
+static void
+emit_fdb_lookup (struct XdpAsm *a,
+                 int key_off)
+{
+  emit_map_fd (a, BPF_REG_1, xdp_fdb_fd);
+  emit (a, BPF_MOV64_REG (BPF_REG_2, BPF_REG_10));
+  emit (a, BPF_ALU64_IMM (BPF_ADD, BPF_REG_2, key_off));
+  emit (a, BPF_CALL_FUNC (BPF_FUNC_map_lookup_elem));
+  emit_pass_jump (a, BPF_JMP_IMM (BPF_JEQ, BPF_REG_0, 0, 0));
+  emit (a, BPF_LDX_MEM (BPF_W, BPF_REG_2, BPF_REG_0,
+                        offsetof (struct XdpFdbValue, ifindex)));
+  emit (a, BPF_LDX_MEM (BPF_W, BPF_REG_3, BPF_REG_6,
+                        offsetof (struct xdp_md, ingress_ifindex)));
+}
+
+
+/**
+ * Assemble the XDP program into @a a.  Equivalent C:
+ *
+ *   if (data + 12 > data_end || (dst[0] & 1)) return XDP_PASS;
+ *   s = fdb[src]; if (!s || s->ifindex != ingress) return XDP_PASS;
+ *   d = fdb[dst]; if (!d || d->ifindex == ingress) return XDP_PASS;
+ *   return bpf_redirect_map (&ports, d->port, XDP_PASS);
+ */
+static void
+xdp_assemble (struct XdpAsm *a)
+{
+  memset (a,
+          0,
+          sizeof (*a));
+  emit (a, BPF_MOV64_REG (BPF_REG_6, BPF_REG_1));
+  emit (a, BPF_LDX_MEM (BPF_W, BPF_REG_2, BPF_REG_6,
+                        offsetof (struct xdp_md, data)));
+  emit (a, BPF_LDX_MEM (BPF_W, BPF_REG_3, BPF_REG_6,
+                        offsetof (struct xdp_md, data_end)));
+  emit (a, BPF_MOV64_REG (BPF_REG_4, BPF_REG_2));
+  emit (a, BPF_ALU64_IMM (BPF_ADD, BPF_REG_4, 2 * MAC_ADDR_SIZE));
+  emit_pass_jump (a, BPF_JMP_REG (BPF_JGT, BPF_REG_4, BPF_REG_3, 0));
+  /* group (broadcast/multicast) destinations always go to the child */
+  emit (a, BPF_LDX_MEM (BPF_B, BPF_REG_4, BPF_REG_2, 0));
+  emit (a, BPF_ALU64_IMM (BPF_AND, BPF_REG_4, 1));
+  emit_pass_jump (a, BPF_JMP_IMM (BPF_JNE, BPF_REG_4, 0, 0));
+  /* keys: destination at fp-8, source at fp-16, zero-padded */
+  emit (a, BPF_ST_MEM (BPF_DW, BPF_REG_10, -8, 0));
+  emit (a, BPF_ST_MEM (BPF_DW, BPF_REG_10, -16, 0));
+  for (int i = 0; i < MAC_ADDR_SIZE; i++)
+  {
+    emit (a, BPF_LDX_MEM (BPF_B, BPF_REG_4, BPF_REG_2, i));
+    emit (a, BPF_STX_MEM (BPF_B, BPF_REG_10, BPF_REG_4, -8 + i));
+    emit (a, BPF_LDX_MEM (BPF_B, BPF_REG_4, BPF_REG_2, MAC_ADDR_SIZE + i));
+    emit (a, BPF_STX_MEM (BPF_B, BPF_REG_10, BPF_REG_4, -16 + i));
+  }
+  /* unknown or moved source: learning event for the child */
+  emit_fdb_lookup (a, -16);
+  emit_pass_jump (a, BPF_JMP_REG (BPF_JNE, BPF_REG_2, BPF_REG_3, 0));
+  /* unknown destination (flood) or hairpin: child decides */
+  emit_fdb_lookup (a, -8);
+  emit_pass_jump (a, BPF_JMP_REG (BPF_JEQ, BPF_REG_2, BPF_REG_3, 0));
+  emit (a, BPF_LDX_MEM (BPF_W, BPF_REG_2, BPF_REG_0,
+                        offsetof (struct XdpFdbValue, port)));
+  emit_map_fd (a, BPF_REG_1, xdp_ports_fd);
+  emit (a, BPF_MOV64_IMM (BPF_REG_3, XDP_PASS));
+  emit (a, BPF_CALL_FUNC (BPF_FUNC_redirect_map));
+  emit (a, BPF_EXIT_INSN ());
+  /* pass: */
+  for (unsigned int i = 0; i < a->num_pass_jumps; i++)
+    a->insn[a->pass_jumps[i]].off = a->pc - a->pass_jumps[i] - 1;
+  emit (a, BPF_MOV64_IMM (BPF_REG_0, XDP_PASS));
+  emit (a, BPF_EXIT_INSN ());
+}
+
+
+/**
+ * Create a BPF map.
+ *
+ * @return map file descriptor, -1 on error
+ */
+static int
+xdp_create_map (uint32_t map_type,
+                uint32_t key_size,
+                uint32_t value_size,
+                uint32_t max_entries)
+{
+  union bpf_attr attr;
+
+  memset (&attr,
+          0,
+          sizeof (attr));
+  attr.map_type = map_type;
+  attr.key_size = key_size;
+  attr.value_size = value_size;
+  attr.max_entries = max_entries;
+  return bpf_sys (BPF_MAP_CREATE,
+                  &attr);
+}
+
+
+/**
+ * Load the XDP program, printing the verifier log on failure.
+ *
+ * @return program file descriptor, -1 on error
+ */
+static int
+xdp_load_program (void)
+{
+  static char log[65536];
+  struct XdpAsm a;
+  union bpf_attr attr;
+  int fd;
+
+  xdp_assemble (&a);
+  memset (&attr,
+          0,
+          sizeof (attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uintptr_t) a.insn;
+  attr.insn_cnt = a.pc;
+  attr.license = (uintptr_t) "GPL";
+  attr.log_buf = (uintptr_t) log;
+  attr.log_size = sizeof (log);
+  attr.log_level = 1;
+  log[0] = '\0';
+  fd = bpf_sys (BPF_PROG_LOAD,
+                &attr);
+  if (-1 == fd)
+    fprintf (stderr,
+             "Failed to load XDP program: %s\n%s",
+             strerror (errno),
+             log);
+  return fd;
+}
+
+
+/**
+ * Release all XDP resources.  Closing the link file descriptors
+ * (which happens implicitly on exit) detaches the program.
+ */
+static void
+xdp_done (void)
+{
+  if (-1 != xdp_prog_fd)
+    close (xdp_prog_fd);
+  if (-1 != xdp_ports_fd)
+    close (xdp_ports_fd);
+  if (-1 != xdp_fdb_fd)
+    close (xdp_fdb_fd);
+  xdp_prog_fd = -1;
+  xdp_ports_fd = -1;
+  xdp_fdb_fd = -1;
+}
+
+
+/**
+ * Set up the XDP fast path on all interfaces.  Must be called
+ * before we drop privileges.  On failure, the driver continues
+ * without offload and simply ignores FDB updates from the child.
+ *
+ * @param gifc array of interfaces
+ * @param gifc_len length of @a gifc
+ * @return 0 on success
+ */
+static int
+xdp_init (struct Interface *gifc,
+          unsigned int gifc_len)
+{
+  if (gifc_len > XDP_MAX_PORTS)
+    {
+      fprintf (stderr,
+               "XDP offload supports at most %u interfaces\n",
+               XDP_MAX_PORTS);
+      return -1;
+    }
+  xdp_fdb_fd = xdp_create_map (BPF_MAP_TYPE_HASH,
+                               sizeof (uint64_t),
+                               sizeof (struct XdpFdbValue),
+                               XDP_FDB_SIZE);
+  xdp_ports_fd = xdp_create_map (BPF_MAP_TYPE_DEVMAP,
+                                 sizeof (uint32_t),
+                                 sizeof (uint32_t),
+                                 XDP_MAX_PORTS);
+  if ( (-1 == xdp_fdb_fd) ||
+       (-1 == xdp_ports_fd) )
+    {
+      fprintf (stderr,
+               "Failed to create BPF maps: %s\n",
+               strerror (errno));
+      xdp_done ();
+      return -1;
+    }
+  xdp_prog_fd = xdp_load_program ();
+  if (-1 == xdp_prog_fd)
+    {
+      xdp_done ();
+      return -1;
+    }
+  for (unsigned int i=0;i<gifc_len;i++)
+    {
+      uint32_t port = i;
+      uint32_t ifindex = gifc[i].if_idx.ifr_ifindex;
+      union bpf_attr attr;
+
+      memset (&attr,
+              0,
+              sizeof (attr));
+      attr.map_fd = xdp_ports_fd;
+      attr.key = (uintptr_t) &port;
+      attr.value = (uintptr_t) &ifindex;
+      if (0 != bpf_sys (BPF_MAP_UPDATE_ELEM,
+                        &attr))
+        {
+          fprintf (stderr,
+                   "Failed to add `%s' to BPF port map: %s\n",
+                   gifc[i].if_idx.ifr_name,
+                   strerror (errno));
+          xdp_done ();
+          return -1;
+        }
+      memset (&attr,
+              0,
+              sizeof (attr));
+      attr.link_create.prog_fd = xdp_prog_fd;
+      attr.link_create.target_ifindex = ifindex;
+      attr.link_create.attach_type = BPF_XDP;
+      attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+      if (-1 == bpf_sys (BPF_LINK_CREATE,
+                         &attr))
+        {
+          fprintf (stderr,
+                   "Failed to attach XDP program to `%s': %s\n",
+                   gifc[i].if_idx.ifr_name,
+                   strerror (errno));
+          xdp_done ();
+          return -1;
+        }
+      /* we deliberately leak the link FD, it lives as long as we do */
+    }
+  return 0;
+}
+
+
+/**
+ * Apply FDB update from the child to the BPF map.
+ *
+ * @param gifc array of interfaces
+ * @param gifc_len length of @a gifc
+ * @param msg the message, of type #GLAB_TYPE_FDB_UPDATE
+ * @param msg_size number of bytes in @a msg
+ */
+static void
+xdp_handle_fdb_update (struct Interface *gifc,
+                       unsigned int gifc_len,
+                       const void *msg,
+                       size_t msg_size)
+{
+  struct GLAB_FdbUpdate fu;
+  union bpf_attr attr;
+  uint64_t key = 0;
+  struct XdpFdbValue value;
+  uint16_t ifc_num;
+
+  if (-1 == xdp_fdb_fd)
+    return; /* offload not active */
+  if (msg_size != sizeof (fu))
+    {
+      fprintf (stderr,
+               "Malformed FDB update from child\n");
+      return;
+    }
+  memcpy (&fu,
+          msg,
+          sizeof (fu));
+  ifc_num = ntohs (fu.ifc_num);
+  if (ifc_num > gifc_len)
+    {
+      fprintf (stderr,
+               "Invalid interface %u in FDB update\n",
+               (unsigned int) ifc_num);
+      return;
+    }
+  memcpy (&key,
+          &fu.mac,
+          sizeof (struct MacAddress));
+  memset (&attr,
+          0,
+          sizeof (attr));
+  attr.map_fd = xdp_fdb_fd;
+  attr.key = (uintptr_t) &key;
+  if (0 == ifc_num)
+    {
+      (void) bpf_sys (BPF_MAP_DELETE_ELEM,
+                      &attr);
+      return;
+    }
+  value.port = ifc_num - 1;
+  value.ifindex = gifc[ifc_num - 1].if_idx.ifr_ifindex;
+  attr.value = (uintptr_t) &value;
+  if (0 != bpf_sys (BPF_MAP_UPDATE_ELEM,
+                    &attr))
+    {
+#if DEBUG
+      fprintf (stderr,
+               "Failed to update BPF FDB: %s\n",
+               strerror (errno));
+#endif
+    }
+}